@@ -17,16 +17,95 @@ static _Bool is_decimal(const char c);
 static _Bool is_hexadecimal(const char c);
 static _Bool is_alphabet_char(const char c);
 static u8 make_byte(const u8 c1, const u8 c2, const u8 c3);
-static inline unsigned long partial_name_hash(unsigned long c,
-					      unsigned long prevhash);
-static inline unsigned int full_name_hash(const unsigned char *name,
-					  unsigned int len);
-static void *alloc_element(const unsigned int size);
 static int path_depth(const char *pathname);
 static int const_part_length(const char *filename);
 static int domainname_compare(const void *a, const void *b);
 static int path_info_compare(const void *a, const void *b);
-static void sort_domain_policy(struct domain_policy *dp);
+static int read_name_list(FILE *fp, const struct path_info ***list);
+static _Bool save_proc_diff(const char *src, const char *base,
+			    const char *dest, FILE *file_fp);
+static u64 store_hash(const char *data, const size_t len);
+static void store_chunk_id(char id[33], const char *data, const size_t len);
+static _Bool store_file(const char *path, const char *data, const size_t len);
+static void store_chunk(struct policy_store *store, const size_t len);
+static _Bool is_store_boundary(const struct policy_store *store,
+			       const char *line, const size_t len);
+static ssize_t store_write(void *cookie, const char *data, size_t size);
+static int store_close(void *cookie);
+static _Bool is_same_manifest(const char *path, const char *manifest,
+			      const size_t len);
+static _Bool save_domain_policy_to_stream(struct domain_policy *dp,
+					  struct domain_policy *bp,
+					  const char *proc, const char *base,
+					  FILE *diff_fp);
+static void reserve_pattern_work(const unsigned int max_ops);
+static int char_length(const char *str);
+static unsigned int compile_segment(struct pattern_op *op,
+				    const char *pattern,
+				    const char *pattern_end);
+static unsigned int compile_component(struct pattern_op *op,
+				      struct pattern_component *component,
+				      unsigned int *max_ops,
+				      const char *pattern,
+				      const char *pattern_end);
+static _Bool segment_matches(const char *filename, const int len,
+			     const struct pattern_op *op, const unsigned int ops);
+static _Bool component_matches(const char *filename, const int len,
+			       const struct pattern_op *op,
+			       const unsigned int segments);
+static struct pattern_program *compile_pattern(const char *pattern,
+					       struct memory_arena *arena);
+static _Bool program_matches(const char *f,
+			     const struct pattern_program *program);
+static _Bool is_interned(const struct path_info *ptr);
+static void savename_stats(void);
+static int pattern_index_child(const struct pattern_index *index,
+			       const int parent, const u8 c);
+static void pattern_index_add_edge(struct pattern_index *index,
+				   const int parent, const u8 c,
+				   const int child);
+static int pattern_index_new_node(struct pattern_index *index);
+static int pattern_index_lookup(const struct pattern_index *index,
+				const struct path_info *pathname,
+				const _Bool use_pattern);
+static const struct path_info *intern_name(const char *name, const int len,
+					   const u32 hash,
+					   const struct path_info *info);
+static u32 transition_rule_hash(const struct path_info *program,
+				const struct path_info *domainname,
+				const _Bool is_last_name);
+static struct transition_rule_slot *
+find_transition_rule(const struct transition_rule_index *index,
+		     const struct path_info *program,
+		     const struct path_info *domainname,
+		     const _Bool is_last_name);
+static _Bool check_transition_rule(const struct transition_rule_index *index,
+				   const struct path_info *program,
+				   const struct path_info *domainname,
+				   const _Bool is_last_name, int *found);
+static void resize_chunk_slots(struct policy_chunk *chunk);
+static unsigned int chunk_name_id(struct policy_chunk *chunk,
+				  const char *name);
+static void add_chunk_op(struct policy_chunk *chunk, const u8 type,
+			 const unsigned int value);
+static void parse_policy_line(struct policy_chunk *chunk, char *line);
+static void *parse_policy_chunk(void *arg);
+static const char *find_chunk_start(const char *start, const char *cp,
+				    const char *end);
+static void merge_policy_chunk(struct domain_policy *dp,
+			       struct policy_chunk *chunk);
+static _Bool read_domain_policy_parallel(struct domain_policy *dp, FILE *fp);
+static u64 snapshot_checksum(const char *data, const u64 len);
+static void stat_snapshot_source(struct snapshot_source *source,
+				 const char *filename);
+static _Bool snapshot_table_ok(const u64 offset, const u64 count,
+			       const u64 size, const u64 len);
+static u32 snapshot_string_index(struct name_map *map,
+				 const struct path_info ***string,
+				 u32 *count, u64 *data_size,
+				 const struct path_info *name);
+static _Bool snapshot_ok(const char *buf, const u64 len, const char *base,
+			 const char *src);
 
 /* Utility functions */
 
@@ -74,23 +153,92 @@ static u8 make_byte(const u8 c1, const u8 c2, const u8 c3)
 	return ((c1 - '0') << 6) + ((c2 - '0') << 3) + (c3 - '0');
 }
 
-void normalize_line(unsigned char *line)
+const u8 char_class[256] = {
+	[0]           = CHAR_SPACE,
+	[1 ... 8]     = CHAR_SPACE | CHAR_ILLEGAL,
+	['\t']        = CHAR_SPACE,
+	[10 ... 12]   = CHAR_SPACE | CHAR_ILLEGAL,
+	['\r']        = CHAR_SPACE,
+	[14 ... 31]   = CHAR_SPACE | CHAR_ILLEGAL,
+	[' ']         = CHAR_SPACE,
+	['!' ... '['] = CHAR_PLAIN,
+	[']' ... '~'] = CHAR_PLAIN,
+	[127 ... 255] = CHAR_SPACE | CHAR_ILLEGAL,
+};
+
+#define WORD_ONES  0x0101010101010101ULL
+#define WORD_HIGHS 0x8080808080808080ULL
+
+/* Returns true if every byte in @word is within @lo .. @hi, 0 < @lo < 128. */
+static inline _Bool word_in_range(const u64 word, const u8 lo, const u8 hi)
+{
+	return !((((word - WORD_ONES * lo) & ~word) |
+		  (word + WORD_ONES * (127 - hi)) | word) & WORD_HIGHS);
+}
+
+/* Returns true if a byte in @word is @c. */
+static inline _Bool word_has_byte(const u64 word, const u8 c)
+{
+	const u64 x = word ^ (WORD_ONES * c);
+	return ((x - WORD_ONES) & ~x & WORD_HIGHS) != 0;
+}
+
+/**
+ * skip_plain_chars - Skip bytes which have CHAR_PLAIN.
+ *
+ * @str: Start of bytes.
+ * @end: End of bytes.
+ *
+ * Returns pointer to the first byte which needs a closer look, or @end.
+ * Eight bytes are tested at a time.
+ */
+const char *skip_plain_chars(const char *str, const char *end)
+{
+	while (end - str >= 8) {
+		u64 word;
+		memcpy(&word, str, sizeof(word));
+		if (!word_in_range(word, '!', '~') || word_has_byte(word, '\\'))
+			break;
+		str += 8;
+	}
+	while (str < end && (char_class[(u8) *str] & CHAR_PLAIN))
+		str++;
+	return str;
+}
+
+/* Same as skip_plain_chars(), but for ' ' .. '~'. */
+const char *skip_printable_chars(const char *str, const char *end)
+{
+	while (end - str >= 8) {
+		u64 word;
+		memcpy(&word, str, sizeof(word));
+		if (!word_in_range(word, ' ', '~'))
+			break;
+		str += 8;
+	}
+	while (str < end && *str >= ' ' && *str <= '~')
+		str++;
+	return str;
+}
+
+int normalize_line(unsigned char *line)
 {
 	unsigned char *sp = line;
 	unsigned char *dp = line;
 	_Bool first = true;
-	while (*sp && (*sp <= ' ' || 127 <= *sp))
+	while (*sp && (char_class[*sp] & CHAR_SPACE))
 		sp++;
 	while (*sp) {
 		if (!first)
 			*dp++ = ' ';
 		first = false;
-		while (' ' < *sp && *sp < 127)
+		while (!(char_class[*sp] & CHAR_SPACE))
 			*dp++ = *sp++;
-		while (*sp && (*sp <= ' ' || 127 <= *sp))
+		while (*sp && (char_class[*sp] & CHAR_SPACE))
 			sp++;
 	}
 	*dp = '\0';
+	return dp - line;
 }
 
 char *make_filename(const char *prefix, const time_t time)
@@ -105,49 +253,79 @@ char *make_filename(const char *prefix, const time_t time)
 	return filename;
 }
 
-/* Copied from kernel source. */
-static inline unsigned long partial_name_hash(unsigned long c,
-					      unsigned long prevhash)
+/* Memory blocks are aligned so that any structure can be put there. */
+#define ARENA_ALIGN(size) (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+static struct memory_block *alloc_memory_block(const size_t size)
 {
-	return (prevhash + (c << 4) + (c >> 4)) * 11;
+	struct memory_block *block = malloc(ARENA_ALIGN(sizeof(*block)) + size);
+	if (!block)
+		out_of_memory();
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	return block;
 }
 
-/* Copied from kernel source. */
-static inline unsigned int full_name_hash(const unsigned char *name,
-					  unsigned int len)
+/**
+ * arena_alloc - Allocate memory which is released by arena_reset().
+ *
+ * @arena: Pointer to "struct memory_arena".
+ * @size:  Size in bytes.
+ *
+ * Returns pointer to allocated memory. The memory is not zero-cleared.
+ * Never returns NULL.
+ *
+ * Elements larger than a quarter of ARENA_BLOCK_SIZE get a block of their
+ * own so that the remainder of the current block is not wasted.
+ */
+void *arena_alloc(struct memory_arena *arena, const size_t size)
 {
-	unsigned long hash = 0;
-	while (len--)
-		hash = partial_name_hash(*name++, hash);
-	return (unsigned int) hash;
+	const size_t len = ARENA_ALIGN(size);
+	struct memory_block *block = arena->block;
+	char *ptr;
+	if (len > ARENA_BLOCK_SIZE / 4) {
+		block = alloc_memory_block(len);
+		block->next = arena->large;
+		arena->large = block;
+	} else if (!block || block->used + len > block->size) {
+		block = alloc_memory_block(ARENA_BLOCK_SIZE);
+		block->next = arena->block;
+		arena->block = block;
+	}
+	ptr = ((char *) block) + ARENA_ALIGN(sizeof(*block)) + block->used;
+	block->used += len;
+	return ptr;
 }
 
-static void *alloc_element(const unsigned int size)
+/**
+ * arena_reset - Release all memory allocated by arena_alloc().
+ *
+ * @arena: Pointer to "struct memory_arena".
+ *
+ * One block is kept for reuse by the next generation.
+ */
+void arena_reset(struct memory_arena *arena)
 {
-	static char *buf = NULL;
-	static unsigned int buf_used_len = PAGE_SIZE;
-	char *ptr = NULL;
-	if (size > PAGE_SIZE)
-		return NULL;
-	if (buf_used_len + size > PAGE_SIZE) {
-		ptr = malloc(PAGE_SIZE);
-		if (!ptr)
-			out_of_memory();
-		buf = ptr;
-		memset(buf, 0, PAGE_SIZE);
-		buf_used_len = size;
-		ptr = buf;
-	} else if (size) {
-		int i;
-		ptr = buf + buf_used_len;
-		buf_used_len += size;
-		for (i = 0; i < size; i++)
-			if (ptr[i])
-				out_of_memory();
+	struct memory_block *block = arena->block;
+	while (arena->large) {
+		struct memory_block *next = arena->large->next;
+		free(arena->large);
+		arena->large = next;
+	}
+	if (block) {
+		while (block->next) {
+			struct memory_block *next = block->next->next;
+			free(block->next);
+			block->next = next;
+		}
+		block->used = 0;
 	}
-	return ptr;
 }
 
+/* Memory for names interned by savename() and their compiled patterns. */
+static struct memory_arena name_arena = { NULL, NULL };
+
 static int path_depth(const char *pathname)
 {
 	int i = 0;
@@ -168,6 +346,12 @@ static int const_part_length(const char *filename)
 {
 	int len = 0;
 	if (filename) {
+		/* Most names have no '\\' at all. */
+		const char *cp = strchr(filename, '\\');
+		if (!cp)
+			return strlen(filename);
+		len = cp - filename;
+		filename = cp;
 		while (true) {
 			char c = *filename++;
 			if (!c)
@@ -209,18 +393,24 @@ _Bool is_domain_def(const unsigned char *domainname)
 
 _Bool is_correct_domain(const unsigned char *domainname)
 {
+	const char *end;
 	if (!domainname || strncmp(domainname, ROOT_NAME, ROOT_NAME_LEN))
 		goto out;
 	domainname += ROOT_NAME_LEN;
 	if (!*domainname)
 		return true;
+	end = (const char *) domainname + strlen((const char *) domainname);
 	do {
 		if (*domainname++ != ' ')
 			goto out;
 		if (*domainname++ != '/')
 			goto out;
 		while (true) {
-			unsigned char c = *domainname;
+			unsigned char c;
+			domainname = (const unsigned char *)
+				skip_plain_chars((const char *) domainname,
+						 end);
+			c = *domainname;
 			if (!c || c == ' ')
 				break;
 			domainname++;
@@ -323,9 +513,11 @@ _Bool is_correct_path(const char *filename, const s8 start_type,
 		     const s8 pattern_type, const s8 end_type)
 {
 	_Bool contains_pattern = false;
+	const char *end;
 	unsigned char c;
 	if (!filename)
 		goto out;
+	end = filename + strlen(filename);
 	c = *filename;
 	if (start_type == 1) { /* Must start with '/' */
 		if (c != '/')
@@ -335,7 +527,7 @@ _Bool is_correct_path(const char *filename, const s8 start_type,
 			goto out;
 	}
 	if (c)
-		c = *(strchr(filename, '\0') - 1);
+		c = *(end - 1);
 	if (end_type == 1) { /* Must end with '/' */
 		if (c != '/')
 			goto out;
@@ -344,6 +536,7 @@ _Bool is_correct_path(const char *filename, const s8 start_type,
 			goto out;
 	}
 	while (true) {
+		filename = skip_plain_chars(filename, end);
 		c = *filename++;
 		if (!c)
 			break;
@@ -396,139 +589,384 @@ out:
 	return false;
 }
 
-static _Bool file_matches_pattern2(const char *filename,
-				  const char *filename_end,
-				  const char *pattern, const char *pattern_end)
+/* The longest instruction ("\ooo") consumes 4 characters of a filename. */
+#define PATTERN_ROWS 5
+
+/* Per thread, for checkpolicy checks policy on all CPUs. */
+static __thread u8 *pattern_work = NULL;
+static __thread unsigned int pattern_work_size = 0;
+
+static void reserve_pattern_work(const unsigned int max_ops)
+{
+	if (max_ops * PATTERN_ROWS <= pattern_work_size)
+		return;
+	pattern_work_size = max_ops * PATTERN_ROWS;
+	pattern_work = realloc(pattern_work, pattern_work_size);
+	if (!pattern_work)
+		out_of_memory();
+}
+
+/* Returns the length of the character at @str, 0 if it is a bad escape. */
+static int char_length(const char *str)
+{
+	if (*str != '\\')
+		return 1;
+	if (str[1] == '\\')
+		return 2;
+	if (is_byte_range(str + 1))
+		return 4;
+	return 0;
+}
+
+/*
+ * Compile a segment between @pattern and @pattern_end into @op.
+ * Returns the number of instructions, including PATTERN_OP_END.
+ */
+static unsigned int compile_segment(struct pattern_op *op,
+				    const char *pattern,
+				    const char *pattern_end)
 {
-	while (filename < filename_end && pattern < pattern_end) {
-		char c;
+	unsigned int len = 0;
+	while (pattern < pattern_end) {
+		struct pattern_op *ptr = &op[len++];
+		memset(ptr, 0, sizeof(*ptr));
 		if (*pattern != '\\') {
-			if (*filename++ != *pattern++)
-				return false;
+			ptr->type = PATTERN_OP_CHAR;
+			ptr->c[0] = *pattern++;
 			continue;
 		}
-		c = *filename;
-		pattern++;
-		switch (*pattern) {
-			int i;
-			int j;
-		case '?':
-			if (c == '/') {
-				return false;
-			} else if (c == '\\') {
-				if (filename[1] == '\\')
-					filename++;
-				else if (is_byte_range(filename + 1))
-					filename += 3;
-				else
-					return false;
-			}
-			break;
+		if (pattern + 1 == pattern_end)
+			goto bad_pattern;
+		switch (pattern[1]) {
 		case '\\':
-			if (c != '\\')
-				return false;
-			if (*++filename != '\\')
-				return false;
+			ptr->type = PATTERN_OP_BACKSLASH;
+			break;
+		case '?':
+			ptr->type = PATTERN_OP_ANY;
 			break;
 		case '+':
-			if (!is_decimal(c))
-				return false;
+			ptr->type = PATTERN_OP_DECIMAL;
 			break;
 		case 'x':
-			if (!is_hexadecimal(c))
-				return false;
+			ptr->type = PATTERN_OP_HEXADECIMAL;
 			break;
 		case 'a':
-			if (!is_alphabet_char(c))
-				return false;
+			ptr->type = PATTERN_OP_ALPHABET;
+			break;
+		case '*':
+			ptr->type = PATTERN_OP_STAR;
+			break;
+		case '@':
+			ptr->type = PATTERN_OP_STAR_NO_DOT;
+			break;
+		case '$':
+			ptr->type = PATTERN_OP_DECIMAL;
+			memset(&op[len], 0, sizeof(*op));
+			op[len++].type = PATTERN_OP_DECIMALS;
+			break;
+		case 'X':
+			ptr->type = PATTERN_OP_HEXADECIMAL;
+			memset(&op[len], 0, sizeof(*op));
+			op[len++].type = PATTERN_OP_HEXADECIMALS;
+			break;
+		case 'A':
+			ptr->type = PATTERN_OP_ALPHABET;
+			memset(&op[len], 0, sizeof(*op));
+			op[len++].type = PATTERN_OP_ALPHABETS;
 			break;
 		case '0':
 		case '1':
 		case '2':
 		case '3':
-			if (c == '\\' && is_byte_range(filename + 1)
-			    && !strncmp(filename + 1, pattern, 3)) {
-				filename += 3;
-				pattern += 2;
-				break;
-			}
-			return false; /* Not matched. */
-		case '*':
-		case '@':
-			for (i = 0; i <= filename_end - filename; i++) {
-				if (file_matches_pattern2(filename + i,
-							  filename_end,
-							  pattern + 1,
-							  pattern_end))
-					return true;
-				c = filename[i];
-				if (c == '.' && *pattern == '@')
-					break;
-				if (c != '\\')
-					continue;
-				if (filename[i + 1] == '\\')
-					i++;
-				else if (is_byte_range(filename + i + 1))
-					i += 3;
-				else
-					break; /* Bad pattern. */
-			}
-			return false; /* Not matched. */
+			if (pattern + 4 > pattern_end ||
+			    !is_byte_range(pattern + 1))
+				goto bad_pattern;
+			ptr->type = PATTERN_OP_OCTAL;
+			memmove(ptr->c, pattern + 1, 3);
+			pattern += 2;
+			break;
 		default:
-			j = 0;
-			c = *pattern;
-			if (c == '$') {
-				while (is_decimal(filename[j]))
-					j++;
-			} else if (c == 'X') {
-				while (is_hexadecimal(filename[j]))
-					j++;
-			} else if (c == 'A') {
-				while (is_alphabet_char(filename[j]))
-					j++;
-			}
-			for (i = 1; i <= j; i++) {
-				if (file_matches_pattern2(filename + i,
-							  filename_end,
-							  pattern + 1,
-							  pattern_end))
-					return true;
-			}
-			return false; /* Not matched or bad pattern. */
+			goto bad_pattern;
 		}
-		filename++;
-		pattern++;
-	}
-	while (*pattern == '\\' &&
-	       (*(pattern + 1) == '*' || *(pattern + 1) == '@'))
 		pattern += 2;
-	return filename == filename_end && pattern == pattern_end;
+	}
+	goto out;
+bad_pattern:
+	/* Nothing after this instruction can be reached. */
+	op[len - 1].type = PATTERN_OP_FAIL;
+out:
+	memset(&op[len], 0, sizeof(*op));
+	op[len++].type = PATTERN_OP_END;
+	return len;
 }
 
-_Bool file_matches_pattern(const char *filename, const char *filename_end,
-			  const char *pattern, const char *pattern_end)
+/*
+ * Compile a component between @pattern and @pattern_end into @op.
+ * @op needs room for 2 * (@pattern_end - @pattern) + 2 instructions.
+ * Returns the number of instructions.
+ */
+static unsigned int compile_component(struct pattern_op *op,
+				      struct pattern_component *component,
+				      unsigned int *max_ops,
+				      const char *pattern,
+				      const char *pattern_end)
 {
 	const char *pattern_start = pattern;
-	_Bool first = true;
-	_Bool result;
+	unsigned int len = 0;
+	unsigned int i;
+	component->start = pattern;
+	component->segments = 0;
 	while (pattern < pattern_end - 1) {
 		/* Split at "\-" pattern. */
 		if (*pattern++ != '\\' || *pattern++ != '-')
 			continue;
-		result = file_matches_pattern2(filename, filename_end,
-					       pattern_start, pattern - 2);
-		if (first)
-			result = !result;
-		if (result)
-			return false;
-		first = false;
+		i = compile_segment(op + len, pattern_start, pattern - 2);
+		if (i > *max_ops)
+			*max_ops = i;
+		len += i;
+		component->segments++;
 		pattern_start = pattern;
 	}
-	result = file_matches_pattern2(filename, filename_end,
-				       pattern_start, pattern_end);
-	return first ? result : !result;
+	i = compile_segment(op + len, pattern_start, pattern_end);
+	if (i > *max_ops)
+		*max_ops = i;
+	component->segments++;
+	return len + i;
+}
+
+static inline _Bool is_loop_op(const u8 type)
+{
+	return type == PATTERN_OP_STAR || type == PATTERN_OP_STAR_NO_DOT ||
+		type == PATTERN_OP_DECIMALS ||
+		type == PATTERN_OP_HEXADECIMALS ||
+		type == PATTERN_OP_ALPHABETS;
+}
+
+/* Mark @i and the instructions reachable from @i without consuming. */
+static inline void add_pattern_state(u8 *row, const struct pattern_op *op,
+				     unsigned int i)
+{
+	while (!row[i]) {
+		row[i] = 1;
+		if (!is_loop_op(op[i].type))
+			break;
+		i++;
+	}
+}
+
+/*
+ * Simulate all possible positions in the segment at once, so that
+ * the cost is proportional to the length of @filename times the length of
+ * the segment no matter how many "\*" it has.
+ */
+static _Bool segment_matches(const char *filename, const int len,
+			     const struct pattern_op *op, const unsigned int ops)
+{
+	const unsigned int width = ops + 1;
+	int last = 0;
+	int pos;
+	memset(pattern_work, 0, width * PATTERN_ROWS);
+	add_pattern_state(pattern_work, op, 0);
+	for (pos = 0; pos <= last; pos++) {
+		u8 *row = pattern_work + (pos % PATTERN_ROWS) * width;
+		const char c = filename[pos];
+		unsigned int i;
+		if (pos == len)
+			return row[ops];
+		for (i = 0; i < ops; i++) {
+			unsigned int next = i + 1;
+			int step = 0;
+			if (!row[i])
+				continue;
+			switch (op[i].type) {
+			case PATTERN_OP_CHAR:
+				if (c == op[i].c[0])
+					step = 1;
+				break;
+			case PATTERN_OP_BACKSLASH:
+				if (c == '\\' && filename[pos + 1] == '\\')
+					step = 2;
+				break;
+			case PATTERN_OP_OCTAL:
+				if (c == '\\' &&
+				    !strncmp(filename + pos + 1, op[i].c, 3))
+					step = 4;
+				break;
+			case PATTERN_OP_ANY:
+				if (c != '/')
+					step = char_length(filename + pos);
+				break;
+			case PATTERN_OP_DECIMALS:
+				next = i;
+				/* fall through */
+			case PATTERN_OP_DECIMAL:
+				if (is_decimal(c))
+					step = 1;
+				break;
+			case PATTERN_OP_HEXADECIMALS:
+				next = i;
+				/* fall through */
+			case PATTERN_OP_HEXADECIMAL:
+				if (is_hexadecimal(c))
+					step = 1;
+				break;
+			case PATTERN_OP_ALPHABETS:
+				next = i;
+				/* fall through */
+			case PATTERN_OP_ALPHABET:
+				if (is_alphabet_char(c))
+					step = 1;
+				break;
+			case PATTERN_OP_STAR_NO_DOT:
+				if (c == '.')
+					break;
+				/* fall through */
+			case PATTERN_OP_STAR:
+				next = i;
+				step = char_length(filename + pos);
+				break;
+			}
+			if (!step || pos + step > len)
+				continue;
+			add_pattern_state(pattern_work + ((pos + step) %
+							  PATTERN_ROWS) * width,
+					  op, next);
+			if (pos + step > last)
+				last = pos + step;
+		}
+		memset(row, 0, width);
+	}
+	return false;
+}
+
+/*
+ * The first segment must match and none of the "\-" separated segments
+ * that follow may match.
+ */
+static _Bool component_matches(const char *filename, const int len,
+			       const struct pattern_op *op,
+			       const unsigned int segments)
+{
+	unsigned int i;
+	for (i = 0; i < segments; i++) {
+		unsigned int ops = 0;
+		while (op[ops].type != PATTERN_OP_END)
+			ops++;
+		if (segment_matches(filename, len, op, ops) != !i)
+			return false;
+		op += ops + 1;
+	}
+	return true;
+}
+
+_Bool file_matches_pattern(const char *filename, const char *filename_end,
+			   const char *pattern, const char *pattern_end)
+{
+	static __thread struct pattern_op *op = NULL;
+	static __thread unsigned int op_size = 0;
+	struct pattern_component component;
+	unsigned int max_ops = 0;
+	const unsigned int size = 2 * (pattern_end - pattern) + 2;
+	if (size > op_size) {
+		op = realloc(op, size * sizeof(*op));
+		if (!op)
+			out_of_memory();
+		op_size = size;
+	}
+	compile_component(op, &component, &max_ops, pattern, pattern_end);
+	reserve_pattern_work(max_ops);
+	return component_matches(filename, filename_end - filename, op,
+				 component.segments);
+}
+
+/**
+ * compile_pattern - Compile a pattern for path_matches_pattern().
+ *
+ * @pattern: The pattern after its constant part.
+ * @arena:   Pointer to "struct memory_arena" to allocate from. If NULL, the
+ *           program is allocated by malloc() and the caller must free() it.
+ *
+ * Returns pointer to "struct pattern_program" in one piece of memory.
+ */
+static struct pattern_program *compile_pattern(const char *pattern,
+					       struct memory_arena *arena)
+{
+	const int len = strlen(pattern);
+	struct pattern_component *component =
+		malloc((len + 1) * sizeof(*component));
+	struct pattern_op *op = malloc((4 * len + 4) * sizeof(*op));
+	struct pattern_program *program;
+	unsigned int components = 0;
+	unsigned int ops = 0;
+	unsigned int max_ops = 0;
+	size_t size;
+	char *cp;
+	if (!component || !op)
+		out_of_memory();
+	while (*pattern) {
+		const char *delimiter = strchr(pattern, '/');
+		if (!delimiter)
+			delimiter = strchr(pattern, '\0');
+		component[components].first_op = ops;
+		ops += compile_component(op + ops, &component[components++],
+					 &max_ops, pattern, delimiter);
+		pattern = delimiter;
+		if (*pattern)
+			pattern++;
+	}
+	/* Put everything into one piece of memory. */
+	size = sizeof(*program) + components * sizeof(*component) +
+		ops * sizeof(*op);
+	cp = arena ? arena_alloc(arena, size) : malloc(size);
+	if (!cp)
+		out_of_memory();
+	program = (struct pattern_program *) cp;
+	cp += sizeof(*program);
+	program->component = memmove(cp, component,
+				      components * sizeof(*component));
+	cp += components * sizeof(*component);
+	program->op = memmove(cp, op, ops * sizeof(*op));
+	program->components = components;
+	program->max_ops = max_ops;
+	free(component);
+	free(op);
+	return program;
+}
+
+/* Returns true if @f, after the constant part, matches @program. */
+static _Bool program_matches(const char *f,
+			     const struct pattern_program *program)
+{
+	const char *p;
+	unsigned int i = 0;
+	reserve_pattern_work(program->max_ops);
+	/* Main loop. Compare each directory component. */
+	while (*f && i < program->components) {
+		const struct pattern_component *ptr = &program->component[i++];
+		const char *f_delimiter = strchr(f, '/');
+		if (!f_delimiter)
+			f_delimiter = strchr(f, '\0');
+		if (!component_matches(f, f_delimiter - f,
+				       program->op + ptr->first_op,
+				       ptr->segments))
+			return false;
+		f = f_delimiter;
+		if (*f)
+			f++;
+	}
+	p = i < program->components ? program->component[i].start : "";
+	/* Ignore trailing "\*" and "\@" in @pattern. */
+	while (*p == '\\' &&
+	       (*(p + 1) == '*' || *(p + 1) == '@'))
+		p += 2;
+	return !*f && !*p;
 }
 
+/*
+ * The compiled program of @pattern is cached in @pattern only if it is owned
+ * by savename(), which is used by the main thread only. Other patterns, such
+ * as "struct path_info" on the stack, are compiled into a temporary program.
+ */
 _Bool path_matches_pattern(const struct path_info *filename,
 			  const struct path_info *pattern)
 {
@@ -536,9 +974,10 @@ _Bool path_matches_pattern(const struct path_info *filename,
 	if (!filename || !pattern)
 		return false;
 	*/
+	struct pattern_program *program;
 	const char *f = filename->name;
-	const char *p = pattern->name;
 	const int len = pattern->const_len;
+	_Bool matched;
 	/* If @pattern doesn't contain pattern, I can use strcmp(). */
 	if (!pattern->is_patterned)
 		return !pathcmp(filename, pattern);
@@ -546,297 +985,1539 @@ _Bool path_matches_pattern(const struct path_info *filename,
 	if (filename->depth != pattern->depth)
 		return false;
 	/* Compare the initial length without patterns. */
-	if (strncmp(f, p, len))
+	if (strncmp(f, pattern->name, len))
 		return false;
 	f += len;
-	p += len;
-	/* Main loop. Compare each directory component. */
-	while (*f && *p) {
-		const char *f_delimiter = strchr(f, '/');
-		const char *p_delimiter = strchr(p, '/');
-		if (!f_delimiter)
-			f_delimiter = strchr(f, '\0');
-		if (!p_delimiter)
-			p_delimiter = strchr(p, '\0');
-		if (!file_matches_pattern(f, f_delimiter, p, p_delimiter))
-			return false;
-		f = f_delimiter;
-		if (*f)
-			f++;
-		p = p_delimiter;
-		if (*p)
-			p++;
+	if (pattern->program)
+		return program_matches(f, pattern->program);
+	if (is_interned(pattern)) {
+		program = compile_pattern(pattern->name + len, &name_arena);
+		((struct path_info *) pattern)->program = program;
+		return program_matches(f, program);
 	}
-	/* Ignore trailing "\*" and "\@" in @pattern. */
-	while (*p == '\\' &&
-	       (*(p + 1) == '*' || *(p + 1) == '@'))
-		p += 2;
-	return !*f && !*p;
+	program = compile_pattern(pattern->name + len, NULL);
+	matched = program_matches(f, program);
+	free(program);
+	return matched;
 }
 
-int string_compare(const void *a, const void *b)
+/**
+ * compile_path_info - Compile a pattern which is not owned by savename().
+ *
+ * @ptr: Pointer to "struct path_info" filled by fill_path_info().
+ *
+ * path_matches_pattern() uses the program cached in @ptr instead of
+ * compiling a temporary one on each call. The caller must release it with
+ * free_path_info_program() before @ptr goes away.
+ */
+void compile_path_info(struct path_info *ptr)
 {
-	return strcmp(*(char **) a, *(char **) b);
+	if (ptr->is_patterned && !ptr->program)
+		ptr->program = compile_pattern(ptr->name + ptr->const_len,
+					       NULL);
 }
 
-_Bool pathcmp(const struct path_info *a, const struct path_info *b)
+/**
+ * free_path_info_program - Release the program made by compile_path_info().
+ *
+ * @ptr: Pointer to "struct path_info" passed to compile_path_info().
+ */
+void free_path_info_program(struct path_info *ptr)
 {
-	return a->hash != b->hash || strcmp(a->name, b->name);
+	free((void *) ptr->program);
+	ptr->program = NULL;
 }
 
-void fill_path_info(struct path_info *ptr)
+static inline unsigned int pattern_edge_index(const int parent, const u8 c,
+					      const unsigned int size)
 {
-	const char *name = ptr->name;
-	const int len = strlen(name);
-	ptr->total_len = len;
-	ptr->const_len = const_part_length(name);
-	ptr->is_dir = len && (name[len - 1] == '/');
-	ptr->is_patterned = (ptr->const_len < len);
-	ptr->hash = full_name_hash(name, len);
-	ptr->depth = path_depth(name);
+	return hash_slot_index(((u32) parent) << 8 | c, size);
 }
 
-static unsigned int memsize(const unsigned int size)
+static int pattern_index_child(const struct pattern_index *index,
+			       const int parent, const u8 c)
 {
-	if (size <= 1048576)
-		return ((size / PAGE_SIZE) + 1) * PAGE_SIZE;
-	return 0;
+	unsigned int i;
+	if (!index->edge_size)
+		return EOF;
+	i = pattern_edge_index(parent, c, index->edge_size);
+	while (index->edge[i].child) {
+		if (index->edge[i].parent == parent && index->edge[i].c == c)
+			return index->edge[i].child;
+		i = (i + 1) & (index->edge_size - 1);
+	}
+	return EOF;
 }
 
-const struct path_info *savename(const char *name)
+static void pattern_index_add_edge(struct pattern_index *index,
+				   const int parent, const u8 c,
+				   const int child)
 {
-	static struct free_memory_block_list fmb_list = { NULL, NULL, 0 };
-	/* The list of names. */
-	static struct savename_entry name_list[SAVENAME_MAX_HASH];
-	struct savename_entry *ptr;
-	struct savename_entry *prev = NULL;
-	unsigned int hash;
-	struct free_memory_block_list *fmb = &fmb_list;
-	int len;
-	static _Bool first_call = true;
-	if (!name)
-		return NULL;
-	len = strlen(name) + 1;
-	hash = full_name_hash((const unsigned char *) name, len - 1);
-	if (first_call) {
-		int i;
-		first_call = false;
-		memset(&name_list, 0, sizeof(name_list));
-		for (i = 0; i < SAVENAME_MAX_HASH; i++) {
-			name_list[i].entry.name = "/";
-			fill_path_info(&name_list[i].entry);
-		}
-	}
-	ptr = &name_list[hash % SAVENAME_MAX_HASH];
-	while (ptr) {
-		if (hash == ptr->entry.hash && !strcmp(name, ptr->entry.name))
-			goto out;
-		prev = ptr;
-		ptr = ptr->next;
-	}
-	while (len > fmb->len) {
-		char *cp;
-		if (fmb->next) {
-			fmb = fmb->next;
-			continue;
-		}
-		cp = malloc(memsize(len));
-		if (!cp)
+	unsigned int i;
+	if ((index->edge_count + 1) * 4 > index->edge_size * 3) {
+		struct pattern_index_edge *old = index->edge;
+		const unsigned int old_size = index->edge_size;
+		index->edge_size = old_size ? old_size << 1 : 256;
+		index->edge = calloc(index->edge_size, sizeof(*index->edge));
+		if (!index->edge)
 			out_of_memory();
-		fmb->next = alloc_element(sizeof(*fmb->next));
-		if (!fmb->next)
-			out_of_memory();
-		memset(cp, 0, memsize(len));
-		fmb = fmb->next;
-		fmb->ptr = cp;
-		fmb->len = memsize(len);
+		index->edge_count = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].child)
+				pattern_index_add_edge(index, old[i].parent,
+						       old[i].c,
+						       old[i].child);
+		free(old);
 	}
-	ptr = alloc_element(sizeof(*ptr));
-	if (!ptr)
-		out_of_memory();
-	memset(ptr, 0, sizeof(struct savename_entry));
-	ptr->entry.name = fmb->ptr;
-	memmove(fmb->ptr, name, len);
-	fill_path_info(&ptr->entry);
-	fmb->ptr += len;
-	fmb->len -= len;
-	prev->next = ptr; /* prev != NULL because name_list is not empty. */
-	if (!fmb->len) {
-		struct free_memory_block_list *ptr = &fmb_list;
-		while (ptr->next != fmb)
-			ptr = ptr->next;
-		ptr->next = fmb->next;
+	i = pattern_edge_index(parent, c, index->edge_size);
+	while (index->edge[i].child)
+		i = (i + 1) & (index->edge_size - 1);
+	index->edge[i].parent = parent;
+	index->edge[i].c = c;
+	index->edge[i].child = child;
+	index->edge_count++;
+}
+
+static int pattern_index_new_node(struct pattern_index *index)
+{
+	if (index->node_len == index->node_size) {
+		index->node_size = index->node_size ?
+			index->node_size << 1 : 64;
+		index->node = realloc(index->node,
+				      index->node_size * sizeof(int));
+		if (!index->node)
+			out_of_memory();
 	}
-out:
-	return ptr ? &ptr->entry : NULL;
+	index->node[index->node_len] = EOF;
+	return index->node_len++;
 }
 
-_Bool move_proc_to_file(const char *src, const char *base, const char *dest)
+/**
+ * pattern_index_add - Add a pattern to "struct pattern_index".
+ *
+ * @index:   Pointer to "struct pattern_index".
+ * @pattern: Pointer to "struct path_info". Need not be kept by the caller.
+ * @value:   Value returned by pattern_index_find() when @pattern matches.
+ *
+ * The pattern is interned by savename(), so @index has to be cleared before
+ * savename_reset() is called.
+ */
+void pattern_index_add(struct pattern_index *index,
+		       const struct path_info *pattern, const int value)
 {
-	FILE *proc_fp;
-	FILE *base_fp;
-	FILE *file_fp = stdout;
-	char **proc_list = NULL;
-	char **base_list = NULL;
-	int proc_list_len = 0;
-	int base_list_len = 0;
+	const struct path_info *saved_pattern = savename(pattern->name);
+	const char *cp = saved_pattern->name;
+	const int depth = saved_pattern->depth;
+	int node;
+	int *ptr;
 	int i;
-	proc_fp = open_read(src);
-	if (!proc_fp) {
-		fprintf(stderr, "Can't open %s\n", src);
-		return false;
-	}
-	if (dest) {
-		file_fp = fopen(dest, "w");
-		if (!file_fp) {
-			fprintf(stderr, "Can't open %s\n", dest);
-			fclose(proc_fp);
-			return false;
-		}
+	if (depth >= index->root_len) {
+		index->root = realloc(index->root, (depth + 1) * sizeof(int));
+		if (!index->root)
+			out_of_memory();
+		while (index->root_len <= depth)
+			index->root[index->root_len++] = EOF;
 	}
-	get();
-	base_fp = fopen(base, "r");
-	if (base_fp) {
-		while (freadline(base_fp)) {
-			char *cp;
-			if (!shared_buffer[0])
-				continue;
-			base_list = realloc(base_list, sizeof(char *) *
-					    (base_list_len + 1));
-			if (!base_list)
-				out_of_memory();
-			cp = strdup(shared_buffer);
-			if (!cp)
-				out_of_memory();
-			base_list[base_list_len++] = cp;
+	if (index->root[depth] == EOF)
+		index->root[depth] = pattern_index_new_node(index);
+	node = index->root[depth];
+	for (i = 0; i < saved_pattern->const_len; i++) {
+		int child = pattern_index_child(index, node, cp[i]);
+		if (child == EOF) {
+			child = pattern_index_new_node(index);
+			pattern_index_add_edge(index, node, cp[i], child);
 		}
-		fclose(base_fp);
+		node = child;
 	}
-	while (freadline(proc_fp)) {
-		char *cp;
-		if (!shared_buffer[0])
-			continue;
-		proc_list = realloc(proc_list, sizeof(char *) *
-				    (proc_list_len + 1));
-		if (!proc_list)
-			out_of_memory();
-		cp = strdup(shared_buffer);
-		if (!cp)
+	if (index->entry_len == index->entry_size) {
+		index->entry_size = index->entry_size ?
+			index->entry_size << 1 : 64;
+		index->entry = realloc(index->entry, index->entry_size *
+				       sizeof(struct pattern_index_entry));
+		if (!index->entry)
 			out_of_memory();
-		proc_list[proc_list_len++] = cp;
 	}
-	put();
-	fclose(proc_fp);
+	i = index->entry_len++;
+	index->entry[i].pattern = saved_pattern;
+	index->entry[i].value = value;
+	/* Keep entries of a node sorted by value. */
+	ptr = &index->node[node];
+	while (*ptr != EOF && index->entry[*ptr].value <= value)
+		ptr = &index->entry[*ptr].next;
+	index->entry[i].next = *ptr;
+	*ptr = i;
+}
 
-	for (i = 0; i < proc_list_len; i++) {
-		int j;
-		for (j = 0; j < base_list_len; j++) {
-			if (!proc_list[i] || !base_list[j] ||
-			    strcmp(proc_list[i], base_list[j]))
-				continue;
-			free(proc_list[i]);
-			proc_list[i] = NULL;
-			free(base_list[j]);
-			base_list[j] = NULL;
-			break;
-		}
+/*
+ * Walk the trie of @pathname's depth along @pathname. Only patterns whose
+ * constant part is a prefix of @pathname are visited.
+ */
+static int pattern_index_lookup(const struct pattern_index *index,
+				const struct path_info *pathname,
+				const _Bool use_pattern)
+{
+	const char *cp = pathname->name;
+	int found = EOF;
+	int node;
+	if (pathname->depth >= index->root_len)
+		return EOF;
+	node = index->root[pathname->depth];
+	while (node != EOF) {
+		int i;
+		for (i = index->node[node]; i != EOF;
+		     i = index->entry[i].next) {
+			const struct pattern_index_entry *ptr =
+				&index->entry[i];
+			if (found != EOF && ptr->value >= found)
+				break;
+			if (use_pattern ?
+			    path_matches_pattern(pathname, ptr->pattern) :
+			    !pathcmp(pathname, ptr->pattern)) {
+				found = ptr->value;
+				break;
+			}
+		}
+		if (!*cp)
+			break;
+		node = pattern_index_child(index, node, *cp++);
+	}
+	return found;
+}
+
+/**
+ * pattern_index_find - Find the first pattern which matches a pathname.
+ *
+ * @index:    Pointer to "struct pattern_index".
+ * @pathname: Pointer to "struct path_info".
+ *
+ * Returns the smallest value of patterns which path_matches_pattern()
+ * accepts, EOF otherwise.
+ */
+int pattern_index_find(const struct pattern_index *index,
+		       const struct path_info *pathname)
+{
+	return pattern_index_lookup(index, pathname, true);
+}
+
+/**
+ * pattern_index_find_name - Find a pattern which is identical to a pathname.
+ *
+ * @index:    Pointer to "struct pattern_index".
+ * @pathname: Pointer to "struct path_info".
+ *
+ * Returns the smallest value of patterns which are the same string as
+ * @pathname, EOF otherwise.
+ */
+int pattern_index_find_name(const struct pattern_index *index,
+			    const struct path_info *pathname)
+{
+	return pattern_index_lookup(index, pathname, false);
+}
+
+void clear_pattern_index(struct pattern_index *index)
+{
+	free(index->entry);
+	free(index->node);
+	free(index->root);
+	free(index->edge);
+	memset(index, 0, sizeof(*index));
+}
+
+/**
+ * build_keyword_trie - Build a trie for looking up keywords.
+ *
+ * @trie:    Pointer to "struct keyword_trie".
+ * @keyword: Array of keywords. NULL or empty ones are skipped.
+ * @count:   Number of elements in @keyword.
+ *
+ * The value of a keyword is its index in @keyword. If a keyword appears
+ * more than once, the smallest index is used.
+ */
+void build_keyword_trie(struct keyword_trie *trie,
+			const char * const *keyword, const int count)
+{
+	int size = 1;
+	int i;
+	memset(trie, 0, sizeof(*trie));
+	for (i = 0; i < count; i++) {
+		const u8 *cp = (const u8 *) keyword[i];
+		if (!cp)
+			continue;
+		for (; *cp; cp++) {
+			if (!trie->column[*cp])
+				trie->column[*cp] = ++trie->columns;
+			size++;
+		}
+	}
+	/* Each byte of each keyword adds at most one node. */
+	trie->child = calloc(size * trie->columns, sizeof(int));
+	trie->value = malloc(size * sizeof(int));
+	if ((trie->columns && !trie->child) || !trie->value)
+		out_of_memory();
+	trie->value[0] = EOF;
+	trie->len = 1;
+	for (i = 0; i < count; i++) {
+		const u8 *cp = (const u8 *) keyword[i];
+		int node = 0;
+		if (!cp || !*cp)
+			continue;
+		for (; *cp; cp++) {
+			int *child = &trie->child[node * trie->columns +
+						  trie->column[*cp] - 1];
+			if (!*child) {
+				trie->value[trie->len] = EOF;
+				*child = trie->len++;
+			}
+			node = *child;
+		}
+		if (trie->value[node] == EOF)
+			trie->value[node] = i;
+	}
+}
+
+/**
+ * keyword_trie_find - Find the keyword at the start of a string.
+ *
+ * @trie:       Pointer to "struct keyword_trie".
+ * @str:        String to look at.
+ * @whole_word: True if the keyword must be followed by ' ' or '\0'.
+ * @len:        Pointer to length of the keyword found.
+ *
+ * Returns the smallest value of keywords which are a prefix of @str, EOF
+ * if none. This is what comparing @str with each keyword in order returns.
+ */
+int keyword_trie_find(const struct keyword_trie *trie, const char *str,
+		      const _Bool whole_word, int *len)
+{
+	const u8 *cp = (const u8 *) str;
+	int found = EOF;
+	int node = 0;
+	while (true) {
+		const int value = trie->value[node];
+		u8 column;
+		if (value != EOF && (found == EOF || value < found) &&
+		    (!whole_word || *cp == ' ' || !*cp)) {
+			found = value;
+			*len = cp - (const u8 *) str;
+		}
+		column = trie->column[*cp++];
+		if (!column)
+			break;
+		node = trie->child[node * trie->columns + column - 1];
+		if (!node)
+			break;
+	}
+	return found;
+}
+
+void clear_keyword_trie(struct keyword_trie *trie)
+{
+	free(trie->child);
+	free(trie->value);
+	memset(trie, 0, sizeof(*trie));
+}
+
+int string_compare(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+_Bool pathcmp(const struct path_info *a, const struct path_info *b)
+{
+	return a->hash != b->hash || strcmp(a->name, b->name);
+}
+
+void fill_path_info(struct path_info *ptr)
+{
+	const char *name = ptr->name;
+	const int len = strlen(name);
+	ptr->total_len = len;
+	ptr->const_len = const_part_length(name);
+	ptr->is_dir = len && (name[len - 1] == '/');
+	ptr->is_patterned = (ptr->const_len < len);
+	ptr->hash = full_name_hash(name, len);
+	ptr->depth = path_depth(name);
+	ptr->program = NULL;
+}
+
+static struct savename_table name_table = { NULL, 0, 0, 0, 0, 0, 0, 0 };
+
+static void savename_resize(const unsigned int size)
+{
+	struct savename_slot *slot = calloc(size, sizeof(*slot));
+	unsigned int i;
+	if (!slot)
+		out_of_memory();
+	/* Hashes are stored inline, so rehashing needs no strcmp(). */
+	for (i = 0; i < name_table.size; i++) {
+		const struct savename_slot *old = &name_table.slot[i];
+		unsigned int j;
+		if (!old->entry)
+			continue;
+		j = hash_slot_index(old->hash, size);
+		while (slot[j].entry)
+			j = (j + 1) & (size - 1);
+		slot[j] = *old;
+	}
+	free(name_table.slot);
+	name_table.slot = slot;
+	if (name_table.size)
+		name_table.resizes++;
+	name_table.size = size;
+}
+
+/**
+ * savename_reserve - Make room for names without growing the table.
+ *
+ * @count: Number of names expected to be interned.
+ */
+void savename_reserve(const unsigned long count)
+{
+	unsigned long size = name_table.size ? name_table.size :
+		SAVENAME_MIN_HASH_SIZE;
+	/* Keep the load factor at or below 3/4. */
+	while ((name_table.count + count) * 4 > size * 3)
+		size <<= 1;
+	if (size > INT_MAX)
+		out_of_memory();
+	if (size != name_table.size)
+		savename_resize(size);
+}
+
+/**
+ * savename_reserve_for_file - Pre-size the table from the size of a file.
+ *
+ * @fp: Pointer to "FILE" which is about to be read.
+ *
+ * Does nothing unless @fp refers to a regular file. Policies repeat most of
+ * their names, so the size of @fp only caps the hint, which counts names
+ * already interned and never exceeds SAVENAME_MAX_RESERVE. Larger policies
+ * grow the table as they are read.
+ */
+void savename_reserve_for_file(FILE *fp)
+{
+	struct stat buf;
+	unsigned long count;
+	if (fstat(fileno(fp), &buf) || !S_ISREG(buf.st_mode))
+		return;
+	count = buf.st_size / SAVENAME_FILE_BYTES_PER_NAME;
+	if (count > SAVENAME_MAX_RESERVE)
+		count = SAVENAME_MAX_RESERVE;
+	if (count > name_table.count)
+		savename_reserve(count - name_table.count);
+}
+
+/*
+ * Print counters of savename() to stderr. Registered with atexit() if
+ * CCSTOOLS_SAVENAME_STATS is set, since most tools leave by exit().
+ */
+static void savename_stats(void)
+{
+	FILE *fp = stderr;
+	fprintf(fp, "savename: %u names in %u slots, %u resizes\n",
+		name_table.count, name_table.size, name_table.resizes);
+	fprintf(fp, "savename: %lu lookups, %lu hits (%.1f%%)\n",
+		name_table.lookups, name_table.hits, name_table.lookups ?
+		100.0 * name_table.hits / name_table.lookups : 0.0);
+	fprintf(fp, "savename: %.2f probes per lookup, %u probes max\n",
+		name_table.lookups ?
+		(double) name_table.probes / name_table.lookups : 0.0,
+		name_table.max_probes);
+}
+
+/**
+ * savename_reset - Forget all names interned by savename().
+ *
+ * Every pointer returned by savename() so far becomes invalid. Callers must
+ * drop all references to the current policy generation before calling this.
+ */
+void savename_reset(void)
+{
+	if (name_table.slot)
+		memset(name_table.slot, 0,
+		       name_table.size * sizeof(struct savename_slot));
+	name_table.count = 0;
+	arena_reset(&name_arena);
+}
+
+/*
+ * Intern @name, which is @len bytes long and hashes to @hash. If @info is not
+ * NULL, the new entry takes its precomputed fields from @info.
+ */
+static const struct path_info *intern_name(const char *name, const int len,
+					   const u32 hash,
+					   const struct path_info *info)
+{
+	struct savename_slot *slot;
+	struct path_info *ptr;
+	unsigned int i;
+	unsigned int probes = 0;
+	if ((name_table.count + 1) * 4 > name_table.size * 3)
+		savename_resize(name_table.size ? name_table.size << 1 :
+				SAVENAME_MIN_HASH_SIZE);
+	name_table.lookups++;
+	i = hash_slot_index(hash, name_table.size);
+	while (true) {
+		slot = &name_table.slot[i];
+		probes++;
+		if (!slot->entry)
+			break;
+		if (slot->hash == hash && !strcmp(name, slot->entry->name)) {
+			name_table.hits++;
+			goto out;
+		}
+		i = (i + 1) & (name_table.size - 1);
+	}
+	/* The name is stored right after its "struct path_info". */
+	ptr = arena_alloc(&name_arena, sizeof(*ptr) + len + 1);
+	if (info)
+		*ptr = *info;
+	else
+		memset(ptr, 0, sizeof(*ptr));
+	ptr->name = memmove(ptr + 1, name, len + 1);
+	if (info)
+		ptr->program = NULL;
+	else
+		fill_path_info(ptr);
+	slot->hash = hash;
+	slot->entry = ptr;
+	name_table.count++;
+out:
+	name_table.probes += probes;
+	if (probes > name_table.max_probes)
+		name_table.max_probes = probes;
+	return slot->entry;
+}
+
+/* Returns true if @ptr is the entry returned by savename() for its name. */
+static _Bool is_interned(const struct path_info *ptr)
+{
+	unsigned int i;
+	if (!name_table.size)
+		return false;
+	i = hash_slot_index(ptr->hash, name_table.size);
+	while (name_table.slot[i].entry) {
+		if (name_table.slot[i].entry == ptr)
+			return true;
+		i = (i + 1) & (name_table.size - 1);
+	}
+	return false;
+}
+
+const struct path_info *savename(const char *name)
+{
+	int len;
+	if (!name)
+		return NULL;
+	len = strlen(name);
+	return intern_name(name, len,
+			   full_name_hash((const unsigned char *) name, len),
+			   NULL);
+}
+
+/**
+ * savename_info - Intern a name whose "struct path_info" is already known.
+ *
+ * @info: Pointer to "struct path_info" with all fields filled in.
+ *
+ * Same as savename(@info->name), without computing the hash and other
+ * fields again. Used for names loaded from a snapshot.
+ */
+const struct path_info *savename_info(const struct path_info *info)
+{
+	return intern_name(info->name, strlen(info->name), info->hash, info);
+}
+
+/**
+ * name_map_value - Find the value associated with a name.
+ *
+ * @map:    Pointer to "struct name_map".
+ * @name:   Pointer to "struct path_info" returned by savename().
+ * @create: True if @name should be added with value 0 when not found.
+ *
+ * Returns pointer to the value, NULL if not found and !@create.
+ * The pointer is valid until the next call with @create set.
+ */
+int *name_map_value(struct name_map *map, const struct path_info *name,
+		    const _Bool create)
+{
+	unsigned int i;
+	if (create && (map->len + 1) * 4 > map->size * 3) {
+		struct name_map_entry *old = map->entry;
+		const unsigned int old_size = map->size;
+		map->size = old_size ? old_size << 1 : 256;
+		map->entry = calloc(map->size, sizeof(struct name_map_entry));
+		if (!map->entry)
+			out_of_memory();
+		for (i = 0; i < old_size; i++) {
+			unsigned int j;
+			if (!old[i].name)
+				continue;
+			j = hash_slot_index(old[i].name->hash, map->size);
+			while (map->entry[j].name)
+				j = (j + 1) & (map->size - 1);
+			map->entry[j] = old[i];
+		}
+		free(old);
+	}
+	if (!map->size)
+		return NULL;
+	i = hash_slot_index(name->hash, map->size);
+	while (map->entry[i].name) {
+		/* Faster comparison, for they are savename'd. */
+		if (map->entry[i].name == name)
+			return &map->entry[i].value;
+		i = (i + 1) & (map->size - 1);
+	}
+	if (!create)
+		return NULL;
+	map->entry[i].name = name;
+	map->entry[i].value = 0;
+	map->len++;
+	return &map->entry[i].value;
+}
+
+void clear_name_map(struct name_map *map)
+{
+	free(map->entry);
+	map->entry = NULL;
+	map->size = 0;
+	map->len = 0;
+}
+
+static u32 transition_rule_hash(const struct path_info *program,
+				const struct path_info *domainname,
+				const _Bool is_last_name)
+{
+	return (program ? program->hash : 0) * 31 +
+		(domainname ? domainname->hash : 0) + is_last_name;
+}
+
+/* Returns the slot for the given key, NULL if there is no such rule. */
+static struct transition_rule_slot *
+find_transition_rule(const struct transition_rule_index *index,
+		     const struct path_info *program,
+		     const struct path_info *domainname,
+		     const _Bool is_last_name)
+{
+	unsigned int i;
+	if (!index->size)
+		return NULL;
+	i = hash_slot_index(transition_rule_hash(program, domainname,
+						 is_last_name), index->size);
+	for (; index->slot[i].is_used; i = (i + 1) & (index->size - 1)) {
+		struct transition_rule_slot *slot = &index->slot[i];
+		if (slot->program == program &&
+		    slot->domainname == domainname &&
+		    slot->is_last_name == is_last_name)
+			return slot;
+	}
+	return NULL;
+}
+
+/*
+ * Record rule number @rule. Rules must be added in list order, so that the
+ * last one wins as it did when the lists were scanned.
+ */
+void add_transition_rule(struct transition_rule_index *index,
+			 const struct path_info *program,
+			 const struct path_info *domainname,
+			 const _Bool is_last_name, const _Bool is_not,
+			 const int rule)
+{
+	struct transition_rule_slot *slot =
+		find_transition_rule(index, program, domainname, is_last_name);
+	if (!slot) {
+		unsigned int i;
+		if ((index->len + 1) * 4 > index->size * 3) {
+			struct transition_rule_slot *old = index->slot;
+			const unsigned int old_size = index->size;
+			index->size = old_size ? old_size * 2 : 64;
+			index->slot = calloc(index->size,
+					     sizeof(struct transition_rule_slot));
+			if (!index->slot)
+				out_of_memory();
+			for (i = 0; i < old_size; i++) {
+				unsigned int j;
+				if (!old[i].is_used)
+					continue;
+				j = hash_slot_index(transition_rule_hash
+						    (old[i].program,
+						     old[i].domainname,
+						     old[i].is_last_name),
+						    index->size);
+				while (index->slot[j].is_used)
+					j = (j + 1) & (index->size - 1);
+				index->slot[j] = old[i];
+			}
+			free(old);
+		}
+		i = hash_slot_index(transition_rule_hash(program, domainname,
+							 is_last_name),
+				    index->size);
+		while (index->slot[i].is_used)
+			i = (i + 1) & (index->size - 1);
+		slot = &index->slot[i];
+		slot->program = program;
+		slot->domainname = domainname;
+		slot->is_last_name = is_last_name;
+		slot->is_used = true;
+		slot->index = EOF;
+		index->len++;
+	}
+	if (is_not)
+		slot->is_not = true;
+	else
+		slot->index = rule;
+}
+
+void clear_transition_rule_index(struct transition_rule_index *index)
+{
+	free(index->slot);
+	clear_name_map(&index->positive);
+	memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Merge rules for the given key into @found. Returns false if a "no_" rule
+ * matches, for it overrides every other rule.
+ */
+static _Bool check_transition_rule(const struct transition_rule_index *index,
+				   const struct path_info *program,
+				   const struct path_info *domainname,
+				   const _Bool is_last_name, int *found)
+{
+	const struct transition_rule_slot *slot =
+		find_transition_rule(index, program, domainname, is_last_name);
+	if (!slot)
+		return true;
+	if (slot->is_not)
+		return false;
+	if (slot->index > *found)
+		*found = slot->index;
+	return true;
+}
+
+/* Returns the last word of @domainname, savename()d. */
+const struct path_info *last_name_of(const struct path_info *domainname)
+{
+	const char *cp = strrchr(domainname->name, ' ');
+	const struct path_info *last_name = savename(cp ? cp + 1 :
+						     domainname->name);
+	if (!last_name)
+		out_of_memory();
+	return last_name;
+}
+
+/**
+ * find_domain_keeper - Find the keep_domain rule for a transition.
+ *
+ * @index:      Pointer to "struct transition_rule_index" of keep_domain.
+ * @domainname: Domain the transition starts from. Must be savename()d.
+ * @program:    Program executed.
+ *
+ * Returns the number of the last matching rule, EOF if none or if a
+ * no_keep_domain rule matches.
+ */
+int find_domain_keeper(const struct transition_rule_index *index,
+		       const struct path_info *domainname, const char *program)
+{
+	const struct path_info *last_name = last_name_of(domainname);
+	const struct path_info *saved_program = savename(program);
+	int found = EOF;
+	if (!saved_program)
+		out_of_memory();
+	if (!check_transition_rule(index, saved_program, domainname, false,
+				   &found) ||
+	    !check_transition_rule(index, saved_program, last_name, true,
+				   &found) ||
+	    !check_transition_rule(index, NULL, domainname, false, &found) ||
+	    !check_transition_rule(index, NULL, last_name, true, &found))
+		return EOF;
+	return found;
+}
+
+/**
+ * find_domain_initializer - Find the initialize_domain rule for a transition.
+ *
+ * @index:      Pointer to "struct transition_rule_index" of
+ *              initialize_domain.
+ * @domainname: Domain the transition starts from. Must be savename()d.
+ * @program:    Program executed.
+ *
+ * Returns the number of the last matching rule, EOF if none or if a
+ * no_initialize_domain rule matches.
+ */
+int find_domain_initializer(const struct transition_rule_index *index,
+			    const struct path_info *domainname,
+			    const char *program)
+{
+	const struct path_info *last_name = last_name_of(domainname);
+	const struct path_info *saved_program = savename(program);
+	int found = EOF;
+	if (!saved_program)
+		out_of_memory();
+	if (!check_transition_rule(index, saved_program, NULL, false,
+				   &found) ||
+	    !check_transition_rule(index, saved_program, domainname, false,
+				   &found) ||
+	    !check_transition_rule(index, saved_program, last_name, true,
+				   &found))
+		return EOF;
+	return found;
+}
+
+/* Returns index of the node for @name, adding it and its ancestors. */
+int domain_tree_add(struct domain_tree *tree, const struct path_info *name)
+{
+	struct domain_tree_node *node;
+	const char *cp;
+	int *value = name_map_value(&tree->map, name, false);
+	int parent = EOF;
+	if (value)
+		return *value - 1;
+	cp = strrchr(name->name, ' ');
+	if (cp) {
+		char *parent_name = strndup(name->name, cp - name->name);
+		const struct path_info *saved_name = savename(parent_name);
+		if (!parent_name || !saved_name)
+			out_of_memory();
+		free(parent_name);
+		parent = domain_tree_add(tree, saved_name);
+	}
+	if (tree->len == tree->size) {
+		tree->size = tree->size ? tree->size * 2 : 256;
+		tree->node = realloc(tree->node, tree->size *
+				     sizeof(struct domain_tree_node));
+		if (!tree->node)
+			out_of_memory();
+	}
+	node = &tree->node[tree->len];
+	memset(node, 0, sizeof(*node));
+	node->name = name;
+	node->last_name = cp ? cp + 1 : name->name;
+	node->parent = parent;
+	node->domain = EOF;
+	node->d_i = EOF;
+	node->d_k = EOF;
+	node->top_d_k = EOF;
+	*name_map_value(&tree->map, name, true) = ++tree->len;
+	return tree->len - 1;
+}
+
+/* Add all domains in @dp and their ancestors to @tree. */
+void build_domain_tree(struct domain_tree *tree,
+		       const struct domain_policy *dp)
+{
+	int index;
+	for (index = 0; index < dp->list_len; index++) {
+		const int i = domain_tree_add(tree, dp->list[index].domainname);
+		tree->node[i].domain = index;
+	}
+}
+
+void clear_domain_tree(struct domain_tree *tree)
+{
+	free(tree->node);
+	clear_name_map(&tree->map);
+	memset(tree, 0, sizeof(*tree));
+}
+
+/**
+ * find_unreachable_domains - Find domains no transition can reach.
+ *
+ * @tree:        Pointer to "struct domain_tree".
+ * @initializer: Pointer to "struct transition_rule_index" of
+ *               initialize_domain.
+ * @keeper:      Pointer to "struct transition_rule_index" of keep_domain.
+ *
+ * Sets d_i, d_k and top_d_k of each node to the number of the rule which
+ * makes it unreachable, EOF if none. The domain is unreachable if any of
+ * them is not EOF.
+ */
+void find_unreachable_domains(struct domain_tree *tree,
+			      const struct transition_rule_index *initializer,
+			      const struct transition_rule_index *keeper)
+{
+	int i;
+	/*
+	 * Walking from a domain towards <kernel>, the last initializer or
+	 * keeper found wins, except that an initializer directly under
+	 * <kernel> is reachable and leaves the result as it is. So compute
+	 * the outermost one below the child of <kernel> once for each node,
+	 * parents first.
+	 */
+	for (i = 0; i < tree->len; i++) {
+		struct domain_tree_node *node = &tree->node[i];
+		const struct domain_tree_node *parent;
+		if (node->parent == EOF)
+			continue;
+		parent = &tree->node[node->parent];
+		if (parent->parent == EOF) {
+			if (find_domain_initializer(initializer, parent->name,
+						    node->last_name) == EOF)
+				node->top_d_k =
+					find_domain_keeper(keeper,
+							   parent->name,
+							   node->last_name);
+			continue;
+		}
+		node->top_d_k = parent->top_d_k;
+		node->d_i = parent->d_i;
+		node->d_k = parent->d_k;
+		if (node->d_i != EOF || node->d_k != EOF)
+			continue;
+		node->d_i = find_domain_initializer(initializer, parent->name,
+						    node->last_name);
+		if (node->d_i == EOF)
+			node->d_k = find_domain_keeper(keeper, parent->name,
+						       node->last_name);
+	}
+}
+
+/* Read non-empty lines of @fp into @list, interning them by savename(). */
+static int read_name_list(FILE *fp, const struct path_info ***list)
+{
+	struct line_reader reader;
+	char *line;
+	int len = 0;
+	int size = 0;
+	line_reader_open(&reader, fp, true);
+	while ((line = line_reader_next(&reader)) != NULL) {
+		if (!line[0])
+			continue;
+		if (len == size) {
+			size = size ? size * 2 : 64;
+			*list = realloc(*list, size * sizeof(**list));
+			if (!*list)
+				out_of_memory();
+		}
+		(*list)[len] = savename(line);
+		if (!(*list)[len++])
+			out_of_memory();
+	}
+	line_reader_close(&reader);
+	return len;
+}
+
+/*
+ * Write lines of @src which differ from @base to @dest, or to @file_fp if
+ * @dest is NULL. @dest is not created unless @src can be opened.
+ */
+static _Bool save_proc_diff(const char *src, const char *base,
+			    const char *dest, FILE *file_fp)
+{
+	FILE *proc_fp;
+	FILE *base_fp;
+	const struct path_info **proc_list = NULL;
+	const struct path_info **base_list = NULL;
+	int proc_list_len = 0;
+	int base_list_len = 0;
+	_Bool *is_unmatched;
+	struct name_map map = { NULL, 0, 0 };
+	int i;
+	proc_fp = open_read(src);
+	if (!proc_fp) {
+		fprintf(stderr, "Can't open %s\n", src);
+		return false;
+	}
+	if (dest) {
+		file_fp = fopen(dest, "w");
+		if (!file_fp) {
+			fprintf(stderr, "Can't open %s\n", dest);
+			fclose(proc_fp);
+			return false;
+		}
+	}
+	base_fp = fopen(base, "r");
+	if (base_fp) {
+		savename_reserve_for_file(base_fp);
+		base_list_len = read_name_list(base_fp, &base_list);
+		fclose(base_fp);
+	}
+	proc_list_len = read_name_list(proc_fp, &proc_list);
+	fclose(proc_fp);
+
+	/*
+	 * Each proc line cancels the first base line with the same content
+	 * which is not cancelled yet. Count base lines per content, let proc
+	 * lines consume the counts, and then the last "count" occurrences of
+	 * each content in base are the ones left.
+	 */
+	is_unmatched = calloc(base_list_len + proc_list_len + 1,
+			      sizeof(_Bool));
+	if (!is_unmatched)
+		out_of_memory();
+	for (i = 0; i < base_list_len; i++)
+		(*name_map_value(&map, base_list[i], true))++;
+	for (i = 0; i < proc_list_len; i++) {
+		int *count = name_map_value(&map, proc_list[i], false);
+		if (count && *count)
+			(*count)--;
+		else
+			is_unmatched[base_list_len + i] = true;
+	}
+	for (i = base_list_len - 1; i >= 0; i--) {
+		int *count = name_map_value(&map, base_list[i], false);
+		if (!*count)
+			continue;
+		(*count)--;
+		is_unmatched[i] = true;
 	}
 	for (i = 0; i < base_list_len; i++) {
-		if (base_list[i])
-			fprintf(file_fp, "delete %s\n", base_list[i]);
+		if (is_unmatched[i])
+			fprintf(file_fp, "delete %s\n", base_list[i]->name);
 	}
 	for (i = 0; i < proc_list_len; i++) {
-		if (proc_list[i])
-			fprintf(file_fp, "%s\n", proc_list[i]);
+		if (is_unmatched[base_list_len + i])
+			fprintf(file_fp, "%s\n", proc_list[i]->name);
 	}
 
-	if (file_fp != stdout)
+	if (dest)
 		fclose(file_fp);
-	while (proc_list_len)
-		free(proc_list[--proc_list_len]);
+	clear_name_map(&map);
+	free(is_unmatched);
 	free(proc_list);
-	while (base_list_len)
-		free(base_list[--base_list_len]);
 	free(base_list);
 	return true;
 }
 
-_Bool is_identical_file(const char *file1, const char *file2)
+_Bool move_proc_to_file(const char *src, const char *base, const char *dest)
+{
+	return save_proc_diff(src, base, dest, stdout);
+}
+
+/* Save what move_proc_to_file() writes into the store as @prefix. */
+_Bool move_proc_to_store(const char *src, const char *base,
+			 const char *prefix, const time_t now,
+			 const _Bool force)
+{
+	struct policy_store store;
+	FILE *fp = open_policy_store(&store, prefix, now, false);
+	if (!fp)
+		return false;
+	return close_policy_store(&store,
+				  save_proc_diff(src, base, NULL, fp), force);
+}
+
+static u64 store_hash(const char *data, const size_t len)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+/*
+ * Name @len bytes at @data by two independent 64 bit hashes. This is not
+ * meant to resist forged input, only to tell policies apart.
+ */
+static void store_chunk_id(char id[33], const char *data, const size_t len)
+{
+	u64 hash = len;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = (hash + (unsigned char) data[i] + 1) *
+			0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+	snprintf(id, 33, "%016llx%016llx",
+		 (unsigned long long) store_hash(data, len),
+		 (unsigned long long) hash);
+}
+
+/* Write @len bytes at @data to @path, replacing it atomically. */
+static _Bool store_file(const char *path, const char *data, const size_t len)
+{
+	char *tmp = malloc(strlen(path) + 5);
+	FILE *fp;
+	_Bool result;
+	if (!tmp)
+		out_of_memory();
+	sprintf(tmp, "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	result = fp && fwrite(data, 1, len, fp) == len;
+	if (fp && fclose(fp))
+		result = false;
+	if (result && rename(tmp, path))
+		result = false;
+	if (!result) {
+		fprintf(stderr, "Can't write %s\n", path);
+		unlink(tmp);
+	}
+	free(tmp);
+	return result;
+}
+
+/*
+ * Store the first @len bytes of the pending data as a chunk. A chunk which
+ * is already there costs a stat() only.
+ */
+static void store_chunk(struct policy_store *store, const size_t len)
+{
+	char path[sizeof(STORE_DIR) + 32];
+	char id[33];
+	char entry[64];
+	struct stat buf;
+	int entry_len;
+	store_chunk_id(id, store->chunk, len);
+	snprintf(path, sizeof(path), STORE_DIR "%s", id);
+	if ((stat(path, &buf) || buf.st_size != len) &&
+	    !store_file(path, store->chunk, len))
+		store->error = true;
+	entry_len = snprintf(entry, sizeof(entry), "%s %lu\n", id,
+			     (unsigned long) len);
+	if (store->manifest_len + entry_len > store->manifest_size) {
+		store->manifest_size = store->manifest_size ?
+			store->manifest_size * 2 : 4096;
+		store->manifest = realloc(store->manifest,
+					  store->manifest_size);
+		if (!store->manifest)
+			out_of_memory();
+	}
+	memmove(store->manifest + store->manifest_len, entry, entry_len);
+	store->manifest_len += entry_len;
+	store->len -= len;
+	memmove(store->chunk, store->chunk + len, store->len);
+	store->line_start -= len;
+}
+
+/* Returns true if a chunk should end before @line of @len bytes. */
+static _Bool is_store_boundary(const struct policy_store *store,
+			       const char *line, const size_t len)
+{
+	if (store->by_domain)
+		return *line == '<' &&
+			!(store_hash(line, len) & STORE_DOMAIN_MASK);
+	return !(store_hash(line, len) & STORE_LINE_MASK);
+}
+
+static ssize_t store_write(void *cookie, const char *data, size_t size)
+{
+	struct policy_store *store = cookie;
+	size_t pos = store->len;
+	if (store->len + size > store->size) {
+		while (store->len + size > store->size)
+			store->size = store->size ? store->size * 2 : 65536;
+		store->chunk = realloc(store->chunk, store->size);
+		if (!store->chunk)
+			out_of_memory();
+	}
+	memmove(store->chunk + store->len, data, size);
+	store->len += size;
+	while (true) {
+		const size_t start = store->line_start;
+		char *cp = memchr(store->chunk + pos, '\n', store->len - pos);
+		if (!cp)
+			break;
+		pos = cp - store->chunk + 1;
+		store->line_start = pos;
+		if (start && (start >= STORE_CHUNK_MAX ||
+			      is_store_boundary(store, store->chunk + start,
+						pos - start - 1))) {
+			store_chunk(store, start);
+			pos -= start;
+		}
+	}
+	return size;
+}
+
+static int store_close(void *cookie)
 {
-	char buffer1[4096];
-	char buffer2[4096];
-	struct stat sb1;
-	struct stat sb2;
-	const int fd1 = open(file1, O_RDONLY);
-	const int fd2 = open(file2, O_RDONLY);
-	int len1;
-	int len2;
-	/* Don't compare if file1 is a symlink to file2. */
-	if (fstat(fd1, &sb1) || fstat(fd2, &sb2) || sb1.st_ino == sb2.st_ino)
+	struct policy_store *store = cookie;
+	if (store->len)
+		store_chunk(store, store->len);
+	return 0;
+}
+
+/**
+ * open_policy_store - Start saving policy into the store.
+ *
+ * @store:     Pointer to "struct policy_store".
+ * @prefix:    Name of the policy, such as "domain_policy".
+ * @now:       Time to name the saved policy after.
+ * @by_domain: True if the policy is a domain policy.
+ *
+ * Returns a stream to write the policy to, NULL on error.
+ * close_policy_store() must be called if a stream was returned.
+ */
+FILE *open_policy_store(struct policy_store *store, const char *prefix,
+			const time_t now, const _Bool by_domain)
+{
+	static const cookie_io_functions_t io = {
+		.write = store_write,
+		.close = store_close,
+	};
+	char *conf = malloc(strlen(prefix) + 6);
+	if (!conf)
+		out_of_memory();
+	sprintf(conf, "%s.conf", prefix);
+	if (mkdir(STORE_DIR, 0700) && errno != EEXIST) {
+		fprintf(stderr, "Can't create %s\n", STORE_DIR);
+		free(conf);
+		return NULL;
+	}
+	memset(store, 0, sizeof(*store));
+	store->conf = conf;
+	store->by_domain = by_domain;
+	store->filename = strdup(make_filename(prefix, now));
+	store->fp = fopencookie(store, "w", io);
+	if (!store->filename || !store->fp)
+		out_of_memory();
+	return store->fp;
+}
+
+/* Returns true if the manifest at @path is @len bytes at @manifest. */
+static _Bool is_same_manifest(const char *path, const char *manifest,
+			      const size_t len)
+{
+	struct stat buf;
+	_Bool result = false;
+	char *data;
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return false;
+	if (!fstat(fileno(fp), &buf) && buf.st_size == len) {
+		data = malloc(len + 1);
+		if (!data)
+			out_of_memory();
+		result = fread(data, 1, len, fp) == len &&
+			!memcmp(data, manifest, len);
+		free(data);
+	}
+	fclose(fp);
+	return result;
+}
+
+/**
+ * close_policy_store - Finish saving policy into the store.
+ *
+ * @store:  Pointer to "struct policy_store".
+ * @commit: False if the policy could not be written completely.
+ * @force:  True to save the policy even if it did not change.
+ *
+ * Returns true on success, false otherwise.
+ *
+ * Unless the policy is the same as what "prefix.conf" points to, its
+ * manifest is saved as STORE_DIR "prefix.YY-MM-DD.hh:mm:ss.conf", its text
+ * as "prefix.YY-MM-DD.hh:mm:ss.conf", and "prefix.conf" points to the
+ * latter. Text of the previous policy is then removed if its manifest is
+ * in the store, for restore_policy_store() can rebuild it.
+ */
+_Bool close_policy_store(struct policy_store *store, const _Bool commit,
+			 const _Bool force)
+{
+	char *manifest = malloc(strlen(store->filename) +
+				sizeof(STORE_DIR));
+	char prev[PATH_MAX];
+	char prev_manifest[sizeof(STORE_DIR) + PATH_MAX];
+	int prev_len;
+	FILE *fp;
+	_Bool result = false;
+	if (!manifest)
+		out_of_memory();
+	sprintf(manifest, STORE_DIR "%s", store->filename);
+	fclose(store->fp);
+	if (!commit || store->error)
 		goto out;
-	do {
-		len1 = read(fd1, buffer1, sizeof(buffer1));
-		len2 = read(fd2, buffer2, sizeof(buffer2));
-		if (len1 < 0 || len1 != len2)
+	/* Only policy saved next to "prefix.conf" is managed here. */
+	prev_len = readlink(store->conf, prev, sizeof(prev) - 1);
+	if (prev_len <= 0 || memchr(prev, '/', prev_len))
+		prev_len = 0;
+	prev[prev_len] = '\0';
+	snprintf(prev_manifest, sizeof(prev_manifest), STORE_DIR "%s", prev);
+	if (!force && prev_len &&
+	    is_same_manifest(prev_manifest, store->manifest,
+			     store->manifest_len)) {
+		result = true;
+		goto out;
+	}
+	if (!store_file(manifest, store->manifest, store->manifest_len))
+		goto out;
+	fp = fopen(store->filename, "w");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s\n", store->filename);
+		goto out;
+	}
+	result = restore_policy_store(manifest, fp);
+	if (fclose(fp))
+		result = false;
+	if (!result)
+		goto out;
+	unlink(store->conf);
+	symlink(store->filename, store->conf);
+	if (prev_len && strcmp(prev, store->filename) &&
+	    !access(prev_manifest, R_OK))
+		unlink(prev);
+out:
+	free(manifest);
+	free(store->chunk);
+	free(store->manifest);
+	free(store->filename);
+	free((char *) store->conf);
+	memset(store, 0, sizeof(*store));
+	return result;
+}
+
+/**
+ * restore_policy_store - Rebuild policy text from its manifest.
+ *
+ * @manifest: Pathname of a manifest written by close_policy_store().
+ * @fp:       Stream to write the policy to.
+ *
+ * Returns true on success, false otherwise.
+ *
+ * Chunks are looked for in the directory of @manifest, and are checked
+ * against their names.
+ */
+_Bool restore_policy_store(const char *manifest, FILE *fp)
+{
+	const char *cp = strrchr(manifest, '/');
+	const int dir_len = cp ? cp - manifest + 1 : 0;
+	char *data = NULL;
+	size_t data_size = 0;
+	char path[PATH_MAX];
+	char id[33];
+	char check[33];
+	unsigned long len;
+	_Bool result = false;
+	FILE *manifest_fp = fopen(manifest, "r");
+	if (!manifest_fp) {
+		fprintf(stderr, "Can't open %s\n", manifest);
+		return false;
+	}
+	while (fscanf(manifest_fp, "%32s %lu", id, &len) == 2) {
+		FILE *chunk_fp;
+		_Bool ok;
+		snprintf(path, sizeof(path), "%.*s%s", dir_len, manifest, id);
+		if (len > data_size) {
+			data_size = len;
+			data = realloc(data, data_size);
+			if (!data)
+				out_of_memory();
+		}
+		chunk_fp = fopen(path, "r");
+		ok = chunk_fp && fread(data, 1, len, chunk_fp) == len &&
+			fgetc(chunk_fp) == EOF;
+		if (chunk_fp)
+			fclose(chunk_fp);
+		if (ok) {
+			store_chunk_id(check, data, len);
+			ok = !strcmp(check, id);
+		}
+		if (!ok) {
+			fprintf(stderr, "%s is missing or damaged.\n", path);
 			goto out;
-		if (memcmp(buffer1, buffer2, len1))
+		}
+		if (fwrite(data, 1, len, fp) != len)
 			goto out;
-	} while (len1);
-	close(fd1);
-	close(fd2);
-	return true;
+	}
+	result = feof(manifest_fp);
 out:
-	close(fd1);
-	close(fd2);
-	return false;
+	free(data);
+	fclose(manifest_fp);
+	return result;
 }
 
 void clear_domain_policy(struct domain_policy *dp)
 {
 	int index;
+	clear_domain_rows(dp);
 	for (index = 0; index < dp->list_len; index++) {
 		free(dp->list[index].string_ptr);
 		dp->list[index].string_ptr = NULL;
 		dp->list[index].string_count = 0;
+		free(dp->list[index].string_hash);
 	}
 	free(dp->list);
 	dp->list = NULL;
 	dp->list_len = 0;
+	free(dp->hash);
+	dp->hash = NULL;
+	dp->hash_size = 0;
+}
+
+/* Forget the layout of rows, for "list" of @dp has changed. */
+void clear_domain_rows(struct domain_policy *dp)
+{
+	int index;
+	if (!dp->row)
+		return;
+	for (index = 0; index < dp->list_len; index++)
+		free(dp->row[index].text);
+	free(dp->row);
+	dp->row = NULL;
+}
+
+static void insert_domain_hash(struct domain_policy *dp, const int index)
+{
+	unsigned int i = hash_slot_index(dp->list[index].domainname->hash,
+					 dp->hash_size);
+	while (dp->hash[i] != EOF)
+		i = (i + 1) & (dp->hash_size - 1);
+	dp->hash[i] = index;
+}
+
+/**
+ * rebuild_domain_hash - Rebuild the hash index of "struct domain_policy".
+ *
+ * @dp: Pointer to "struct domain_policy".
+ *
+ * Needs to be called whenever dp->list[] is reordered.
+ */
+void rebuild_domain_hash(struct domain_policy *dp)
+{
+	unsigned int size = 64;
+	unsigned int i;
+	while (size * 3 < (dp->list_len + 1) * 4)
+		size <<= 1;
+	if (size != dp->hash_size) {
+		free(dp->hash);
+		dp->hash = malloc(size * sizeof(int));
+		if (!dp->hash)
+			out_of_memory();
+		dp->hash_size = size;
+	}
+	for (i = 0; i < size; i++)
+		dp->hash[i] = EOF;
+	for (i = 0; i < dp->list_len; i++)
+		insert_domain_hash(dp, i);
+}
+
+/**
+ * add_domain_hash - Add a domain appended to dp->list[] to the hash index.
+ *
+ * @dp:    Pointer to "struct domain_policy".
+ * @index: Index of the new domain.
+ */
+void add_domain_hash(struct domain_policy *dp, const int index)
+{
+	if (dp->list_len * 4 > dp->hash_size * 3)
+		rebuild_domain_hash(dp);
+	else
+		insert_domain_hash(dp, index);
+}
+
+/**
+ * find_domain_by_name - Find a domain by name and attributes.
+ *
+ * @dp:         Pointer to "struct domain_policy".
+ * @domainname: Pointer to "struct path_info". Need not be savename()'d.
+ * @is_dis:     True if looking for a domain initializer source.
+ * @is_dd:      True if looking for a deleted domain.
+ *
+ * Returns index of the domain if found, EOF otherwise.
+ */
+int find_domain_by_name(const struct domain_policy *dp,
+			const struct path_info *domainname,
+			const _Bool is_dis, const _Bool is_dd)
+{
+	int found = EOF;
+	unsigned int i;
+	if (!dp->hash_size)
+		return EOF;
+	i = hash_slot_index(domainname->hash, dp->hash_size);
+	for (; dp->hash[i] != EOF; i = (i + 1) & (dp->hash_size - 1)) {
+		const int index = dp->hash[i];
+		const struct domain_info *ptr = &dp->list[index];
+		if (ptr->is_dis != is_dis || ptr->is_dd != is_dd ||
+		    pathcmp(domainname, ptr->domainname))
+			continue;
+		if (found == EOF || index < found)
+			found = index;
+	}
+	return found;
 }
 
 int find_domain_by_ptr(struct domain_policy *dp,
 		       const struct path_info *domainname)
+{
+	int found = EOF;
+	unsigned int i;
+	if (!dp->hash_size)
+		return EOF;
+	i = hash_slot_index(domainname->hash, dp->hash_size);
+	for (; dp->hash[i] != EOF; i = (i + 1) & (dp->hash_size - 1)) {
+		const int index = dp->hash[i];
+		if (dp->list[index].domainname != domainname)
+			continue;
+		if (found == EOF || index < found)
+			found = index;
+	}
+	return found;
+}
+
+/**
+ * print_missing_entries - Print ACL entries which exist only in one domain.
+ *
+ * @fp:        Pointer to "FILE".
+ * @prefix:    String to print before each entry.
+ * @domain:    Pointer to "struct domain_info" to print entries from.
+ * @other:     Pointer to "struct domain_info" to compare with.
+ * @separator: String to print after the domainname line. The diff file
+ *             wants an empty line there, but the kernel does not.
+ * @first:     Pointer to "_Bool". If true, the domainname is printed
+ *             before the first entry and this is set to false.
+ *
+ * Both arrays must be sorted by sort_domain_policy(), so that one merge
+ * walk is enough.
+ */
+void print_missing_entries(FILE *fp, const char *prefix,
+			   const struct domain_info *domain,
+			   const struct domain_info *other,
+			   const char *separator, _Bool *first)
 {
 	int i;
-	for (i = 0; i < dp->list_len; i++) {
-		if (dp->list[i].domainname == domainname)
-			return i;
+	int j = 0;
+	for (i = 0; i < domain->string_count; i++) {
+		const struct path_info *cp = domain->string_ptr[i];
+		while (j < other->string_count &&
+		       strcmp(other->string_ptr[j]->name, cp->name) < 0)
+			j++;
+		/* Faster comparison, for they are savename'd. */
+		if (j < other->string_count && other->string_ptr[j] == cp)
+			continue;
+		if (*first)
+			fprintf(fp, "%s\n%s", domain->domainname->name,
+				separator);
+		*first = false;
+		fprintf(fp, "%s%s\n", prefix, cp->name);
 	}
-	return EOF;
 }
 
-_Bool save_domain_policy_with_diff(struct domain_policy *dp,
-				   struct domain_policy *bp,
-				   const char *proc, const char *base,
-				   const char *diff)
+_Bool save_domain_policy_with_diff(struct domain_policy *dp,
+				   struct domain_policy *bp,
+				   const char *proc, const char *base,
+				   const char *diff)
+{
+	FILE *diff_fp = stdout;
+	if (diff) {
+		diff_fp = fopen(diff, "w");
+		if (!diff_fp) {
+			fprintf(stderr, "Can't open %s\n", diff);
+			return false;
+		}
+	}
+	save_domain_policy_to_stream(dp, bp, proc, base, diff_fp);
+	if (diff_fp != stdout)
+		fclose(diff_fp);
+	return true;
+}
+
+static _Bool save_domain_policy_to_stream(struct domain_policy *dp,
+					  struct domain_policy *bp,
+					  const char *proc, const char *base,
+					  FILE *diff_fp)
 {
 	const struct path_info **proc_string_ptr;
-	const struct path_info **base_string_ptr;
 	int proc_string_count;
-	int base_string_count;
 	int proc_index;
 	int base_index;
+	int *base_of_proc;
+	_Bool *base_is_used;
 	const struct path_info *domainname;
 	int i;
-	int j;
-	FILE *diff_fp = stdout;
-	if (diff) {
-		diff_fp = fopen(diff, "w");
-		if (!diff_fp) {
-			fprintf(stderr, "Can't open %s\n", diff);
-			return false;
-		}
-	}
 	read_domain_policy(dp, proc);
 	if (!access(base, R_OK)) {
 		_Bool om = offline_mode;
@@ -848,21 +2529,43 @@ _Bool save_domain_policy_with_diff(struct domain_policy *dp,
 		network_mode = nm;
 	}
 
+	/*
+	 * Pair domains of both policies. They are sorted by domainname and
+	 * each domainname appears only once in each policy.
+	 */
+	base_of_proc = malloc((dp->list_len + 1) * sizeof(int));
+	base_is_used = calloc(bp->list_len + 1, sizeof(_Bool));
+	if (!base_of_proc || !base_is_used)
+		out_of_memory();
+	base_index = 0;
+	for (proc_index = 0; proc_index < dp->list_len; proc_index++) {
+		domainname = dp->list[proc_index].domainname;
+		while (base_index < bp->list_len &&
+		       strcmp(bp->list[base_index].domainname->name,
+			      domainname->name) < 0)
+			base_index++;
+		if (base_index < bp->list_len &&
+		    bp->list[base_index].domainname == domainname) {
+			base_of_proc[proc_index] = base_index;
+			base_is_used[base_index] = true;
+		} else {
+			base_of_proc[proc_index] = EOF;
+		}
+	}
+
 	for (base_index = 0; base_index < bp->list_len; base_index++) {
-		domainname = bp->list[base_index].domainname;
-		proc_index = find_domain_by_ptr(dp, domainname);
-		if (proc_index >= 0)
+		if (base_is_used[base_index])
 			continue;
 		/* This domain was deleted by diff policy. */
-		fprintf(diff_fp, "delete %s\n\n", domainname->name);
+		fprintf(diff_fp, "delete %s\n\n",
+			bp->list[base_index].domainname->name);
 	}
 
 	for (proc_index = 0; proc_index < dp->list_len; proc_index++) {
-		domainname = dp->list[proc_index].domainname;
-		base_index = find_domain_by_ptr(bp, domainname);
-		if (base_index >= 0)
+		if (base_of_proc[proc_index] != EOF)
 			continue;
 		/* This domain was added by diff policy. */
+		domainname = dp->list[proc_index].domainname;
 		fprintf(diff_fp, "%s\n\n", domainname->name);
 		fprintf(diff_fp, KEYWORD_USE_PROFILE "%u\n",
 			dp->list[proc_index].profile);
@@ -874,59 +2577,51 @@ _Bool save_domain_policy_with_diff(struct domain_policy *dp,
 	}
 
 	for (proc_index = 0; proc_index < dp->list_len; proc_index++) {
+		const struct domain_info *proc_domain = &dp->list[proc_index];
+		const struct domain_info *base_domain;
 		_Bool first = true;
-		domainname = dp->list[proc_index].domainname;
-		base_index = find_domain_by_ptr(bp, domainname);
+		base_index = base_of_proc[proc_index];
 		if (base_index == EOF)
 			continue;
 		/* This domain exists in both base policy and proc policy. */
-		proc_string_ptr = dp->list[proc_index].string_ptr;
-		proc_string_count = dp->list[proc_index].string_count;
-		base_string_ptr = bp->list[base_index].string_ptr;
-		base_string_count = bp->list[base_index].string_count;
-		for (i = 0; i < proc_string_count; i++) {
-			for (j = 0; j < base_string_count; j++) {
-				if (proc_string_ptr[i] != base_string_ptr[j])
-					continue;
-				proc_string_ptr[i] = NULL;
-				base_string_ptr[j] = NULL;
-			}
-		}
-
-		for (i = 0; i < base_string_count; i++) {
-			if (!base_string_ptr[i])
-				continue;
-			if (first)
-				fprintf(diff_fp, "%s\n\n", domainname->name);
-			first = false;
-			fprintf(diff_fp, "delete %s\n",
-				base_string_ptr[i]->name);
-		}
-		for (i = 0; i < proc_string_count; i++) {
-			if (!proc_string_ptr[i])
-				continue;
-			if (first)
-				fprintf(diff_fp, "%s\n\n", domainname->name);
-			first = false;
-			fprintf(diff_fp, "%s\n", proc_string_ptr[i]->name);
-		}
-		if (dp->list[proc_index].profile !=
-		    bp->list[base_index].profile) {
+		base_domain = &bp->list[base_index];
+		print_missing_entries(diff_fp, "delete ", base_domain,
+				      proc_domain, "\n", &first);
+		print_missing_entries(diff_fp, "", proc_domain, base_domain,
+				      "\n", &first);
+		if (proc_domain->profile != base_domain->profile) {
 			if (first)
-				fprintf(diff_fp, "%s\n\n", domainname->name);
+				fprintf(diff_fp, "%s\n\n",
+					proc_domain->domainname->name);
 			first = false;
 			fprintf(diff_fp, KEYWORD_USE_PROFILE "%u\n",
-				dp->list[proc_index].profile);
+				proc_domain->profile);
 		}
 		if (!first)
 			fprintf(diff_fp, "\n");
 	}
 
-	if (diff_fp != stdout)
-		fclose(diff_fp);
+	free(base_of_proc);
+	free(base_is_used);
 	return true;
 }
 
+/* Save what save_domain_policy_with_diff() writes into the store. */
+_Bool save_domain_policy_to_store(struct domain_policy *dp,
+				  struct domain_policy *bp,
+				  const char *proc, const char *base,
+				  const time_t now, const _Bool force)
+{
+	struct policy_store store;
+	FILE *fp = open_policy_store(&store, "domain_policy", now, true);
+	if (!fp)
+		return false;
+	return close_policy_store(&store,
+				  save_domain_policy_to_stream(dp, bp, proc,
+							       base, fp),
+				  force);
+}
+
 const char *domain_name(const struct domain_policy *dp, const int index)
 {
 	return dp->list[index].domainname->name;
@@ -945,14 +2640,282 @@ static int path_info_compare(const void *a, const void *b)
 	return strcmp(a0, b0);
 }
 
-static void sort_domain_policy(struct domain_policy *dp)
+void sort_domain_policy(struct domain_policy *dp)
 {
 	int i;
 	qsort(dp->list, dp->list_len, sizeof(struct domain_info),
 	      domainname_compare);
-	for (i = 0; i < dp->list_len; i++)
-		qsort(dp->list[i].string_ptr, dp->list[i].string_count,
+	for (i = 0; i < dp->list_len; i++) {
+		struct domain_info *domain = &dp->list[i];
+		compact_string_entries(domain);
+		qsort(domain->string_ptr, domain->string_count,
 		      sizeof(struct path_info *), path_info_compare);
+		/* Positions in string_hash are no longer valid. */
+		free(domain->string_hash);
+		domain->string_hash = NULL;
+		domain->string_hash_size = 0;
+	}
+	rebuild_domain_hash(dp);
+}
+
+static void resize_chunk_slots(struct policy_chunk *chunk)
+{
+	const unsigned int size = chunk->slot_size ?
+		chunk->slot_size * 2 : 1024;
+	unsigned int *slot = calloc(size, sizeof(*slot));
+	unsigned int i;
+	if (!slot)
+		out_of_memory();
+	for (i = 0; i < chunk->name_len; i++) {
+		unsigned int j = hash_slot_index(chunk->name[i].hash, size);
+		while (slot[j])
+			j = (j + 1) & (size - 1);
+		slot[j] = i + 1;
+	}
+	free(chunk->slot);
+	chunk->slot = slot;
+	chunk->slot_size = size;
+}
+
+/* Intern @name into the chunk and return its id. @name is copied if new. */
+static unsigned int chunk_name_id(struct policy_chunk *chunk,
+				  const char *name)
+{
+	const u32 hash = full_name_hash((const unsigned char *) name,
+					strlen(name));
+	unsigned int i;
+	if ((chunk->name_len + 1) * 4 > chunk->slot_size * 3)
+		resize_chunk_slots(chunk);
+	i = hash_slot_index(hash, chunk->slot_size);
+	while (chunk->slot[i]) {
+		const struct chunk_name *ptr = &chunk->name[chunk->slot[i] - 1];
+		if (ptr->hash == hash && !strcmp(ptr->name, name))
+			return chunk->slot[i] - 1;
+		i = (i + 1) & (chunk->slot_size - 1);
+	}
+	if (chunk->name_len == chunk->name_size) {
+		chunk->name_size = chunk->name_size ?
+			chunk->name_size * 2 : 1024;
+		chunk->name = realloc(chunk->name, chunk->name_size *
+				      sizeof(struct chunk_name));
+		if (!chunk->name)
+			out_of_memory();
+	}
+	chunk->name[chunk->name_len].name =
+		strcpy(arena_alloc(&chunk->names, strlen(name) + 1), name);
+	chunk->name[chunk->name_len].hash = hash;
+	chunk->slot[i] = ++chunk->name_len;
+	return chunk->name_len - 1;
+}
+
+static void add_chunk_op(struct policy_chunk *chunk, const u8 type,
+			 const unsigned int value)
+{
+	if (chunk->op_len == chunk->op_size) {
+		chunk->op_size = chunk->op_size ? chunk->op_size * 2 : 4096;
+		chunk->op = realloc(chunk->op, chunk->op_size *
+				    sizeof(struct policy_op));
+		if (!chunk->op)
+			out_of_memory();
+	}
+	chunk->op[chunk->op_len].type = type;
+	chunk->op[chunk->op_len++].value = value;
+}
+
+/* Same as the loop in handle_domain_policy(), but records operations. */
+static void parse_policy_line(struct policy_chunk *chunk, char *line)
+{
+	_Bool is_delete = false;
+	_Bool is_select = false;
+	unsigned int profile;
+	u8 type;
+	if (str_starts(line, "delete "))
+		is_delete = true;
+	else if (str_starts(line, "select "))
+		is_select = true;
+	if (is_domain_def((unsigned char *) line)) {
+		if (is_delete)
+			type = POLICY_OP_DELETE_DOMAIN;
+		else if (is_select)
+			type = POLICY_OP_SELECT_DOMAIN;
+		else
+			type = POLICY_OP_DOMAIN;
+	} else if (!line[0]) {
+		return;
+	} else if (sscanf(line, KEYWORD_USE_PROFILE "%u", &profile) == 1) {
+		add_chunk_op(chunk, POLICY_OP_PROFILE, (u8) profile);
+		return;
+	} else {
+		type = is_delete ? POLICY_OP_DELETE : POLICY_OP_ADD;
+	}
+	add_chunk_op(chunk, type, chunk_name_id(chunk, line));
+}
+
+/* Worker thread. Lines are copied out of the mapping to be normalized. */
+static void *parse_policy_chunk(void *arg)
+{
+	struct policy_chunk *chunk = arg;
+	const char *line = chunk->start;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	while (line < chunk->end) {
+		const char *cp = memchr(line, '\n', chunk->end - line);
+		char *copy;
+		if (!cp)
+			break;
+		copy = copy_line(&buffer, &buffer_size, line, cp - line);
+		normalize_line((unsigned char *) copy);
+		parse_policy_line(chunk, copy);
+		line = cp + 1;
+	}
+	free(buffer);
+	return NULL;
+}
+
+/*
+ * Returns the first line at or after @cp which starts with ROOT_NAME, @end
+ * if none. Such a line always selects a domain, so parsing can restart there
+ * without knowing the preceding lines.
+ */
+static const char *find_chunk_start(const char *start, const char *cp,
+				    const char *end)
+{
+	if (cp > start && cp[-1] != '\n') {
+		cp = memchr(cp, '\n', end - cp);
+		if (!cp)
+			return end;
+		cp++;
+	}
+	while (cp < end) {
+		if (end - cp > ROOT_NAME_LEN &&
+		    !memcmp(cp, ROOT_NAME, ROOT_NAME_LEN) &&
+		    (cp[ROOT_NAME_LEN] == ' ' || cp[ROOT_NAME_LEN] == '\n'))
+			return cp;
+		cp = memchr(cp, '\n', end - cp);
+		if (!cp)
+			return end;
+		cp++;
+	}
+	return end;
+}
+
+/* Replay operations of @chunk against @dp, in the order they were read. */
+static void merge_policy_chunk(struct domain_policy *dp,
+			       struct policy_chunk *chunk)
+{
+	const struct path_info **name;
+	int index = EOF;
+	unsigned int i;
+	name = malloc((chunk->name_len + 1) * sizeof(*name));
+	if (!name)
+		out_of_memory();
+	for (i = 0; i < chunk->name_len; i++) {
+		name[i] = savename(chunk->name[i].name);
+		if (!name[i])
+			out_of_memory();
+	}
+	for (i = 0; i < chunk->op_len; i++) {
+		const struct policy_op *op = &chunk->op[i];
+		const struct path_info *cp = NULL;
+		if (op->type != POLICY_OP_PROFILE)
+			cp = name[op->value];
+		switch (op->type) {
+		case POLICY_OP_DOMAIN:
+			index = find_or_assign_new_domain(dp, cp->name, false,
+							  false);
+			break;
+		case POLICY_OP_DELETE_DOMAIN:
+			index = find_domain_by_name(dp, cp, false, false);
+			if (index >= 0)
+				delete_domain(dp, index);
+			index = EOF;
+			break;
+		case POLICY_OP_SELECT_DOMAIN:
+			index = find_domain_by_name(dp, cp, false, false);
+			break;
+		case POLICY_OP_PROFILE:
+			if (index != EOF)
+				dp->list[index].profile = op->value;
+			break;
+		case POLICY_OP_ADD:
+			if (index != EOF)
+				add_string_ptr(dp, cp, index);
+			break;
+		case POLICY_OP_DELETE:
+			if (index != EOF)
+				del_string_ptr(dp, cp, index);
+			break;
+		}
+	}
+	free(name);
+	free(chunk->op);
+	free(chunk->name);
+	free(chunk->slot);
+	arena_reset(&chunk->names);
+	free(chunk->names.block);
+}
+
+/**
+ * read_domain_policy_parallel - Parse a large domain policy on all CPUs.
+ *
+ * @dp: Pointer to "struct domain_policy".
+ * @fp: Pointer to "FILE" to read from.
+ *
+ * Returns true if @fp was read, false if @fp is not a regular file or is
+ * too small to be worth splitting. The caller must read it then.
+ *
+ * The mapped file is cut at lines starting with ROOT_NAME and each chunk is
+ * parsed by its own thread into a list of operations using a chunk local
+ * interner. The operations are then replayed in file order, so "delete" and
+ * "select" behave exactly as with handle_domain_policy().
+ */
+static _Bool read_domain_policy_parallel(struct domain_policy *dp, FILE *fp)
+{
+	struct policy_chunk *chunk;
+	struct line_reader reader;
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	long count;
+	int i;
+	line_reader_open(&reader, fp, true);
+	count = reader.map_size / POLICY_CHUNK_MIN_SIZE;
+	if (count > cpus)
+		count = cpus;
+	if (count > POLICY_CHUNK_MAX)
+		count = POLICY_CHUNK_MAX;
+	if (!reader.map || count < 2) {
+		line_reader_close(&reader);
+		return false;
+	}
+	chunk = calloc(count, sizeof(*chunk));
+	if (!chunk)
+		out_of_memory();
+	for (i = 0; i < count; i++) {
+		const char *end = reader.map + reader.map_size;
+		chunk[i].start = i ? chunk[i - 1].end : reader.map;
+		if (i < count - 1) {
+			const char *cp = reader.map +
+				reader.map_size / count * (i + 1);
+			if (cp < chunk[i].start)
+				cp = chunk[i].start;
+			end = find_chunk_start(reader.map, cp, end);
+		}
+		chunk[i].end = end;
+		chunk[i].is_threaded = !pthread_create(&chunk[i].thread, NULL,
+						       parse_policy_chunk,
+						       &chunk[i]);
+		if (!chunk[i].is_threaded)
+			parse_policy_chunk(&chunk[i]);
+	}
+	for (i = 0; i < count; i++) {
+		if (chunk[i].is_threaded)
+			pthread_join(chunk[i].thread, NULL);
+		merge_policy_chunk(dp, &chunk[i]);
+	}
+	free(chunk);
+	line_reader_close(&reader);
+	for (i = 0; i < dp->list_len; i++)
+		compact_string_entries(&dp->list[i]);
+	return true;
 }
 
 void read_domain_policy(struct domain_policy *dp, const char *filename)
@@ -965,80 +2928,432 @@ void read_domain_policy(struct domain_policy *dp, const char *filename)
 			return;
 		}
 	}
-	get();
-	handle_domain_policy(dp, fp, true);
-	put();
+	savename_reserve_for_file(fp);
+	if (!read_domain_policy_parallel(dp, fp))
+		handle_domain_policy(dp, fp, true);
 	if (fp != stdin)
 		fclose(fp);
 	sort_domain_policy(dp);
 }
 
+static u64 snapshot_checksum(const char *data, const u64 len)
+{
+	u64 hash = 0xcbf29ce484222325ULL;
+	u64 i;
+	for (i = 0; i + sizeof(u64) <= len; i += sizeof(u64)) {
+		u64 word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < len; i++)
+		hash = (hash ^ (u8) data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+static void stat_snapshot_source(struct snapshot_source *source,
+				 const char *filename)
+{
+	struct stat buf;
+	memset(source, 0, sizeof(*source));
+	if (!filename || stat(filename, &buf))
+		return;
+	source->dev = buf.st_dev;
+	source->ino = buf.st_ino;
+	source->size = buf.st_size;
+	source->mtime = buf.st_mtim.tv_sec;
+	source->mtime_nsec = buf.st_mtim.tv_nsec;
+	source->exists = 1;
+}
+
+/* Returns true if @count elements of @size bytes at @offset fit in @len. */
+static _Bool snapshot_table_ok(const u64 offset, const u64 count,
+			       const u64 size, const u64 len)
+{
+	return offset >= sizeof(struct snapshot_header) && offset <= len &&
+		!(offset % sizeof(u64)) && count <= (len - offset) / size;
+}
+
+/* Returns index of @name in @string, appending it if not found. */
+static u32 snapshot_string_index(struct name_map *map,
+				 const struct path_info ***string,
+				 u32 *count, u64 *data_size,
+				 const struct path_info *name)
+{
+	int *value = name_map_value(map, name, true);
+	if (!*value) {
+		if (!(*count & (*count + 1))) {
+			*string = realloc(*string, (*count + 1) * 2 *
+					  sizeof(**string));
+			if (!*string)
+				out_of_memory();
+		}
+		(*string)[(*count)++] = name;
+		*data_size += strlen(name->name) + 1;
+		*value = *count;
+	}
+	return *value - 1;
+}
+
+/**
+ * write_domain_snapshot - Save domain policy in compiled form.
+ *
+ * @dp:       Pointer to "struct domain_policy" equivalent to @base + @src.
+ * @snapshot: Filename to write to.
+ * @base:     Base policy filename.
+ * @src:      Diff policy filename.
+ *
+ * Returns true on success, false otherwise.
+ *
+ * The identity of @base and @src is recorded so that read_domain_snapshot()
+ * ignores the snapshot once either of them changes.
+ */
+_Bool write_domain_snapshot(const struct domain_policy *dp,
+			   const char *snapshot, const char *base,
+			   const char *src)
+{
+	struct name_map map = { NULL, 0, 0 };
+	const struct path_info **string = NULL;
+	struct snapshot_header *header;
+	struct snapshot_string *ss;
+	struct snapshot_domain *sd;
+	u32 *acl;
+	char *data;
+	char *tmp;
+	char *buf;
+	u32 string_count = 0;
+	u64 acl_count = 0;
+	u64 data_size = 0;
+	u64 size;
+	u64 acl_index = 0;
+	FILE *fp;
+	_Bool result;
+	int i;
+	u32 j;
+	for (i = 0; i < dp->list_len; i++) {
+		const struct domain_info *domain = &dp->list[i];
+		int k;
+		snapshot_string_index(&map, &string, &string_count,
+				      &data_size, domain->domainname);
+		for (k = 0; k < domain->string_count; k++) {
+			if (!domain->string_ptr[k])
+				continue;
+			snapshot_string_index(&map, &string, &string_count,
+					      &data_size,
+					      domain->string_ptr[k]);
+			acl_count++;
+		}
+	}
+	size = sizeof(*header);
+	size += string_count * sizeof(*ss);
+	size += dp->list_len * sizeof(*sd);
+	size += (acl_count * sizeof(*acl) + 7) & ~7ULL;
+	size += (data_size + 7) & ~7ULL;
+	buf = calloc(1, size);
+	if (!buf)
+		out_of_memory();
+	header = (struct snapshot_header *) buf;
+	memmove(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header->version = SNAPSHOT_VERSION;
+	header->byte_order = SNAPSHOT_BYTE_ORDER;
+	header->size = size;
+	stat_snapshot_source(&header->source[0], base);
+	stat_snapshot_source(&header->source[1], src);
+	header->string_count = string_count;
+	header->domain_count = dp->list_len;
+	header->acl_count = acl_count;
+	header->string_offset = sizeof(*header);
+	header->domain_offset = header->string_offset +
+		string_count * sizeof(*ss);
+	header->acl_offset = header->domain_offset +
+		dp->list_len * sizeof(*sd);
+	header->data_offset = header->acl_offset +
+		((acl_count * sizeof(*acl) + 7) & ~7ULL);
+	header->data_size = data_size;
+	ss = (struct snapshot_string *) (buf + header->string_offset);
+	sd = (struct snapshot_domain *) (buf + header->domain_offset);
+	acl = (u32 *) (buf + header->acl_offset);
+	data = buf + header->data_offset;
+	for (j = 0; j < string_count; j++) {
+		const struct path_info *name = string[j];
+		const u32 len = strlen(name->name);
+		ss[j].name = data - (buf + header->data_offset);
+		ss[j].total_len = len;
+		ss[j].const_len = name->const_len;
+		ss[j].hash = name->hash;
+		ss[j].depth = name->depth;
+		ss[j].is_dir = name->is_dir;
+		ss[j].is_patterned = name->is_patterned;
+		memmove(data, name->name, len + 1);
+		data += len + 1;
+	}
+	for (i = 0; i < dp->list_len; i++) {
+		const struct domain_info *domain = &dp->list[i];
+		int k;
+		sd[i].domainname = *name_map_value(&map, domain->domainname,
+						   false) - 1;
+		sd[i].profile = domain->profile;
+		sd[i].acl_start = acl_index;
+		for (k = 0; k < domain->string_count; k++)
+			if (domain->string_ptr[k])
+				acl[acl_index++] =
+					*name_map_value(&map,
+							domain->string_ptr[k],
+							false) - 1;
+		sd[i].acl_count = acl_index - sd[i].acl_start;
+	}
+	header->checksum = snapshot_checksum(buf + sizeof(*header),
+					     size - sizeof(*header));
+	clear_name_map(&map);
+	free(string);
+	/* Replace the old snapshot atomically. */
+	tmp = malloc(strlen(snapshot) + 5);
+	if (!tmp)
+		out_of_memory();
+	sprintf(tmp, "%s.tmp", snapshot);
+	fp = fopen(tmp, "w");
+	result = fp && fwrite(buf, size, 1, fp) == 1;
+	if (fp && fclose(fp))
+		result = false;
+	if (result && rename(tmp, snapshot))
+		result = false;
+	if (!result) {
+		fprintf(stderr, "Can't write %s\n", snapshot);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(buf);
+	return result;
+}
+
+/* Returns true if the snapshot at @buf of @len bytes is intact. */
+static _Bool snapshot_ok(const char *buf, const u64 len, const char *base,
+			 const char *src)
+{
+	const struct snapshot_header *header =
+		(const struct snapshot_header *) buf;
+	const struct snapshot_string *ss;
+	const struct snapshot_domain *sd;
+	const u32 *acl;
+	const char *data;
+	struct snapshot_source source;
+	u64 i;
+	if (len < sizeof(*header) ||
+	    memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) ||
+	    header->version != SNAPSHOT_VERSION ||
+	    header->byte_order != SNAPSHOT_BYTE_ORDER || header->size != len)
+		return false;
+	stat_snapshot_source(&source, base);
+	if (memcmp(&source, &header->source[0], sizeof(source)))
+		return false;
+	stat_snapshot_source(&source, src);
+	if (memcmp(&source, &header->source[1], sizeof(source)))
+		return false;
+	if (!snapshot_table_ok(header->string_offset, header->string_count,
+			       sizeof(*ss), len) ||
+	    !snapshot_table_ok(header->domain_offset, header->domain_count,
+			       sizeof(*sd), len) ||
+	    !snapshot_table_ok(header->acl_offset, header->acl_count,
+			       sizeof(*acl), len) ||
+	    !snapshot_table_ok(header->data_offset, header->data_size, 1,
+			       len) ||
+	    header->checksum != snapshot_checksum(buf + sizeof(*header),
+						  len - sizeof(*header)))
+		return false;
+	ss = (const struct snapshot_string *) (buf + header->string_offset);
+	sd = (const struct snapshot_domain *) (buf + header->domain_offset);
+	acl = (const u32 *) (buf + header->acl_offset);
+	data = buf + header->data_offset;
+	for (i = 0; i < header->string_count; i++) {
+		const char *cp;
+		if (ss[i].name >= header->data_size)
+			return false;
+		cp = memchr(data + ss[i].name, '\0',
+			    header->data_size - ss[i].name);
+		if (!cp || cp - (data + ss[i].name) != ss[i].total_len)
+			return false;
+	}
+	for (i = 0; i < header->domain_count; i++)
+		if (sd[i].domainname >= header->string_count ||
+		    sd[i].acl_start > header->acl_count ||
+		    sd[i].acl_count > header->acl_count - sd[i].acl_start)
+			return false;
+	for (i = 0; i < header->acl_count; i++)
+		if (acl[i] >= header->string_count)
+			return false;
+	return true;
+}
+
+/**
+ * read_domain_snapshot - Load domain policy from a compiled snapshot.
+ *
+ * @dp:       Pointer to empty "struct domain_policy".
+ * @snapshot: Filename written by write_domain_snapshot().
+ * @base:     Base policy filename.
+ * @src:      Diff policy filename.
+ *
+ * Returns true if @dp was loaded, false if the snapshot is missing, damaged
+ * or older than @base or @src. The caller must read @base and @src then.
+ */
+_Bool read_domain_snapshot(struct domain_policy *dp, const char *snapshot,
+			  const char *base, const char *src)
+{
+	const struct snapshot_header *header;
+	const struct snapshot_string *ss;
+	const struct snapshot_domain *sd;
+	const struct path_info **name;
+	const u32 *acl;
+	const char *data;
+	struct stat buf;
+	char *map;
+	u32 i;
+	const int fd = open(snapshot, O_RDONLY);
+	if (fd == EOF)
+		return false;
+	if (dp->list_len || fstat(fd, &buf) || buf.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return false;
+	if (!snapshot_ok(map, buf.st_size, base, src)) {
+		munmap(map, buf.st_size);
+		return false;
+	}
+	header = (const struct snapshot_header *) map;
+	ss = (const struct snapshot_string *) (map + header->string_offset);
+	sd = (const struct snapshot_domain *) (map + header->domain_offset);
+	acl = (const u32 *) (map + header->acl_offset);
+	data = map + header->data_offset;
+	name = malloc((header->string_count + 1) * sizeof(*name));
+	if (!name)
+		out_of_memory();
+	for (i = 0; i < header->string_count; i++) {
+		struct path_info info;
+		info.name = data + ss[i].name;
+		info.total_len = ss[i].total_len;
+		info.const_len = ss[i].const_len;
+		info.hash = ss[i].hash;
+		info.depth = ss[i].depth;
+		info.is_dir = ss[i].is_dir;
+		info.is_patterned = ss[i].is_patterned;
+		info.program = NULL;
+		name[i] = savename_info(&info);
+	}
+	dp->list = realloc(dp->list, (header->domain_count + 1) *
+			   sizeof(struct domain_info));
+	if (!dp->list)
+		out_of_memory();
+	memset(dp->list, 0, header->domain_count * sizeof(struct domain_info));
+	for (i = 0; i < header->domain_count; i++) {
+		struct domain_info *domain = &dp->list[i];
+		u64 j;
+		domain->domainname = name[sd[i].domainname];
+		domain->profile = sd[i].profile;
+		domain->string_ptr = malloc((sd[i].acl_count + 1) *
+					    sizeof(const struct path_info *));
+		if (!domain->string_ptr)
+			out_of_memory();
+		for (j = 0; j < sd[i].acl_count; j++)
+			domain->string_ptr[j] = name[acl[sd[i].acl_start + j]];
+		domain->string_count = sd[i].acl_count;
+		domain->string_size = sd[i].acl_count;
+	}
+	dp->list_len = header->domain_count;
+	rebuild_domain_hash(dp);
+	free(name);
+	munmap(map, buf.st_size);
+	return true;
+}
+
 void delete_domain(struct domain_policy *dp, const int index)
 {
 	if (index >= 0 && index < dp->list_len) {
 		int i;
 		free(dp->list[index].string_ptr);
+		free(dp->list[index].string_hash);
+		clear_domain_rows(dp);
 		for (i = index; i < dp->list_len - 1; i++)
 			dp->list[i] = dp->list[i + 1];
 		dp->list_len--;
+		rebuild_domain_hash(dp);
 	}
 }
 
 void handle_domain_policy(struct domain_policy *dp, FILE *fp, _Bool is_write)
 {
+	struct line_reader reader;
+	struct policy_writer writer;
+	char *line;
 	int i;
 	int index = EOF;
 	if (!is_write)
 		goto read_policy;
-	while (freadline(fp)) {
+	line_reader_open(&reader, fp, true);
+	while ((line = line_reader_next(&reader)) != NULL) {
 		_Bool is_delete = false;
 		_Bool is_select = false;
 		unsigned int profile;
-		if (str_starts(shared_buffer, "delete "))
+		if (str_starts(line, "delete "))
 			is_delete = true;
-		else if (str_starts(shared_buffer, "select "))
+		else if (str_starts(line, "select "))
 			is_select = true;
-		if (is_domain_def(shared_buffer)) {
+		if (is_domain_def(line)) {
 			if (is_delete) {
-				index = find_domain(dp, shared_buffer, false,
-						    false);
+				index = find_domain(dp, line, false, false);
 				if (index >= 0)
 					delete_domain(dp, index);
 				index = EOF;
 				continue;
 			}
 			if (is_select) {
-				index = find_domain(dp, shared_buffer, false,
-						    false);
+				index = find_domain(dp, line, false, false);
 				continue;
 			}
-			index = find_or_assign_new_domain(dp, shared_buffer,
-							  false, false);
+			index = find_or_assign_new_domain(dp, line, false,
+							  false);
 			continue;
 		}
-		if (index == EOF || !shared_buffer[0])
+		if (index == EOF || !line[0])
 			continue;
-		if (sscanf(shared_buffer, KEYWORD_USE_PROFILE "%u", &profile)
-		    == 1)
+		if (sscanf(line, KEYWORD_USE_PROFILE "%u", &profile) == 1)
 			dp->list[index].profile = (u8) profile;
 		else if (is_delete)
-			del_string_entry(dp, shared_buffer, index);
+			del_string_entry(dp, line, index);
 		else
-			add_string_entry(dp, shared_buffer, index);
+			add_string_entry(dp, line, index);
 	}
+	line_reader_close(&reader);
+	for (i = 0; i < dp->list_len; i++)
+		compact_string_entries(&dp->list[i]);
 	return;
 read_policy:
+	fflush(fp);
+	policy_writer_open(&writer, fileno(fp));
 	for (i = 0; i < dp->list_len; i++) {
 		int j;
+		const struct path_info *domainname = dp->list[i].domainname;
 		const struct path_info **string_ptr
 			= dp->list[i].string_ptr;
 		const int string_count = dp->list[i].string_count;
-		fprintf(fp, "%s\n" KEYWORD_USE_PROFILE "%u\n\n",
-			domain_name(dp, i), dp->list[i].profile);
-		for (j = 0; j < string_count; j++)
-			fprintf(fp, "%s\n", string_ptr[j]->name);
-		fprintf(fp, "\n");
+		char profile[sizeof(KEYWORD_USE_PROFILE) + 16];
+		policy_writer_write(&writer, domainname->name,
+				    domainname->total_len);
+		policy_writer_write(&writer, profile,
+				    snprintf(profile, sizeof(profile),
+					     "\n" KEYWORD_USE_PROFILE "%u\n\n",
+					     dp->list[i].profile));
+		for (j = 0; j < string_count; j++) {
+			policy_writer_write(&writer, string_ptr[j]->name,
+					    string_ptr[j]->total_len);
+			policy_writer_write(&writer, "\n", 1);
+		}
+		policy_writer_write(&writer, "\n", 1);
 	}
+	/* The client has gone if this fails. Nothing to do. */
+	policy_writer_close(&writer);
 }
 
 /* Variables */
@@ -1118,6 +3433,249 @@ _Bool freadline(FILE *fp)
 	return true;
 }
 
+/**
+ * line_reader_open - Prepare for reading lines from a file.
+ *
+ * @reader: Pointer to "struct line_reader".
+ * @fp:     Pointer to "FILE" to read from.
+ * @normalize: True if lines are to be passed through normalize_line().
+ *
+ * Regular files which have not been read yet are mapped read-only and each
+ * line is copied from the mapping into a buffer which grows as needed, so
+ * the mapping stays clean page cache. Other files (pipes, /proc/ccs/
+ * interfaces, sockets) are streamed into that buffer.
+ * Unlike freadline(), lines are not limited to the size of shared_buffer.
+ */
+void line_reader_open(struct line_reader *reader, FILE *fp,
+		      const _Bool normalize)
+{
+	struct stat buf;
+	const int fd = fileno(fp);
+	memset(reader, 0, sizeof(*reader));
+	reader->fp = fp;
+	reader->normalize = normalize;
+	if (fstat(fd, &buf) || !S_ISREG(buf.st_mode) ||
+	    buf.st_size <= 0 || ftell(fp) || lseek(fd, 0, SEEK_CUR))
+		return;
+	reader->map = mmap(NULL, buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (reader->map == MAP_FAILED) {
+		reader->map = NULL;
+		return;
+	}
+	reader->map_size = buf.st_size;
+}
+
+/**
+ * line_reader_next - Return the next line.
+ *
+ * @reader: Pointer to "struct line_reader".
+ *
+ * Returns a '\0'-terminated line without the trailing newline, with its
+ * length stored in @reader->len, or NULL at the end of input. The line
+ * remains valid until the next call. A final line without a newline is
+ * not returned, as with freadline(), but is recorded in @reader->partial.
+ */
+char *line_reader_next(struct line_reader *reader)
+{
+	char *line;
+	size_t len;
+	if (reader->map) {
+		const char *start;
+		const char *cp;
+		if (reader->pos >= reader->map_size)
+			return NULL;
+		start = reader->map + reader->pos;
+		len = reader->map_size - reader->pos;
+		cp = memchr(start, '\n', len);
+		if (!cp) {
+			reader->pos = reader->map_size;
+			reader->partial = true;
+			return NULL;
+		}
+		len = cp - start;
+		reader->pos += len + 1;
+		line = copy_line(&reader->buffer, &reader->buffer_size, start,
+				 len);
+	} else if (!network_mode) {
+		const ssize_t ret = getline(&reader->buffer,
+					    &reader->buffer_size, reader->fp);
+		if (ret <= 0)
+			return NULL;
+		line = reader->buffer;
+		len = ret - 1;
+		if (line[len] != '\n') {
+			reader->partial = true;
+			return NULL;
+		}
+	} else {
+		int c;
+		len = 0;
+		while (true) {
+			if (len + 1 >= reader->buffer_size) {
+				reader->buffer_size = reader->buffer_size ?
+					reader->buffer_size * 2 : 8192;
+				reader->buffer = realloc(reader->buffer,
+							 reader->buffer_size);
+				if (!reader->buffer)
+					out_of_memory();
+			}
+			c = fgetc(reader->fp);
+			if (c == EOF || c == '\n' || !c)
+				break;
+			reader->buffer[len++] = c;
+		}
+		if (c != '\n') {
+			reader->partial = len != 0;
+			return NULL;
+		}
+		line = reader->buffer;
+	}
+	line[len] = '\0';
+	if (reader->normalize)
+		len = normalize_line((unsigned char *) line);
+	reader->len = len;
+	return line;
+}
+
+/**
+ * copy_line - Copy a line into a buffer which grows as needed.
+ *
+ * @buffer: Pointer to the buffer. Reallocated if too small.
+ * @size:   Pointer to the size of @buffer.
+ * @line:   Line to copy. Need not be '\0'-terminated.
+ * @len:    Length of @line.
+ *
+ * Returns the '\0'-terminated copy, which remains valid until the next call.
+ */
+char *copy_line(char **buffer, size_t *size, const char *line,
+		const size_t len)
+{
+	if (len + 1 > *size) {
+		*size = len + 1 > 8192 ? len + 1 : 8192;
+		free(*buffer);
+		*buffer = malloc(*size);
+		if (!*buffer)
+			out_of_memory();
+	}
+	memcpy(*buffer, line, len);
+	(*buffer)[len] = '\0';
+	return *buffer;
+}
+
+/**
+ * line_reader_close - Release resources held by a line reader.
+ *
+ * @reader: Pointer to "struct line_reader".
+ *
+ * Lines returned by line_reader_next() become invalid. The file itself is
+ * not closed.
+ */
+void line_reader_close(struct line_reader *reader)
+{
+	if (reader->map)
+		munmap((void *) reader->map, reader->map_size);
+	free(reader->buffer);
+	memset(reader, 0, sizeof(*reader));
+}
+
+/**
+ * policy_writer_open - Prepare for writing to a file descriptor.
+ *
+ * @writer: Pointer to "struct policy_writer".
+ * @fd:     File descriptor to write to. A pipe, a regular file, a socket to
+ *          the offline daemon or to the policy agent.
+ *
+ * Data passed to policy_writer_write() is coalesced into a buffer and written
+ * with as few system calls as possible. Callers which also use a "FILE" on
+ * @fd must fflush() it first.
+ */
+void policy_writer_open(struct policy_writer *writer, const int fd)
+{
+	memset(writer, 0, sizeof(*writer));
+	writer->fd = fd;
+	writer->buffer = malloc(POLICY_WRITER_BUFFER_SIZE);
+	if (!writer->buffer)
+		out_of_memory();
+}
+
+/* Write all of @iov, retrying short writes. Records the first error. */
+static void policy_writer_writev(struct policy_writer *writer,
+				 struct iovec *iov, int count)
+{
+	while (count && !writer->error) {
+		ssize_t ret = writev(writer->fd, iov, count);
+		if (ret < 0) {
+			if (errno != EINTR)
+				writer->error = errno;
+			continue;
+		}
+		while (count && (size_t) ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (char *) iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+/**
+ * policy_writer_write - Write data.
+ *
+ * @writer: Pointer to "struct policy_writer".
+ * @data:   Pointer to data.
+ * @len:    Length of @data.
+ *
+ * Data which does not fit in the buffer is written together with the buffer
+ * in one writev() call, without being copied. Data is discarded once a write
+ * failed, and policy_writer_close() reports the failure.
+ */
+void policy_writer_write(struct policy_writer *writer, const char *data,
+			 const size_t len)
+{
+	struct iovec iov[2];
+	if (len <= POLICY_WRITER_BUFFER_SIZE - writer->len) {
+		memcpy(writer->buffer + writer->len, data, len);
+		writer->len += len;
+		return;
+	}
+	iov[0].iov_base = writer->buffer;
+	iov[0].iov_len = writer->len;
+	iov[1].iov_base = (char *) data;
+	iov[1].iov_len = len;
+	policy_writer_writev(writer, iov, 2);
+	writer->len = 0;
+}
+
+void policy_writer_flush(struct policy_writer *writer)
+{
+	struct iovec iov;
+	iov.iov_base = writer->buffer;
+	iov.iov_len = writer->len;
+	policy_writer_writev(writer, &iov, 1);
+	writer->len = 0;
+}
+
+/**
+ * policy_writer_close - Flush and release a writer.
+ *
+ * @writer: Pointer to "struct policy_writer".
+ *
+ * Returns 0 if all data was written, negative errno otherwise. The file
+ * descriptor is not closed.
+ */
+int policy_writer_close(struct policy_writer *writer)
+{
+	int error;
+	policy_writer_flush(writer);
+	error = writer->error;
+	free(writer->buffer);
+	memset(writer, 0, sizeof(*writer));
+	return error ? -error : 0;
+}
+
 static void change_policy_dir(void)
 {
 	proc_policy_dir = "/sys/kernel/security/tomoyo/";
@@ -1177,6 +3735,8 @@ int main(int argc, char *argv[])
 		change_policy_dir();
 	if (strrchr(argv0, '/'))
 		argv0 = strrchr(argv0, '/') + 1;
+	if (getenv("CCSTOOLS_SAVENAME_STATS"))
+		atexit(savename_stats);
 retry:
 	if (!strcmp(argv0, "sortpolicy"))
 		ret = sortpolicy_main(argc, argv);
@@ -1188,6 +3748,8 @@ retry:
 		ret = diffpolicy_main(argc, argv);
 	else if (!strcmp(argv0, "savepolicy"))
 		ret = savepolicy_main(argc, argv);
+	else if (!strcmp(argv0, "restorepolicy"))
+		ret = restorepolicy_main(argc, argv);
 	else if (!strcmp(argv0, "pathmatch"))
 		ret = pathmatch_main(argc, argv);
 	else if (!strcmp(argv0, "loadpolicy"))
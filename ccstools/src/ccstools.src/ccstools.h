@@ -18,6 +18,8 @@
 #define u8 __u8
 #define u16 __u16
 #define u32 __u32
+#define s64 __s64
+#define u64 __u64
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <asm/types.h>
@@ -26,15 +28,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <syslog.h>
 #include <time.h>
@@ -62,10 +67,45 @@ enum policy_type {
 	POLICY_TYPE_SYSTEM_POLICY
 };
 
+/* What loadpolicy does with lines rejected by check_policy_line(). */
+enum load_check_mode {
+	LOAD_CHECK_NONE,              /* Don't check lines.                  */
+	LOAD_CHECK_ABORT,             /* Load nothing if a line is rejected. */
+	LOAD_CHECK_SKIP               /* Load all but rejected lines.        */
+};
+
 #define VALUE_TYPE_DECIMAL     1
 #define VALUE_TYPE_OCTAL       2
 #define VALUE_TYPE_HEXADECIMAL 3
 
+/* Instructions of a compiled pathname pattern. */
+enum pattern_op_type {
+	PATTERN_OP_END,          /* End of a "\-" separated segment.    */
+	PATTERN_OP_FAIL,         /* Bad pattern. Never matches.          */
+	PATTERN_OP_CHAR,         /* Literal character.                   */
+	PATTERN_OP_BACKSLASH,    /* "\\"                                 */
+	PATTERN_OP_OCTAL,        /* "\ooo"                               */
+	PATTERN_OP_ANY,          /* "\?"                                 */
+	PATTERN_OP_DECIMAL,      /* "\+" or the first character of "\$". */
+	PATTERN_OP_HEXADECIMAL,  /* "\x" or the first character of "\X". */
+	PATTERN_OP_ALPHABET,     /* "\a" or the first character of "\A". */
+	PATTERN_OP_STAR,         /* "\*"                                 */
+	PATTERN_OP_STAR_NO_DOT,  /* "\@"                                 */
+	PATTERN_OP_DECIMALS,     /* The rest of "\$".                    */
+	PATTERN_OP_HEXADECIMALS, /* The rest of "\X".                    */
+	PATTERN_OP_ALPHABETS     /* The rest of "\A".                    */
+};
+
+/* Operations recorded by the parallel domain policy reader. */
+enum policy_op_type {
+	POLICY_OP_DOMAIN,        /* "<kernel> ..."                       */
+	POLICY_OP_DELETE_DOMAIN, /* "delete <kernel> ..."                */
+	POLICY_OP_SELECT_DOMAIN, /* "select <kernel> ..."                */
+	POLICY_OP_PROFILE,       /* "use_profile ..."                    */
+	POLICY_OP_ADD,           /* ACL entry.                           */
+	POLICY_OP_DELETE         /* "delete " ACL entry.                 */
+};
+
 enum socket_operation_type {
 	NETWORK_ACL_UDP_BIND,
 	NETWORK_ACL_UDP_CONNECT,
@@ -110,16 +150,37 @@ enum socket_operation_type {
 #define KEYWORD_ALLOW_EXECUTE            "allow_execute "
 
 #define CCS_AUDITD_MAX_FILES             2
-#define SAVENAME_MAX_HASH                256
+#define SAVENAME_MIN_HASH_SIZE           1024
+#define SAVENAME_FILE_BYTES_PER_NAME     512
+#define SAVENAME_MAX_RESERVE             65536
 #define PAGE_SIZE                        4096
+#define ARENA_BLOCK_SIZE                 (PAGE_SIZE * 16)
 #define CCS_MAX_PATHNAME_LEN             4000
 #define ROOT_NAME                        "<kernel>"
 #define ROOT_NAME_LEN                    (sizeof(ROOT_NAME) - 1)
+#define POLICY_CHUNK_MIN_SIZE            (1 << 20)
+#define POLICY_CHUNK_MAX                 64
+#define SNAPSHOT_MAGIC                   "CCSSNAP"
+#define SNAPSHOT_VERSION                 1
+#define SNAPSHOT_BYTE_ORDER              0x01020304
+#define SORTPOLICY_MIN_MEMORY            (1 << 20)
+#define SORTPOLICY_MERGE_WAYS            64
+#define POLICY_WRITER_BUFFER_SIZE        (1 << 16)
+#define STORE_DIR                        "store/"
+#define STORE_CHUNK_MAX                  (1 << 20)
+#define STORE_LINE_MASK                  63
+#define STORE_DOMAIN_MASK                15
+
+/* Classes of bytes in policy text, see char_class[]. */
+#define CHAR_PLAIN                       1 /* Printable but ' ' and '\\'. */
+#define CHAR_SPACE                       2 /* Folded by normalize_line().   */
+#define CHAR_ILLEGAL                     4 /* Warned by checkpolicy.        */
 
 #define CCSTOOLS_CONFIG_FILE "/usr/lib/ccs/ccstools.conf"
 
 #define DISK_POLICY_DOMAIN_POLICY    "domain_policy.conf"
 #define BASE_POLICY_DOMAIN_POLICY    "domain_policy.base"
+#define SNAPSHOT_DOMAIN_POLICY       "domain_policy.snap"
 #define DISK_POLICY_EXCEPTION_POLICY "exception_policy.conf"
 #define BASE_POLICY_EXCEPTION_POLICY "exception_policy.base"
 #define DISK_POLICY_SYSTEM_POLICY    "system_policy.conf"
@@ -209,12 +270,80 @@ struct path_info {
 	_Bool is_dir;       /* = strendswith(name, "/")             */
 	_Bool is_patterned; /* = path_contains_pattern(name)        */
 	u16 depth;          /* = path_depth(name)                   */
+	/* = compile_pattern(name) if interned by savename(), NULL otherwise. */
+	const struct pattern_program *program;
+};
+
+struct pattern_op {
+	u8 type;                      /* One of "enum pattern_op_type".     */
+	char c[3];                    /* Characters to compare with.        */
+};
+
+struct pattern_component {
+	const char *start;            /* Beginning of the component.        */
+	unsigned int first_op;        /* Index of the first instruction.    */
+	unsigned int segments;        /* Number of "\-" separated segments. */
+};
+
+/*
+ * A pattern compiled into "/" separated components. Each component holds
+ * one or more "\-" separated segments, each terminated by PATTERN_OP_END.
+ */
+struct pattern_program {
+	const struct pattern_component *component;
+	const struct pattern_op *op;
+	unsigned int components;
+	unsigned int max_ops;         /* Longest segment, including END.    */
+};
+
+struct pattern_index_entry {
+	const struct path_info *pattern;
+	int value;
+	int next;                     /* Next entry of the same node.       */
+};
+
+struct pattern_index_edge {
+	int child;                    /* 0 if this slot is unused.          */
+	int parent;
+	u8 c;
+};
+
+/*
+ * Tries over the constant part of patterns, one for each depth, for finding
+ * the first pattern which matches a pathname without trying all of them.
+ * A zero-cleared "struct pattern_index" is an empty index.
+ */
+struct pattern_index {
+	struct pattern_index_entry *entry;
+	int entry_len;
+	int entry_size;
+	int *node;                    /* First entry of each node.          */
+	int node_len;
+	int node_size;
+	int *root;                    /* Root node of each depth.           */
+	int root_len;
+	struct pattern_index_edge *edge;
+	unsigned int edge_size;       /* Number of slots. Power of 2.       */
+	unsigned int edge_count;
+};
+
+/*
+ * Byte trie over a fixed set of keywords. Bytes used by no keyword share
+ * column 0 of no node, so a walk stops at the first such byte.
+ */
+struct keyword_trie {
+	u8 column[256];               /* Byte to column + 1, 0 if unused.   */
+	int columns;
+	int *child;                   /* By node * columns + column. 0: none */
+	int *value;                   /* Keyword ending at node, EOF if none. */
+	int len;                      /* Number of nodes.                   */
 };
 
 struct path_group_entry {
 	const struct path_info *group_name;
 	const struct path_info **member_name;
 	int member_name_len;
+	struct pattern_index member_index;
 };
 
 struct ip_address_entry {
@@ -229,15 +358,209 @@ struct address_group_entry {
 	int member_name_len;
 };
 
-struct savename_entry {
-	struct savename_entry *next;
-	struct path_info entry;
+struct savename_slot {
+	u32 hash;                     /* = entry->hash if entry != NULL */
+	const struct path_info *entry;
 };
 
-struct free_memory_block_list {
-	struct free_memory_block_list *next;
-	char *ptr;
-	int len;
+struct savename_table {
+	struct savename_slot *slot;
+	unsigned int size;            /* Number of slots. Power of 2.       */
+	unsigned int count;           /* Number of used slots.              */
+	unsigned long lookups;        /* Number of savename() calls.        */
+	unsigned long hits;           /* Number of names already interned.  */
+	unsigned long probes;         /* Number of slots visited.           */
+	unsigned int max_probes;      /* Longest probe sequence seen.       */
+	unsigned int resizes;         /* Number of times the table grew.    */
+};
+
+struct memory_block {
+	struct memory_block *next;
+	size_t size;                  /* Usable bytes following this header. */
+	size_t used;                  /* Bytes already handed out.           */
+};
+
+struct memory_arena {
+	struct memory_block *block;   /* Blocks of ARENA_BLOCK_SIZE bytes.    */
+	struct memory_block *large;   /* Blocks holding one large element.   */
+};
+
+struct policy_op {
+	unsigned int type:3;          /* One of POLICY_OP_*.                */
+	unsigned int value:29;        /* Chunk local name id or profile.    */
+};
+
+struct chunk_name {
+	const char *name;             /* Copy in the arena of the chunk.    */
+	u32 hash;
+};
+
+/* A part of domain policy parsed by a worker thread. */
+struct policy_chunk {
+	const char *start;            /* First line of this chunk.          */
+	const char *end;              /* End of the last line.              */
+	struct policy_op *op;
+	unsigned int op_len;
+	unsigned int op_size;
+	struct chunk_name *name;      /* Distinct names, indexed by id.     */
+	unsigned int name_len;
+	unsigned int name_size;
+	unsigned int *slot;           /* Hash of name. 0 or id + 1.         */
+	unsigned int slot_size;       /* Number of slots. Power of 2.       */
+	struct memory_arena names;    /* Copies of distinct names.          */
+	pthread_t thread;
+	_Bool is_threaded;            /* False if pthread_create() failed.  */
+};
+
+/* A part of policy checked by a worker thread of checkpolicy. */
+struct check_chunk {
+	const char *start;            /* First line of this chunk.          */
+	const char *end;              /* End of the last line.              */
+	unsigned int first_line;      /* Number of lines before start.      */
+	unsigned int last_line;       /* Number of lines before end.        */
+	unsigned int errors;
+	unsigned int warnings;
+	char *output;                 /* Diagnostics, in line order.        */
+	size_t output_len;
+	int policy_type;
+	pthread_t thread;
+	_Bool is_threaded;            /* False if pthread_create() failed.  */
+};
+
+/* An ACL on one pathname, looked up by checkpolicy's cross-reference mode. */
+struct xref_acl {
+	const struct path_info *key;  /* Directive and condition part.      */
+	const struct path_info *name; /* Pathname.                          */
+	int domain;                   /* Index of "struct domain_policy".   */
+	unsigned int line;
+	const struct path_info *pattern; /* Covering pattern, NULL if none. */
+	unsigned int pattern_line;
+};
+
+/*
+ * Layout of a compiled domain policy snapshot. All offsets are from the
+ * start of the file and all integers are in host byte order.
+ */
+struct snapshot_source {
+	u64 dev;                      /* Identity of the text policy file.  */
+	u64 ino;
+	u64 size;
+	s64 mtime;
+	u32 mtime_nsec;
+	u32 exists;                   /* 0 if the file did not exist.       */
+};
+
+struct snapshot_header {
+	char magic[8];                /* SNAPSHOT_MAGIC                     */
+	u32 version;                  /* SNAPSHOT_VERSION                   */
+	u32 byte_order;               /* SNAPSHOT_BYTE_ORDER                */
+	u64 size;                     /* Size of the whole snapshot.        */
+	u64 checksum;                 /* Of everything after this header.   */
+	struct snapshot_source source[2]; /* Base and diff policy.          */
+	u32 string_count;
+	u32 domain_count;
+	u64 acl_count;
+	u64 string_offset;            /* struct snapshot_string[]           */
+	u64 domain_offset;            /* struct snapshot_domain[]           */
+	u64 acl_offset;               /* u32[], indexes of strings.         */
+	u64 data_offset;              /* '\0'-terminated names.             */
+	u64 data_size;
+};
+
+/* Precomputed "struct path_info". */
+struct snapshot_string {
+	u64 name;                     /* Offset from data_offset.           */
+	u32 total_len;
+	u32 const_len;
+	u32 hash;
+	u32 depth;
+	u8 is_dir;
+	u8 is_patterned;
+	u8 pad[6];
+};
+
+struct snapshot_domain {
+	u32 domainname;               /* Index of strings.                  */
+	u32 profile;
+	u64 acl_start;                /* Index of the first ACL entry.      */
+	u64 acl_count;
+};
+
+/* A domain seen by "sortpolicy --max-memory=". */
+struct sort_domain {
+	const struct path_info *domainname;
+	u64 delete_line;              /* Line which last deleted it, or 0.  */
+	_Bool exists;
+};
+
+/* An ACL entry added or deleted, as spilled by "sortpolicy --max-memory=". */
+struct sort_record {
+	const char *entry;
+	u64 line;                     /* Line number in the input.          */
+	u32 domain;                   /* Index of "struct sort_domain".     */
+	u32 len;                      /* strlen(entry).                     */
+	u8 is_delete;
+};
+
+/* A sorted run of "struct sort_record" being merged. */
+struct sort_run {
+	FILE *fp;
+	struct sort_record record;    /* Current record.                    */
+	char *buffer;                 /* Holds record.entry.                */
+	u32 buffer_size;
+};
+
+struct name_map_entry {
+	const struct path_info *name; /* NULL if this slot is unused.       */
+	int value;
+};
+
+/* Hash table from savename()'d names to integers. */
+struct name_map {
+	struct name_map_entry *entry;
+	unsigned int size;            /* Number of slots. Power of 2.       */
+	unsigned int len;             /* Number of used slots.              */
+};
+
+struct line_reader {
+	FILE *fp;
+	const char *map;              /* Read-only mapping of a regular file. */
+	size_t map_size;
+	size_t pos;                   /* Offset of the next line in map.     */
+	char *buffer;                 /* Line buffer for streamed input.     */
+	size_t buffer_size;
+	int len;                      /* Length of the line last returned.   */
+	_Bool normalize;              /* Pass lines through normalize_line(). */
+	_Bool partial;                /* Input ended without a newline.      */
+};
+
+/* Coalesces small writes to a file descriptor. */
+struct policy_writer {
+	int fd;
+	char *buffer;                 /* POLICY_WRITER_BUFFER_SIZE bytes.    */
+	size_t len;                   /* Bytes waiting in buffer.            */
+	int error;                    /* errno of the first failure, or 0.   */
+};
+
+/*
+ * Saves policy text as chunks named by their content under STORE_DIR, plus
+ * a manifest listing the chunks of each saved policy. Chunks end at lines
+ * picked by their content, so that a change to a few lines changes only a
+ * few chunks.
+ */
+struct policy_store {
+	FILE *fp;                     /* Stream which policy is written to.  */
+	char *filename;               /* From make_filename().               */
+	const char *conf;             /* Symlink to the current policy.      */
+	char *chunk;                  /* Bytes not stored yet.               */
+	size_t len;
+	size_t size;
+	size_t line_start;            /* Offset of the incomplete line.      */
+	char *manifest;               /* "id length\n" for each chunk.       */
+	size_t manifest_len;
+	size_t manifest_size;
+	_Bool by_domain;              /* Cut only before domain definitions. */
+	_Bool error;
 };
 
 struct dll_pathname_entry {
@@ -264,7 +587,11 @@ struct domain_info {
 	const struct domain_initializer_entry *d_i; /* This may be NULL */
 	const struct domain_keeper_entry *d_k; /* This may be NULL */
 	const struct path_info **string_ptr;
-	int string_count;
+	int string_count;    /* Including NULL entries of deleted ones.  */
+	int string_size;     /* Allocated entries of string_ptr.         */
+	int string_deleted;  /* Number of NULL entries in string_ptr.    */
+	int *string_hash;    /* Index of string_ptr, EOF if unused.      */
+	unsigned int string_hash_size; /* Number of slots. Power of 2.   */
 	int number;   /* domain number (-1 if is_dis or is_dd) */
 	u8 profile;
 	_Bool is_dis; /* domain initializer source */
@@ -274,10 +601,65 @@ struct domain_info {
 	_Bool is_dd;  /* deleted domain */
 };
 
+/* Layout of a row of editpolicy's domain list. */
+struct domain_row {
+	char *text;                   /* Row after the flags, NULL if unused. */
+	int text_len;
+	int depth;                    /* Number of words before last name.  */
+	int last_name;                /* Offset of last word of domainname. */
+};
+
 struct domain_policy {
 	struct domain_info *list;
 	int list_len;
 	unsigned char *list_selected;
+	int *hash;                    /* Index of "list", EOF if unused.    */
+	unsigned int hash_size;       /* Number of slots. Power of 2.       */
+	struct domain_row *row;       /* Layout of "list", NULL if unused.  */
+};
+
+/*
+ * Summary of initialize_domain or keep_domain rules which share program,
+ * domainname and is_last_name.
+ */
+struct transition_rule_slot {
+	const struct path_info *program;    /* NULL if any program.         */
+	const struct path_info *domainname; /* NULL if any domain.          */
+	_Bool is_last_name;
+	_Bool is_used;
+	_Bool is_not;                 /* True if a "no_" rule exists.       */
+	int index;                    /* Last other rule, EOF if none.      */
+};
+
+struct transition_rule_index {
+	struct transition_rule_slot *slot;
+	unsigned int size;            /* Number of slots. Power of 2.       */
+	unsigned int len;             /* Number of used slots.              */
+	/*
+	 * Programs of initialize_domain rules, or domainnames of keep_domain
+	 * rules, which are not "no_" rules.
+	 */
+	struct name_map positive;
+};
+
+struct domain_tree_node {
+	const struct path_info *name; /* savename()d domainname.            */
+	const char *last_name;        /* Last word of name.                 */
+	int parent;                   /* Index of node, EOF for ROOT_NAME.  */
+	int domain;                   /* Index of list, EOF if none.        */
+	/* Initializer or keeper which makes this domain unreachable. */
+	int d_i;                      /* Rule number, EOF if none.          */
+	int d_k;                      /* Rule number, EOF if none.          */
+	/* Keeper for the child of ROOT_NAME this domain is under. */
+	int top_d_k;                  /* Rule number, EOF if none.          */
+};
+
+/* Domains and all their ancestors. Parents come before children. */
+struct domain_tree {
+	struct domain_tree_node *node;
+	int len;
+	int size;
+	struct name_map map;          /* Index of node + 1 by name.         */
 };
 
 struct generic_acl {
@@ -304,11 +686,43 @@ struct task_entry {
 
 /***** STRUCTURES DEFINITION END *****/
 
+/* Copied from kernel source. */
+static inline unsigned long partial_name_hash(unsigned long c,
+					      unsigned long prevhash)
+{
+	return (prevhash + (c << 4) + (c >> 4)) * 11;
+}
+
+/* Copied from kernel source. */
+static inline unsigned int full_name_hash(const unsigned char *name,
+					  unsigned int len)
+{
+	unsigned long hash = 0;
+	while (len--)
+		hash = partial_name_hash(*name++, hash);
+	return (unsigned int) hash;
+}
+
+/*
+ * Map "struct path_info"->hash to a slot of a hash table with @size slots,
+ * which must be a power of 2. The low bits of a product depend only on the
+ * low bits of @hash, so take the high bits, where every bit of @hash counts.
+ */
+static inline unsigned int hash_slot_index(const u32 hash,
+					   const unsigned int size)
+{
+	if (size <= 1)
+		return 0;
+	return (u32) (hash * 0x9E3779B9U) >> (__builtin_clz(size) + 1);
+}
+
 /***** PROTOTYPES DEFINITION START *****/
 
 _Bool check_remote_host(void);
 void out_of_memory(void);
-void normalize_line(unsigned char *line);
+int normalize_line(unsigned char *line);
+const char *skip_plain_chars(const char *str, const char *end);
+const char *skip_printable_chars(const char *str, const char *end);
 _Bool is_domain_def(const unsigned char *domainname);
 _Bool is_correct_domain(const unsigned char *domainname);
 void fprintf_encoded(FILE *fp, const char *pathname);
@@ -321,9 +735,51 @@ int string_compare(const void *a, const void *b);
 _Bool pathcmp(const struct path_info *a, const struct path_info *b);
 void fill_path_info(struct path_info *ptr);
 const struct path_info *savename(const char *name);
+const struct path_info *savename_info(const struct path_info *info);
+void savename_reserve(const unsigned long count);
+void savename_reserve_for_file(FILE *fp);
+void savename_reset(void);
+int *name_map_value(struct name_map *map, const struct path_info *name,
+		    const _Bool create);
+void clear_name_map(struct name_map *map);
+void add_transition_rule(struct transition_rule_index *index,
+			 const struct path_info *program,
+			 const struct path_info *domainname,
+			 const _Bool is_last_name, const _Bool is_not,
+			 const int rule);
+void clear_transition_rule_index(struct transition_rule_index *index);
+const struct path_info *last_name_of(const struct path_info *domainname);
+int find_domain_keeper(const struct transition_rule_index *index,
+		       const struct path_info *domainname, const char *program);
+int find_domain_initializer(const struct transition_rule_index *index,
+			    const struct path_info *domainname,
+			    const char *program);
+int domain_tree_add(struct domain_tree *tree, const struct path_info *name);
+void build_domain_tree(struct domain_tree *tree,
+		       const struct domain_policy *dp);
+void clear_domain_tree(struct domain_tree *tree);
+void find_unreachable_domains(struct domain_tree *tree,
+			      const struct transition_rule_index *initializer,
+			      const struct transition_rule_index *keeper);
+void *arena_alloc(struct memory_arena *arena, const size_t size);
+void arena_reset(struct memory_arena *arena);
 _Bool str_starts(char *str, const char *begin);
 _Bool path_matches_pattern(const struct path_info *pathname0,
 			   const struct path_info *pattern0);
+void compile_path_info(struct path_info *ptr);
+void free_path_info_program(struct path_info *ptr);
+void pattern_index_add(struct pattern_index *index,
+		       const struct path_info *pattern, const int value);
+int pattern_index_find(const struct pattern_index *index,
+		       const struct path_info *pathname);
+int pattern_index_find_name(const struct pattern_index *index,
+			    const struct path_info *pathname);
+void clear_pattern_index(struct pattern_index *index);
+void build_keyword_trie(struct keyword_trie *trie,
+			const char * const *keyword, const int count);
+int keyword_trie_find(const struct keyword_trie *trie, const char *str,
+		      const _Bool whole_word, int *len);
+void clear_keyword_trie(struct keyword_trie *trie);
 char *make_filename(const char *prefix, const time_t time);
 
 int sortpolicy_main(int argc, char *argv[]);
@@ -331,12 +787,15 @@ int setprofile_main(int argc, char *argv[]);
 int setlevel_main(int argc, char *argv[]);
 int diffpolicy_main(int argc, char *argv[]);
 int savepolicy_main(int argc, char *argv[]);
+int restorepolicy_main(int argc, char *argv[]);
 int pathmatch_main(int argc, char *argv[]);
 int loadpolicy_main(int argc, char *argv[]);
 int ldwatch_main(int argc, char *argv[]);
 int findtemp_main(int argc, char *argv[]);
 int editpolicy_main(int argc, char *argv[]);
 int checkpolicy_main(int argc, char *argv[]);
+unsigned int check_policy_line(const int policy_type, char *data,
+			       const unsigned int line_no);
 int ccstree_main(int argc, char *argv[]);
 int ccsqueryd_main(int argc, char *argv[]);
 int ccsauditd_main(int argc, char *argv[]);
@@ -344,23 +803,55 @@ int patternize_main(int argc, char *argv[]);
 void shprintf(const char *fmt, ...)
 	__attribute__ ((format(printf, 1, 2)));
 _Bool move_proc_to_file(const char *src, const char *base, const char *dest);
-_Bool is_identical_file(const char *file1, const char *file2);
+_Bool move_proc_to_store(const char *src, const char *base,
+			 const char *prefix, const time_t now,
+			 const _Bool force);
+FILE *open_policy_store(struct policy_store *store, const char *prefix,
+			const time_t now, const _Bool by_domain);
+_Bool close_policy_store(struct policy_store *store, const _Bool commit,
+			 const _Bool force);
+_Bool restore_policy_store(const char *manifest, FILE *fp);
 FILE *open_read(const char *filename);
 FILE *open_write(const char *filename);
 void clear_domain_policy(struct domain_policy *dp);
+void clear_domain_rows(struct domain_policy *dp);
 _Bool save_domain_policy_with_diff(struct domain_policy *dp,
 				   struct domain_policy *bp,
 				   const char *proc, const char *base,
 				   const char *diff);
+_Bool save_domain_policy_to_store(struct domain_policy *dp,
+				  struct domain_policy *bp,
+				  const char *proc, const char *base,
+				  const time_t now, const _Bool force);
 int find_domain_by_ptr(struct domain_policy *dp,
 		       const struct path_info *domainname);
+int find_domain_by_name(const struct domain_policy *dp,
+			const struct path_info *domainname,
+			const _Bool is_dis, const _Bool is_dd);
+void add_domain_hash(struct domain_policy *dp, const int index);
+void rebuild_domain_hash(struct domain_policy *dp);
+void print_missing_entries(FILE *fp, const char *prefix,
+			   const struct domain_info *domain,
+			   const struct domain_info *other,
+			   const char *separator, _Bool *first);
 void read_domain_policy(struct domain_policy *dp, const char *filename);
+_Bool read_domain_snapshot(struct domain_policy *dp, const char *snapshot,
+			  const char *base, const char *src);
+_Bool write_domain_snapshot(const struct domain_policy *dp,
+			   const char *snapshot, const char *base,
+			   const char *src);
 void delete_domain(struct domain_policy *dp, const int index);
 void handle_domain_policy(struct domain_policy *dp, FILE *fp, _Bool is_write);
+void sort_domain_policy(struct domain_policy *dp);
 int del_string_entry(struct domain_policy *dp, const char *entry,
 		     const int index);
 int add_string_entry(struct domain_policy *dp, const char *entry,
 		     const int index);
+int del_string_ptr(struct domain_policy *dp, const struct path_info *cp,
+		   const int index);
+int add_string_ptr(struct domain_policy *dp, const struct path_info *cp,
+		   const int index);
+void compact_string_entries(struct domain_info *domain);
 int find_domain(struct domain_policy *dp, const char *domainname0,
 		const _Bool is_dis, const _Bool is_dd);
 int find_or_assign_new_domain(struct domain_policy *dp, const char *domainname,
@@ -374,7 +865,8 @@ void editpolicy_try_optimize(struct domain_policy *dp, const int current,
 			     const int screen);
 struct path_group_entry *find_path_group(const char *group_name);
 int add_address_group_policy(char *data, const _Bool is_delete);
-u8 find_directive(const _Bool forward, char *line);
+void clear_address_group_list(void);
+u8 find_directive(const _Bool forward, const char *line, int *operand);
 void editpolicy_color_init(void);
 void editpolicy_color_change(const attr_t attr, const _Bool flg);
 void editpolicy_attr_change(const attr_t attr, const _Bool flg);
@@ -388,6 +880,17 @@ extern char shared_buffer[8192];
 void get(void);
 void put(void);
 _Bool freadline(FILE *fp);
+void line_reader_open(struct line_reader *reader, FILE *fp,
+		      const _Bool normalize);
+char *line_reader_next(struct line_reader *reader);
+char *copy_line(char **buffer, size_t *size, const char *line,
+		const size_t len);
+void line_reader_close(struct line_reader *reader);
+void policy_writer_open(struct policy_writer *writer, const int fd);
+void policy_writer_write(struct policy_writer *writer, const char *data,
+			 const size_t len);
+void policy_writer_flush(struct policy_writer *writer);
+int policy_writer_close(struct policy_writer *writer);
 
 char *simple_readline(const int start_y, const int start_x, const char *prompt,
 		      const char *history[], const int history_count,
@@ -396,6 +899,7 @@ int simple_add_history(const char *buffer, const char **history,
 		       const int history_count, const int max_history);
 int getch2(void);
 
+extern const u8 char_class[256];
 extern int ccs_major;
 extern int ccs_minor;
 extern int ccs_rev;
@@ -62,142 +62,163 @@ static char *find_condition_part(char *data)
 	return cp;
 }
 
-static unsigned int line = 0;
-static unsigned int errors = 0;
-static unsigned int warnings = 0;
+/* Per thread, for parts of policy are checked in parallel. */
+static __thread unsigned int line = 0;
+static __thread unsigned int errors = 0;
+static __thread unsigned int warnings = 0;
+static __thread FILE *report_fp = NULL; /* Diagnostics. stdout if NULL. */
+
+static void report(const char *fmt, ...)
+	__attribute__ ((format(printf, 1, 2)));
+
+static void report(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(report_fp ? report_fp : stdout, fmt, args);
+	va_end(args);
+}
+
+enum condition_keyword_index {
+	TASK_UID,
+	TASK_EUID,
+	TASK_SUID,
+	TASK_FSUID,
+	TASK_GID,
+	TASK_EGID,
+	TASK_SGID,
+	TASK_FSGID,
+	TASK_PID,
+	TASK_PPID,
+	EXEC_ARGC,
+	EXEC_ENVC,
+	TASK_STATE_0,
+	TASK_STATE_1,
+	TASK_STATE_2,
+	TYPE_SOCKET,
+	TYPE_SYMLINK,
+	TYPE_FILE,
+	TYPE_BLOCK_DEV,
+	TYPE_DIRECTORY,
+	TYPE_CHAR_DEV,
+	TYPE_FIFO,
+	MODE_SETUID,
+	MODE_SETGID,
+	MODE_STICKY,
+	MODE_OWNER_READ,
+	MODE_OWNER_WRITE,
+	MODE_OWNER_EXECUTE,
+	MODE_GROUP_READ,
+	MODE_GROUP_WRITE,
+	MODE_GROUP_EXECUTE,
+	MODE_OTHERS_READ,
+	MODE_OTHERS_WRITE,
+	MODE_OTHERS_EXECUTE,
+	TASK_TYPE,
+	TASK_EXECUTE_HANDLER,
+	PATH1_UID,
+	PATH1_GID,
+	PATH1_INO,
+	PATH1_PARENT_UID,
+	PATH1_PARENT_GID,
+	PATH1_PARENT_INO,
+	PATH2_PARENT_UID,
+	PATH2_PARENT_GID,
+	PATH2_PARENT_INO,
+	PATH1_TYPE,
+	PATH1_MAJOR,
+	PATH1_MINOR,
+	PATH1_DEV_MAJOR,
+	PATH1_DEV_MINOR,
+	PATH1_MODE,
+	PATH1_PARENT_MODE,
+	PATH2_PARENT_MODE,
+	EXEC_ARGV,
+	EXEC_ENVP,
+	MAX_KEYWORD
+};
+
+static const char *condition_control_keyword[MAX_KEYWORD] = {
+	[TASK_UID]             = "task.uid",
+	[TASK_EUID]            = "task.euid",
+	[TASK_SUID]            = "task.suid",
+	[TASK_FSUID]           = "task.fsuid",
+	[TASK_GID]             = "task.gid",
+	[TASK_EGID]            = "task.egid",
+	[TASK_SGID]            = "task.sgid",
+	[TASK_FSGID]           = "task.fsgid",
+	[TASK_PID]             = "task.pid",
+	[TASK_PPID]            = "task.ppid",
+	[EXEC_ARGC]            = "exec.argc",
+	[EXEC_ENVC]            = "exec.envc",
+	[TASK_STATE_0]         = "task.state[0]",
+	[TASK_STATE_1]         = "task.state[1]",
+	[TASK_STATE_2]         = "task.state[2]",
+	[TYPE_SOCKET]          = "socket",
+	[TYPE_SYMLINK]         = "symlink",
+	[TYPE_FILE]            = "file",
+	[TYPE_BLOCK_DEV]       = "block",
+	[TYPE_DIRECTORY]       = "directory",
+	[TYPE_CHAR_DEV]        = "char",
+	[TYPE_FIFO]            = "fifo",
+	[MODE_SETUID]          = "setuid",
+	[MODE_SETGID]          = "setgid",
+	[MODE_STICKY]          = "sticky",
+	[MODE_OWNER_READ]      = "owner_read",
+	[MODE_OWNER_WRITE]     = "owner_write",
+	[MODE_OWNER_EXECUTE]   = "owner_execute",
+	[MODE_GROUP_READ]      = "group_read",
+	[MODE_GROUP_WRITE]     = "group_write",
+	[MODE_GROUP_EXECUTE]   = "group_execute",
+	[MODE_OTHERS_READ]     = "others_read",
+	[MODE_OTHERS_WRITE]    = "others_write",
+	[MODE_OTHERS_EXECUTE]  = "others_execute",
+	[TASK_TYPE]            = "task.type",
+	[TASK_EXECUTE_HANDLER] = "execute_handler",
+	[PATH1_UID]            = "path1.uid",
+	[PATH1_GID]            = "path1.gid",
+	[PATH1_INO]            = "path1.ino",
+	[PATH1_PARENT_UID]     = "path1.parent.uid",
+	[PATH1_PARENT_GID]     = "path1.parent.gid",
+	[PATH1_PARENT_INO]     = "path1.parent.ino",
+	[PATH2_PARENT_UID]     = "path2.parent.uid",
+	[PATH2_PARENT_GID]     = "path2.parent.gid",
+	[PATH2_PARENT_INO]     = "path2.parent.ino",
+	[PATH1_TYPE]           = "path1.type",
+	[PATH1_MAJOR]          = "path1.major",
+	[PATH1_MINOR]          = "path1.minor",
+	[PATH1_DEV_MAJOR]      = "path1.dev_major",
+	[PATH1_DEV_MINOR]      = "path1.dev_minor",
+	[PATH1_MODE]           = "path1.perm",
+	[PATH1_PARENT_MODE]    = "path1.parent.perm",
+	[PATH2_PARENT_MODE]    = "path2.parent.perm",
+	[EXEC_ARGV]            = "exec.argv[",
+	[EXEC_ENVP]            = "exec.envp[\"",
+};
+
+/* Lookup of condition_control_keyword[], built on first use. */
+static struct keyword_trie condition_keyword_trie;
+static pthread_once_t condition_keyword_once = PTHREAD_ONCE_INIT;
+
+static void build_condition_keyword_trie(void)
+{
+	build_keyword_trie(&condition_keyword_trie, condition_control_keyword,
+			   MAX_KEYWORD);
+}
 
 static _Bool check_condition(char *condition)
 {
-	enum { TASK_UID,
-	       TASK_EUID,
-	       TASK_SUID,
-	       TASK_FSUID,
-	       TASK_GID,
-	       TASK_EGID,
-	       TASK_SGID,
-	       TASK_FSGID,
-	       TASK_PID,
-	       TASK_PPID,
-	       EXEC_ARGC,
-	       EXEC_ENVC,
-	       TASK_STATE_0,
-	       TASK_STATE_1,
-	       TASK_STATE_2,
-	       TYPE_SOCKET,
-	       TYPE_SYMLINK,
-	       TYPE_FILE,
-	       TYPE_BLOCK_DEV,
-	       TYPE_DIRECTORY,
-	       TYPE_CHAR_DEV,
-	       TYPE_FIFO,
-	       MODE_SETUID,
-	       MODE_SETGID,
-	       MODE_STICKY,
-	       MODE_OWNER_READ,
-	       MODE_OWNER_WRITE,
-	       MODE_OWNER_EXECUTE,
-	       MODE_GROUP_READ,
-	       MODE_GROUP_WRITE,
-	       MODE_GROUP_EXECUTE,
-	       MODE_OTHERS_READ,
-	       MODE_OTHERS_WRITE,
-	       MODE_OTHERS_EXECUTE,
-	       TASK_TYPE,
-	       TASK_EXECUTE_HANDLER,
-	       PATH1_UID,
-	       PATH1_GID,
-	       PATH1_INO,
-	       PATH1_PARENT_UID,
-	       PATH1_PARENT_GID,
-	       PATH1_PARENT_INO,
-	       PATH2_PARENT_UID,
-	       PATH2_PARENT_GID,
-	       PATH2_PARENT_INO,
-	       PATH1_TYPE,
-	       PATH1_MAJOR,
-	       PATH1_MINOR,
-	       PATH1_DEV_MAJOR,
-	       PATH1_DEV_MINOR,
-	       PATH1_MODE,
-	       PATH1_PARENT_MODE,
-	       PATH2_PARENT_MODE,
-	       EXEC_ARGV,
-	       EXEC_ENVP,
-	       MAX_KEYWORD };
-	static const char *condition_control_keyword[MAX_KEYWORD] = {
-		[TASK_UID]             = "task.uid",
-		[TASK_EUID]            = "task.euid",
-		[TASK_SUID]            = "task.suid",
-		[TASK_FSUID]           = "task.fsuid",
-		[TASK_GID]             = "task.gid",
-		[TASK_EGID]            = "task.egid",
-		[TASK_SGID]            = "task.sgid",
-		[TASK_FSGID]           = "task.fsgid",
-		[TASK_PID]             = "task.pid",
-		[TASK_PPID]            = "task.ppid",
-		[EXEC_ARGC]            = "exec.argc",
-		[EXEC_ENVC]            = "exec.envc",
-		[TASK_STATE_0]         = "task.state[0]",
-		[TASK_STATE_1]         = "task.state[1]",
-		[TASK_STATE_2]         = "task.state[2]",
-		[TYPE_SOCKET]          = "socket",
-		[TYPE_SYMLINK]         = "symlink",
-		[TYPE_FILE]            = "file",
-		[TYPE_BLOCK_DEV]       = "block",
-		[TYPE_DIRECTORY]       = "directory",
-		[TYPE_CHAR_DEV]        = "char",
-		[TYPE_FIFO]            = "fifo",
-		[MODE_SETUID]          = "setuid",
-		[MODE_SETGID]          = "setgid",
-		[MODE_STICKY]          = "sticky",
-		[MODE_OWNER_READ]      = "owner_read",
-		[MODE_OWNER_WRITE]     = "owner_write",
-		[MODE_OWNER_EXECUTE]   = "owner_execute",
-		[MODE_GROUP_READ]      = "group_read",
-		[MODE_GROUP_WRITE]     = "group_write",
-		[MODE_GROUP_EXECUTE]   = "group_execute",
-		[MODE_OTHERS_READ]     = "others_read",
-		[MODE_OTHERS_WRITE]    = "others_write",
-		[MODE_OTHERS_EXECUTE]  = "others_execute",
-		[TASK_TYPE]            = "task.type",
-		[TASK_EXECUTE_HANDLER] = "execute_handler",
-		[PATH1_UID]            = "path1.uid",
-		[PATH1_GID]            = "path1.gid",
-		[PATH1_INO]            = "path1.ino",
-		[PATH1_PARENT_UID]     = "path1.parent.uid",
-		[PATH1_PARENT_GID]     = "path1.parent.gid",
-		[PATH1_PARENT_INO]     = "path1.parent.ino",
-		[PATH2_PARENT_UID]     = "path2.parent.uid",
-		[PATH2_PARENT_GID]     = "path2.parent.gid",
-		[PATH2_PARENT_INO]     = "path2.parent.ino",
-		[PATH1_TYPE]           = "path1.type",
-		[PATH1_MAJOR]          = "path1.major",
-		[PATH1_MINOR]          = "path1.minor",
-		[PATH1_DEV_MAJOR]      = "path1.dev_major",
-		[PATH1_DEV_MINOR]      = "path1.dev_minor",
-		[PATH1_MODE]           = "path1.perm",
-		[PATH1_PARENT_MODE]    = "path1.parent.perm",
-		[PATH2_PARENT_MODE]    = "path2.parent.perm",
-		[EXEC_ARGV]            = "exec.argv[",
-		[EXEC_ENVP]            = "exec.envp[\"",
-	};
-	static u8 condition_control_keyword_len[MAX_KEYWORD];
 	char *start = condition;
-	u8 left;
-	u8 right;
+	int left;
+	int right;
+	int len;
 	u8 i;
 	unsigned long left_min = 0;
 	unsigned long left_max = 0;
 	unsigned long right_min = 0;
 	unsigned long right_max = 0;
 	u8 post_state[4] = { 0, 0, 0, 0 };
-	_Bool first = true;
-	if (first) {
-		first = false;
-		for (i = 0; i < MAX_KEYWORD; i++)
-			condition_control_keyword_len[i]
-				= strlen(condition_control_keyword[i]);
-	}
+	pthread_once(&condition_keyword_once, build_condition_keyword_trie);
 	condition = strstr(condition, "; set ");
 	if (condition) {
 		*condition = '\0';
@@ -236,22 +257,18 @@ static _Bool check_condition(char *condition)
 			condition++;
 		if (!*condition)
 			break;
-		for (left = 0; left < MAX_KEYWORD; left++) {
-			int len = condition_control_keyword_len[left];
-			if (strncmp(condition,
-				    condition_control_keyword[left],
-				    len))
-				continue;
+		left = keyword_trie_find(&condition_keyword_trie, condition,
+					 false, &len);
+		if (left == EOF)
+			left = MAX_KEYWORD;
+		else
 			condition += len;
-			break;
-		}
 		if (left == EXEC_ARGV) {
 			if (!parse_ulong(&left_min, &condition))
 				goto out;
 			if (*condition++ != ']')
 				goto out;
 		} else if (left == EXEC_ENVP) {
-			char *tmp = condition;
 			while (true) {
 				const char c = *condition;
 				/*
@@ -266,10 +283,6 @@ static _Bool check_condition(char *condition)
 					goto out;
 				condition++;
 			}
-			*condition = '\0';
-			if (!savename(tmp))
-				goto out;
-			*condition = '"';
 			condition += 2;
 		} else if (left == MAX_KEYWORD) {
 			if (!parse_ulong(&left_min, &condition))
@@ -296,10 +309,8 @@ static _Bool check_condition(char *condition)
 			goto out;
 		} else if (left == EXEC_ARGV || left == EXEC_ENVP) {
 			char c;
-			char *tmp;
 			if (*condition++ != '"')
 				goto out;
-			tmp = condition;
 			while (true) {
 				c = *condition++;
 				if (!c || c == ' ')
@@ -310,23 +321,14 @@ static _Bool check_condition(char *condition)
 				if (!c || c == ' ')
 					break;
 			}
-			c = *--condition;
-			*condition = '\0';
-			if (!savename(tmp))
-				goto out;
-			*condition = c;
-			condition++;
 			continue;
 		}
-		for (right = 0; right < MAX_KEYWORD; right++) {
-			int len = condition_control_keyword_len[right];
-			if (strncmp(condition,
-				    condition_control_keyword[right],
-				    len))
-				continue;
+		right = keyword_trie_find(&condition_keyword_trie, condition,
+					  false, &len);
+		if (right == EOF)
+			right = MAX_KEYWORD;
+		else
 			condition += len;
-			break;
-		}
 		if (right == MAX_KEYWORD) {
 			if (!parse_ulong(&right_min, &condition))
 				goto out;
@@ -340,7 +342,7 @@ static _Bool check_condition(char *condition)
 	}
 	return true;
 out:
-	printf("%u: ERROR: '%s' is an illegal condition.\n", line, start);
+	report("%u: ERROR: '%s' is an illegal condition.\n", line, start);
 	errors++;
 	return false;
 }
@@ -363,7 +365,7 @@ static void check_capability_policy(char *data)
 		if (!strcmp(data, capability_keywords[i]))
 			return;
 	}
-	printf("%u: ERROR: '%s' is a bad capability name.\n", line, data);
+	report("%u: ERROR: '%s' is a bad capability name.\n", line, data);
 	errors++;
 }
 
@@ -373,17 +375,17 @@ static void check_signal_policy(char *data)
 	char *cp;
 	cp = strchr(data, ' ');
 	if (!cp) {
-		printf("%u: ERROR: Too few parameters.\n", line);
+		report("%u: ERROR: Too few parameters.\n", line);
 		errors++;
 		return;
 	}
 	*cp++ = '\0';
 	if (sscanf(data, "%d", &sig) != 1) {
-		printf("%u: ERROR: '%s' is a bad signal number.\n", line, data);
+		report("%u: ERROR: '%s' is a bad signal number.\n", line, data);
 		errors++;
 	}
 	if (!is_correct_domain(cp)) {
-		printf("%u: ERROR: '%s' is a bad domainname.\n", line, cp);
+		report("%u: ERROR: '%s' is a bad domainname.\n", line, cp);
 		errors++;
 	}
 }
@@ -392,17 +394,17 @@ static void check_argv0_policy(char *data)
 {
 	char *argv0 = strchr(data, ' ');
 	if (!argv0) {
-		printf("%u: ERROR: Too few parameters.\n", line);
+		report("%u: ERROR: Too few parameters.\n", line);
 		errors++;
 		return;
 	}
 	*argv0++ = '\0';
 	if (!is_correct_path(data, 1, 0, -1)) {
-		printf("%u: ERROR: '%s' is a bad pathname.\n", line, data);
+		report("%u: ERROR: '%s' is a bad pathname.\n", line, data);
 		errors++;
 	}
 	if (!is_correct_path(argv0, -1, 0, -1) || strchr(argv0, '/')) {
-		printf("%u: ERROR: '%s' is a bad argv[0] name.\n", line, data);
+		report("%u: ERROR: '%s' is a bad argv[0] name.\n", line, data);
 		errors++;
 	}
 }
@@ -410,7 +412,7 @@ static void check_argv0_policy(char *data)
 static void check_env_policy(char *data)
 {
 	if (!is_correct_path(data, 0, 0, 0)) {
-		printf("%u: ERROR: '%s' is a bad variable name.\n", line, data);
+		report("%u: ERROR: '%s' is a bad variable name.\n", line, data);
 		errors++;
 	}
 }
@@ -421,13 +423,13 @@ static void check_ioctl_policy(char *data)
 	unsigned int start = 0;
 	unsigned int end = 0;
 	if (!cmd) {
-		printf("%u: ERROR: Too few parameters.\n", line);
+		report("%u: ERROR: Too few parameters.\n", line);
 		errors++;
 		return;
 	}
 	*cmd++ = '\0';
 	if (!is_correct_path(data, 0, 0, 0)) {
-		printf("%u: ERROR: '%s' is a bad pathname.\n", line, data);
+		report("%u: ERROR: '%s' is a bad pathname.\n", line, data);
 		errors++;
 	}
 	switch (sscanf(cmd, "%u-%u", &start, &end)) {
@@ -442,7 +444,7 @@ static void check_ioctl_policy(char *data)
 		break;
 	}
 	if (end < start) {
-		printf("%u: ERROR: '%s' is a bad cmd number.\n", line, cmd);
+		report("%u: ERROR: '%s' is a bad cmd number.\n", line, cmd);
 		errors++;
 	}
 }
@@ -542,7 +544,7 @@ next:
 			return;
 	}
 out:
-	printf("%u: ERROR: Bad network address.\n", line);
+	report("%u: ERROR: Bad network address.\n", line);
 	errors++;
 }
 
@@ -575,7 +577,7 @@ static void check_file_policy(char *data)
 	char *cp;
 	unsigned int perm;
 	if (!filename) {
-		printf("%u: ERROR: Unknown command '%s'\n", line, data);
+		report("%u: ERROR: Unknown command '%s'\n", line, data);
 		errors++;
 		return;
 	}
@@ -583,7 +585,7 @@ static void check_file_policy(char *data)
 	if (sscanf(data, "%u", &perm) == 1 && perm > 0 && perm <= 7) {
 		/* Don't reject path_group. */
 		if (filename[0] != '@' && strendswith(filename, "/")) {
-			printf("%u: WARNING: Only 'mkdir' and 'rmdir' are "
+			report("%u: WARNING: Only 'mkdir' and 'rmdir' are "
 			       "valid for directory '%s'.\n", line, filename);
 			warnings++;
 		}
@@ -617,12 +619,12 @@ static void check_file_policy(char *data)
 		if (!acl_type_array[type].keyword)
 			goto out2;
 out1:
-		printf("%u: ERROR: '%s' is a bad pathname.\n", line, filename);
+		report("%u: ERROR: '%s' is a bad pathname.\n", line, filename);
 		errors++;
 		return;
 	}
 out2:
-	printf("%u: ERROR: Invalid permission '%s %s'\n", line, data, filename);
+	report("%u: ERROR: Invalid permission '%s %s'\n", line, data, filename);
 	errors++;
 }
 
@@ -649,21 +651,21 @@ static void check_mount_policy(char *data)
 	if (!cp2)
 		goto out;
 	if (!is_correct_path(dev, 0, 0, 0)) {
-		printf("%u: ERROR: '%s' is a bad device name.\n", line, dir);
+		report("%u: ERROR: '%s' is a bad device name.\n", line, dir);
 		errors++;
 	}
 	if (!is_correct_path(dir, 0, 0, 0)) {
-		printf("%u: ERROR: '%s' is a bad mount point.\n", line, dir);
+		report("%u: ERROR: '%s' is a bad mount point.\n", line, dir);
 		errors++;
 	}
 	if (sscanf(cp2 + 1, "0x%X", &flags) != 1) {
-		printf("%u: ERROR: '%s' is a bad mount option.\n",
+		report("%u: ERROR: '%s' is a bad mount option.\n",
 		       line, cp2 + 1);
 		errors++;
 	}
 	return;
 out:
-	printf("%u: ERROR: Too few parameters.\n", line);
+	report("%u: ERROR: Too few parameters.\n", line);
 	errors++;
 }
 
@@ -674,16 +676,16 @@ static void check_pivot_root_policy(char *data)
 		goto out;
 	*cp++ = '\0';
 	if (!is_correct_path(data, 1, 0, 1)) {
-		printf("%u: ERROR: '%s' is a bad directory.\n", line, data);
+		report("%u: ERROR: '%s' is a bad directory.\n", line, data);
 		errors++;
 	}
 	if (!is_correct_path(cp, 1, 0, 1)) {
-		printf("%u: ERROR: '%s' is a bad directory.\n", line, cp);
+		report("%u: ERROR: '%s' is a bad directory.\n", line, cp);
 		errors++;
 	}
 	return;
 out:
-	printf("%u: ERROR: Too few parameters.\n", line);
+	report("%u: ERROR: Too few parameters.\n", line);
 	errors++;
 }
 
@@ -700,12 +702,12 @@ static void check_reserved_port_policy(char *data)
 		if (from < 65536)
 			return;
 	} else {
-		printf("%u: ERROR: Too few parameters.\n", line);
+		report("%u: ERROR: Too few parameters.\n", line);
 		errors++;
 		return;
 	}
 out:
-	printf("%u: ERROR: '%s' is a bad port number.\n", line, data);
+	report("%u: ERROR: '%s' is a bad port number.\n", line, data);
 	errors++;
 }
 
@@ -713,12 +715,12 @@ static void check_domain_initializer_entry(const char *domainname,
 					const char *program)
 {
 	if (!is_correct_path(program, 1, 0, -1)) {
-		printf("%u: ERROR: '%s' is a bad pathname.\n", line, program);
+		report("%u: ERROR: '%s' is a bad pathname.\n", line, program);
 		errors++;
 	}
 	if (domainname && !is_correct_path(domainname, 1, -1, -1) &&
 	    !is_correct_domain(domainname)) {
-		printf("%u: ERROR: '%s' is a bad domainname.\n",
+		report("%u: ERROR: '%s' is a bad domainname.\n",
 		       line, domainname);
 		errors++;
 	}
@@ -740,12 +742,12 @@ static void check_domain_keeper_entry(const char *domainname,
 {
 	if (!is_correct_path(domainname, 1, -1, -1) &&
 	    !is_correct_domain(domainname)) {
-		printf("%u: ERROR: '%s' is a bad domainname.\n",
+		report("%u: ERROR: '%s' is a bad domainname.\n",
 		       line, domainname);
 		errors++;
 	}
 	if (program && !is_correct_path(program, 1, 0, -1)) {
-		printf("%u: ERROR: '%s' is a bad pathname.\n", line, program);
+		report("%u: ERROR: '%s' is a bad pathname.\n", line, program);
 		errors++;
 	}
 }
@@ -765,17 +767,17 @@ static void check_path_group_policy(char *data)
 {
 	char *cp = strchr(data, ' ');
 	if (!cp) {
-		printf("%u: ERROR: Too few parameters.\n", line);
+		report("%u: ERROR: Too few parameters.\n", line);
 		errors++;
 		return;
 	}
 	*cp++ = '\0';
 	if (!is_correct_path(data, 0, 0, 0)) {
-		printf("%u: ERROR: '%s' is a bad group name.\n", line, data);
+		report("%u: ERROR: '%s' is a bad group name.\n", line, data);
 		errors++;
 	}
 	if (!is_correct_path(cp, 0, 0, 0)) {
-		printf("%u: ERROR: '%s' is a bad pathname.\n", line, cp);
+		report("%u: ERROR: '%s' is a bad pathname.\n", line, cp);
 		errors++;
 	}
 }
@@ -787,7 +789,7 @@ static void check_address_group_policy(char *data)
 	u16 max_address[8];
 	int count;
 	if (!cp) {
-		printf("%u: ERROR: Too few parameters.\n", line);
+		report("%u: ERROR: Too few parameters.\n", line);
 		errors++;
 		return;
 	}
@@ -808,27 +810,27 @@ static void check_address_group_policy(char *data)
 		       &max_address[2], &max_address[3]);
 	if (count == 4 || count == 8)
 		return;
-	printf("%u: ERROR: '%s' is a bad address.\n", line, cp);
+	report("%u: ERROR: '%s' is a bad address.\n", line, cp);
 	errors++;
 }
 
-static void check_domain_policy(void)
+static void check_domain_policy(char *data)
 {
-	static int domain = EOF;
+	static __thread int domain = EOF;
 	_Bool is_delete = false;
 	_Bool is_select = false;
 	_Bool is_undelete = false;
-	if (str_starts(shared_buffer, KEYWORD_DELETE))
+	if (str_starts(data, KEYWORD_DELETE))
 		is_delete = true;
-	else if (str_starts(shared_buffer, KEYWORD_SELECT))
+	else if (str_starts(data, KEYWORD_SELECT))
 		is_select = true;
-	else if (str_starts(shared_buffer, KEYWORD_UNDELETE))
+	else if (str_starts(data, KEYWORD_UNDELETE))
 		is_undelete = true;
-	if (is_domain_def(shared_buffer)) {
-		if (!is_correct_domain(shared_buffer) ||
-		    strlen(shared_buffer) >= CCS_MAX_PATHNAME_LEN) {
-			printf("%u: ERROR: '%s' is a bad domainname.\n",
-			       line, shared_buffer);
+	if (is_domain_def(data)) {
+		if (!is_correct_domain(data) ||
+		    strlen(data) >= CCS_MAX_PATHNAME_LEN) {
+			report("%u: ERROR: '%s' is a bad domainname.\n",
+			       line, data);
 			errors++;
 		} else {
 			if (is_delete)
@@ -837,174 +839,732 @@ static void check_domain_policy(void)
 				domain = 0;
 		}
 	} else if (is_select) {
-		printf("%u: ERROR: Command 'select' is valid for selecting "
+		report("%u: ERROR: Command 'select' is valid for selecting "
 		       "domains only.\n", line);
 		errors++;
 	} else if (is_undelete) {
-		printf("%u: ERROR: Command 'undelete' is valid for undeleting "
+		report("%u: ERROR: Command 'undelete' is valid for undeleting "
 		       "domains only.\n", line);
 		errors++;
 	} else if (domain == EOF) {
-		printf("%u: WARNING: '%s' is unprocessed because domain is not "
-		       "selected.\n", line, shared_buffer);
+		report("%u: WARNING: '%s' is unprocessed because domain is not "
+		       "selected.\n", line, data);
 		warnings++;
-	} else if (str_starts(shared_buffer, KEYWORD_USE_PROFILE)) {
+	} else if (str_starts(data, KEYWORD_USE_PROFILE)) {
 		unsigned int profile;
-		if (sscanf(shared_buffer, "%u", &profile) != 1 ||
+		if (sscanf(data, "%u", &profile) != 1 ||
 		    profile >= 256) {
-			printf("%u: ERROR: '%s' is a bad profile.\n",
-			       line, shared_buffer);
+			report("%u: ERROR: '%s' is a bad profile.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (!strcmp(shared_buffer, "ignore_global_allow_read")) {
+	} else if (!strcmp(data, "ignore_global_allow_read")) {
 		/* Nothing to do. */
-	} else if (!strcmp(shared_buffer, "ignore_global_allow_env")) {
+	} else if (!strcmp(data, "ignore_global_allow_env")) {
 		/* Nothing to do. */
-	} else if (str_starts(shared_buffer, "execute_handler ") ||
-		   str_starts(shared_buffer, "denied_execute_handler ")) {
-		if (!is_correct_path(shared_buffer, 1, -1, -1)) {
-			printf("%u: ERROR: '%s' is a bad pathname.\n",
-			       line, shared_buffer);
+	} else if (str_starts(data, "execute_handler ") ||
+		   str_starts(data, "denied_execute_handler ")) {
+		if (!is_correct_path(data, 1, -1, -1)) {
+			report("%u: ERROR: '%s' is a bad pathname.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (!strcmp(shared_buffer, "transition_failed")) {
+	} else if (!strcmp(data, "transition_failed")) {
 		/* Nothing to do. */
-	} else if (!strcmp(shared_buffer, "quota_exceeded")) {
+	} else if (!strcmp(data, "quota_exceeded")) {
 		/* Nothing to do. */
 	} else {
-		char *cp = find_condition_part(shared_buffer);
+		char *cp = find_condition_part(data);
 		if (cp && !check_condition(cp))
 			return;
-		if (str_starts(shared_buffer, KEYWORD_ALLOW_CAPABILITY))
-			check_capability_policy(shared_buffer);
-		else if (str_starts(shared_buffer, KEYWORD_ALLOW_NETWORK))
-			check_network_policy(shared_buffer);
-		else if (str_starts(shared_buffer, KEYWORD_ALLOW_SIGNAL))
-			check_signal_policy(shared_buffer);
-		else if (str_starts(shared_buffer, KEYWORD_ALLOW_ARGV0))
-			check_argv0_policy(shared_buffer);
-		else if (str_starts(shared_buffer, KEYWORD_ALLOW_ENV))
-			check_env_policy(shared_buffer);
-		else if (str_starts(shared_buffer, KEYWORD_ALLOW_IOCTL))
-			check_ioctl_policy(shared_buffer);
+		if (str_starts(data, KEYWORD_ALLOW_CAPABILITY))
+			check_capability_policy(data);
+		else if (str_starts(data, KEYWORD_ALLOW_NETWORK))
+			check_network_policy(data);
+		else if (str_starts(data, KEYWORD_ALLOW_SIGNAL))
+			check_signal_policy(data);
+		else if (str_starts(data, KEYWORD_ALLOW_ARGV0))
+			check_argv0_policy(data);
+		else if (str_starts(data, KEYWORD_ALLOW_ENV))
+			check_env_policy(data);
+		else if (str_starts(data, KEYWORD_ALLOW_IOCTL))
+			check_ioctl_policy(data);
 		else
-			check_file_policy(shared_buffer);
+			check_file_policy(data);
 	}
 }
 
-static void check_exception_policy(void)
+static void check_exception_policy(char *data)
 {
-	str_starts(shared_buffer, KEYWORD_DELETE);
-	if (str_starts(shared_buffer, KEYWORD_ALLOW_READ)) {
-		if (!is_correct_path(shared_buffer, 1, 0, -1)) {
-			printf("%u: ERROR: '%s' is a bad pathname.\n",
-			       line, shared_buffer);
+	str_starts(data, KEYWORD_DELETE);
+	if (str_starts(data, KEYWORD_ALLOW_READ)) {
+		if (!is_correct_path(data, 1, 0, -1)) {
+			report("%u: ERROR: '%s' is a bad pathname.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_INITIALIZE_DOMAIN)) {
-		check_domain_initializer_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_NO_INITIALIZE_DOMAIN)) {
-		check_domain_initializer_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_KEEP_DOMAIN)) {
-		check_domain_keeper_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_NO_KEEP_DOMAIN)) {
-		check_domain_keeper_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_PATH_GROUP)) {
-		check_path_group_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_ADDRESS_GROUP)) {
-		check_address_group_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_ALIAS)) {
-		char *cp = strchr(shared_buffer, ' ');
+	} else if (str_starts(data, KEYWORD_INITIALIZE_DOMAIN)) {
+		check_domain_initializer_policy(data);
+	} else if (str_starts(data, KEYWORD_NO_INITIALIZE_DOMAIN)) {
+		check_domain_initializer_policy(data);
+	} else if (str_starts(data, KEYWORD_KEEP_DOMAIN)) {
+		check_domain_keeper_policy(data);
+	} else if (str_starts(data, KEYWORD_NO_KEEP_DOMAIN)) {
+		check_domain_keeper_policy(data);
+	} else if (str_starts(data, KEYWORD_PATH_GROUP)) {
+		check_path_group_policy(data);
+	} else if (str_starts(data, KEYWORD_ADDRESS_GROUP)) {
+		check_address_group_policy(data);
+	} else if (str_starts(data, KEYWORD_ALIAS)) {
+		char *cp = strchr(data, ' ');
 		if (!cp) {
-			printf("%u: ERROR: Too few parameters.\n", line);
+			report("%u: ERROR: Too few parameters.\n", line);
 			errors++;
 		} else {
 			*cp++ = '\0';
-			if (!is_correct_path(shared_buffer, 1, -1, -1)) {
-				printf("%u: ERROR: '%s' is a bad pathname.\n",
-				       line, shared_buffer);
+			if (!is_correct_path(data, 1, -1, -1)) {
+				report("%u: ERROR: '%s' is a bad pathname.\n",
+				       line, data);
 				errors++;
 			}
 			if (!is_correct_path(cp, 1, -1, -1)) {
-				printf("%u: ERROR: '%s' is a bad pathname.\n",
+				report("%u: ERROR: '%s' is a bad pathname.\n",
 				       line, cp);
 				errors++;
 			}
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_AGGREGATOR)) {
-		char *cp = strchr(shared_buffer, ' ');
+	} else if (str_starts(data, KEYWORD_AGGREGATOR)) {
+		char *cp = strchr(data, ' ');
 		if (!cp) {
-			printf("%u: ERROR: Too few parameters.\n", line);
+			report("%u: ERROR: Too few parameters.\n", line);
 			errors++;
 		} else {
 			*cp++ = '\0';
-			if (!is_correct_path(shared_buffer, 1, 0, -1)) {
-				printf("%u: ERROR: '%s' is a bad pattern.\n",
-				       line, shared_buffer);
+			if (!is_correct_path(data, 1, 0, -1)) {
+				report("%u: ERROR: '%s' is a bad pattern.\n",
+				       line, data);
 				errors++;
 			}
 			if (!is_correct_path(cp, 1, -1, -1)) {
-				printf("%u: ERROR: '%s' is a bad pathname.\n",
+				report("%u: ERROR: '%s' is a bad pathname.\n",
 				       line, cp);
 				errors++;
 			}
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_FILE_PATTERN)) {
-		if (!is_correct_path(shared_buffer, 0, 1, 0)) {
-			printf("%u: ERROR: '%s' is a bad pattern.\n",
-			       line, shared_buffer);
+	} else if (str_starts(data, KEYWORD_FILE_PATTERN)) {
+		if (!is_correct_path(data, 0, 1, 0)) {
+			report("%u: ERROR: '%s' is a bad pattern.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_DENY_REWRITE)) {
-		if (!is_correct_path(shared_buffer, 0, 0, 0)) {
-			printf("%u: ERROR: '%s' is a bad pattern.\n",
-			       line, shared_buffer);
+	} else if (str_starts(data, KEYWORD_DENY_REWRITE)) {
+		if (!is_correct_path(data, 0, 0, 0)) {
+			report("%u: ERROR: '%s' is a bad pattern.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_ALLOW_ENV)) {
-		if (!is_correct_path(shared_buffer, 0, 0, 0)) {
-			printf("%u: ERROR: '%s' is a bad variable name.\n",
-			       line, shared_buffer);
+	} else if (str_starts(data, KEYWORD_ALLOW_ENV)) {
+		if (!is_correct_path(data, 0, 0, 0)) {
+			report("%u: ERROR: '%s' is a bad variable name.\n",
+			       line, data);
 			errors++;
 		}
 	} else {
-		printf("%u: ERROR: Unknown command '%s'.\n",
-		       line, shared_buffer);
+		report("%u: ERROR: Unknown command '%s'.\n",
+		       line, data);
 		errors++;
 	}
 }
 
-static void check_system_policy(void)
+static void check_system_policy(char *data)
 {
-	str_starts(shared_buffer, KEYWORD_DELETE);
-	if (str_starts(shared_buffer, KEYWORD_ALLOW_MOUNT)) {
-		check_mount_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_DENY_UNMOUNT)) {
-		if (!is_correct_path(shared_buffer, 1, 0, 1)) {
-			printf("%u: ERROR: '%s' is a bad pattern.\n",
-			       line, shared_buffer);
+	str_starts(data, KEYWORD_DELETE);
+	if (str_starts(data, KEYWORD_ALLOW_MOUNT)) {
+		check_mount_policy(data);
+	} else if (str_starts(data, KEYWORD_DENY_UNMOUNT)) {
+		if (!is_correct_path(data, 1, 0, 1)) {
+			report("%u: ERROR: '%s' is a bad pattern.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_ALLOW_CHROOT)) {
-		if (!is_correct_path(shared_buffer, 1, 0, 1)) {
-			printf("%u: ERROR: '%s' is a bad pattern.\n",
-			       line, shared_buffer);
+	} else if (str_starts(data, KEYWORD_ALLOW_CHROOT)) {
+		if (!is_correct_path(data, 1, 0, 1)) {
+			report("%u: ERROR: '%s' is a bad pattern.\n",
+			       line, data);
 			errors++;
 		}
-	} else if (str_starts(shared_buffer, KEYWORD_ALLOW_PIVOT_ROOT)) {
-		check_pivot_root_policy(shared_buffer);
-	} else if (str_starts(shared_buffer, KEYWORD_DENY_AUTOBIND)) {
-		check_reserved_port_policy(shared_buffer);
+	} else if (str_starts(data, KEYWORD_ALLOW_PIVOT_ROOT)) {
+		check_pivot_root_policy(data);
+	} else if (str_starts(data, KEYWORD_DENY_AUTOBIND)) {
+		check_reserved_port_policy(data);
 	} else {
-		printf("%u: ERROR: Unknown command '%s'.\n",
-		       line, shared_buffer);
+		report("%u: ERROR: Unknown command '%s'.\n",
+		       line, data);
 		errors++;
 	}
 }
 
+/**
+ * check_policy_line - Check one line of policy.
+ *
+ * @policy_type: One of POLICY_TYPE_*.
+ * @data:        A line passed through normalize_line(). Modified.
+ * @line_no:     Line number used in messages.
+ *
+ * Returns the number of errors found, which are printed to stdout.
+ * Domain policy is checked in the context of previous lines.
+ */
+unsigned int check_policy_line(const int policy_type, char *data,
+			       const unsigned int line_no)
+{
+	const unsigned int prev = errors;
+	line = line_no;
+	switch (policy_type) {
+	case POLICY_TYPE_DOMAIN_POLICY:
+		check_domain_policy(data);
+		break;
+	case POLICY_TYPE_EXCEPTION_POLICY:
+		check_exception_policy(data);
+		break;
+	case POLICY_TYPE_SYSTEM_POLICY:
+		check_system_policy(data);
+		break;
+	}
+	return errors - prev;
+}
+
+/* Check one line of @len bytes, which is modified. */
+static void check_line(const int policy_type, char *data, const int len)
+{
+	const char *cp = data;
+	const char *end = data + len;
+	int illegal = 256;
+	line++;
+	/* Only bytes out of ' ' .. '~' need a look. */
+	while ((cp = skip_printable_chars(cp, end)) < end) {
+		const u8 c = *cp++;
+		if ((char_class[c] & CHAR_ILLEGAL) && c < illegal)
+			illegal = c;
+	}
+	if (illegal < 256) {
+		report("%u: WARNING: Line contains illegal "
+		       "character (\\%03o).\n", line, illegal);
+		warnings++;
+	}
+	normalize_line((unsigned char *) data);
+	if (data[0])
+		check_policy_line(policy_type, data, line);
+}
+
+/*
+ * Worker thread. Diagnostics are buffered and printed by the caller.
+ * Also runs on the caller's thread if pthread_create() failed, so the
+ * caller's counters are saved and restored.
+ */
+static void *check_policy_chunk(void *arg)
+{
+	struct check_chunk *chunk = arg;
+	const char *data = chunk->start;
+	char *buffer = NULL;
+	size_t buffer_size = 0;
+	const unsigned int saved_errors = errors;
+	const unsigned int saved_warnings = warnings;
+	errors = 0;
+	warnings = 0;
+	report_fp = open_memstream(&chunk->output, &chunk->output_len);
+	if (!report_fp)
+		out_of_memory();
+	line = chunk->first_line;
+	while (data < chunk->end) {
+		const char *cp = memchr(data, '\n', chunk->end - data);
+		check_line(chunk->policy_type,
+			   copy_line(&buffer, &buffer_size, data, cp - data),
+			   cp - data);
+		data = cp + 1;
+	}
+	free(buffer);
+	fclose(report_fp);
+	report_fp = NULL;
+	chunk->last_line = line;
+	chunk->errors = errors;
+	chunk->warnings = warnings;
+	errors = saved_errors;
+	warnings = saved_warnings;
+	return NULL;
+}
+
+/*
+ * Returns true if the line at @cp can start a chunk. For domain policy, the
+ * line must select a domain so that the chunk does not depend on the
+ * domain selected by previous lines.
+ */
+static _Bool is_check_chunk_start(const int policy_type, const char *cp,
+				  const char *end)
+{
+	unsigned char buffer[CCS_MAX_PATHNAME_LEN];
+	const char *eol;
+	if (policy_type != POLICY_TYPE_DOMAIN_POLICY)
+		return true;
+	if (end - cp <= ROOT_NAME_LEN || memcmp(cp, ROOT_NAME, ROOT_NAME_LEN) ||
+	    (cp[ROOT_NAME_LEN] != ' ' && cp[ROOT_NAME_LEN] != '\n'))
+		return false;
+	eol = memchr(cp, '\n', end - cp);
+	if (eol - cp >= CCS_MAX_PATHNAME_LEN)
+		return false;
+	memcpy(buffer, cp, eol - cp);
+	buffer[eol - cp] = '\0';
+	normalize_line(buffer);
+	return is_domain_def(buffer) && is_correct_domain(buffer);
+}
+
+/*
+ * Returns the first line at or after @cp which can start a chunk, @end if
+ * none. Lines in @start .. @cp are counted into @lines.
+ */
+static const char *find_check_chunk_start(const int policy_type,
+					  const char *start, const char *cp,
+					  const char *end, unsigned int *lines)
+{
+	while (start < cp) {
+		const char *eol = memchr(start, '\n', end - start);
+		start = eol + 1;
+		(*lines)++;
+	}
+	while (start < end) {
+		if (is_check_chunk_start(policy_type, start, end))
+			return start;
+		start = memchr(start, '\n', end - start) + 1;
+		(*lines)++;
+	}
+	return end;
+}
+
+/**
+ * check_policy_parallel - Check a large policy file on all CPUs.
+ *
+ * @policy_type: One of POLICY_TYPE_*.
+ * @reader:      Pointer to "struct line_reader" opened on the policy.
+ *
+ * Returns true if the policy was checked, false if @reader is not mapped or
+ * is too small to be worth splitting. The caller must check it then.
+ *
+ * Each chunk is checked by its own thread and its diagnostics are printed
+ * in file order, so the output is identical to checking line by line.
+ */
+static _Bool check_policy_parallel(const int policy_type,
+				   struct line_reader *reader)
+{
+	struct check_chunk *chunk;
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *end;
+	unsigned int lines = 0;
+	long count;
+	int i;
+	count = reader->map_size / POLICY_CHUNK_MIN_SIZE;
+	if (count > cpus)
+		count = cpus;
+	if (count > POLICY_CHUNK_MAX)
+		count = POLICY_CHUNK_MAX;
+	if (!reader->map || count < 2)
+		return false;
+	/* A final line without a newline is left for the caller. */
+	end = reader->map + reader->map_size;
+	while (end > reader->map && end[-1] != '\n')
+		end--;
+	chunk = calloc(count, sizeof(*chunk));
+	if (!chunk)
+		out_of_memory();
+	for (i = 0; i < count; i++) {
+		const char *cp = end;
+		chunk[i].start = i ? chunk[i - 1].end : reader->map;
+		chunk[i].first_line = lines;
+		chunk[i].policy_type = policy_type;
+		if (i < count - 1) {
+			cp = reader->map + reader->map_size / count * (i + 1);
+			if (cp < chunk[i].start)
+				cp = chunk[i].start;
+			if (cp > end)
+				cp = end;
+			if (cp > chunk[i].start && cp[-1] != '\n')
+				cp = memchr(cp, '\n', end - cp) + 1;
+			cp = find_check_chunk_start(policy_type,
+						    chunk[i].start, cp, end,
+						    &lines);
+		}
+		chunk[i].end = cp;
+		chunk[i].is_threaded = !pthread_create(&chunk[i].thread, NULL,
+						       check_policy_chunk,
+						       &chunk[i]);
+		if (!chunk[i].is_threaded)
+			check_policy_chunk(&chunk[i]);
+	}
+	for (i = 0; i < count; i++) {
+		if (chunk[i].is_threaded)
+			pthread_join(chunk[i].thread, NULL);
+		fwrite(chunk[i].output, 1, chunk[i].output_len, stdout);
+		free(chunk[i].output);
+		errors += chunk[i].errors;
+		warnings += chunk[i].warnings;
+	}
+	line = chunk[count - 1].last_line;
+	free(chunk);
+	reader->pos = end - reader->map;
+	return true;
+}
+
+/* State of the cross-reference mode. */
+static struct transition_rule_index xref_initializer;
+static struct transition_rule_index xref_keeper;
+static struct name_map xref_path_group;
+static struct name_map xref_address_group;
+static struct domain_policy xref_domain;
+static unsigned int *xref_domain_line = NULL; /* Line defining the domain. */
+static struct xref_acl *xref_acl = NULL;
+static int xref_acl_len = 0;
+static int xref_acl_size = 0;
+
+/* Record "initialize_domain" or "keep_domain" at line number @rule. */
+static void xref_transition_rule(char *data, const _Bool is_keeper,
+				 const _Bool is_not, const unsigned int rule)
+{
+	char *cp = strstr(data, " from ");
+	const char *program = data;
+	const char *domainname = NULL;
+	_Bool is_last_name = false;
+	if (cp) {
+		*cp = '\0';
+		domainname = cp + 6;
+	} else if (is_keeper) {
+		program = NULL;
+		domainname = data;
+	}
+	if (program && !is_correct_path(program, 1, 0, -1))
+		return;
+	if (domainname) {
+		if (is_correct_path(domainname, 1, -1, -1))
+			is_last_name = true;
+		else if (!is_correct_domain((unsigned char *) domainname))
+			return;
+	}
+	add_transition_rule(is_keeper ? &xref_keeper : &xref_initializer,
+			    program ? savename(program) : NULL,
+			    domainname ? savename(domainname) : NULL,
+			    is_last_name, is_not, rule);
+}
+
+/* Record a group defined by "path_group" or "address_group". */
+static void xref_group(struct name_map *map, const char *data)
+{
+	const char *cp = strchr(data, ' ');
+	char *name;
+	if (!cp)
+		return;
+	name = strndup(data, cp - data);
+	if (!name)
+		out_of_memory();
+	*name_map_value(map, savename(name), true) = 1;
+	free(name);
+}
+
+static void xref_exception_policy(char *data, const unsigned int line_no)
+{
+	/* The policy is taken as is, like savepolicy writes it. */
+	if (str_starts(data, KEYWORD_DELETE))
+		return;
+	if (str_starts(data, KEYWORD_INITIALIZE_DOMAIN))
+		xref_transition_rule(data, false, false, line_no);
+	else if (str_starts(data, KEYWORD_NO_INITIALIZE_DOMAIN))
+		xref_transition_rule(data, false, true, line_no);
+	else if (str_starts(data, KEYWORD_KEEP_DOMAIN))
+		xref_transition_rule(data, true, false, line_no);
+	else if (str_starts(data, KEYWORD_NO_KEEP_DOMAIN))
+		xref_transition_rule(data, true, true, line_no);
+	else if (str_starts(data, KEYWORD_PATH_GROUP))
+		xref_group(&xref_path_group, data);
+	else if (str_starts(data, KEYWORD_ADDRESS_GROUP))
+		xref_group(&xref_address_group, data);
+}
+
+/* Warn if @name is "@group" and the group is not in @map. */
+static void xref_check_group(struct name_map *map, const char *keyword,
+			     const char *name)
+{
+	if (*name != '@' || name_map_value(map, savename(name + 1), false))
+		return;
+	report("%u: WARNING: %s '%s' is not defined.\n", line, keyword,
+	       name + 1);
+	warnings++;
+}
+
+static void xref_add_acl(const int domain, const char *directive,
+			 const char *condition, const char *name)
+{
+	struct xref_acl *acl;
+	char *key = NULL;
+	if (xref_acl_len == xref_acl_size) {
+		xref_acl_size = xref_acl_size ? xref_acl_size * 2 : 1024;
+		xref_acl = realloc(xref_acl, xref_acl_size *
+				   sizeof(struct xref_acl));
+		if (!xref_acl)
+			out_of_memory();
+	}
+	acl = &xref_acl[xref_acl_len++];
+	if (condition) {
+		if (asprintf(&key, "%s %s", directive, condition) == -1)
+			out_of_memory();
+		directive = key;
+	}
+	acl->key = savename(directive);
+	acl->name = savename(name);
+	acl->domain = domain;
+	acl->line = line;
+	acl->pattern = NULL;
+	free(key);
+}
+
+/* Look at one ACL line of domain @domain. */
+static void xref_domain_acl(const int domain, char *data)
+{
+	char *condition = find_condition_part(data);
+	char *operand = strchr(data, ' ');
+	char *cp;
+	unsigned int perm;
+	if (!operand)
+		return;
+	*operand++ = '\0';
+	if (!strcmp(data, "allow_network")) {
+		/* allow_network protocol operation address port */
+		cp = strchr(operand, ' ');
+		if (cp)
+			cp = strchr(cp + 1, ' ');
+		if (!cp)
+			return;
+		operand = cp + 1;
+		cp = strchr(operand, ' ');
+		if (cp)
+			*cp = '\0';
+		xref_check_group(&xref_address_group, "address_group",
+				 operand);
+		return;
+	}
+	if (sscanf(data, "%u", &perm) == 1 && perm > 0 && perm <= 7) {
+		/* "1", "3", "5", "7" don't accept patterns. */
+		if (perm & 1)
+			data = NULL;
+	} else if (strncmp(data, "allow_", 6) ||
+		   !strcmp(data, "allow_capability") ||
+		   !strcmp(data, "allow_signal") ||
+		   !strcmp(data, "allow_argv0") ||
+		   !strcmp(data, "allow_env") ||
+		   !strcmp(data, "allow_ioctl")) {
+		return;
+	} else if (!strcmp(data, "allow_link") ||
+		   !strcmp(data, "allow_rename")) {
+		cp = strchr(operand, ' ');
+		if (!cp)
+			return;
+		*cp++ = '\0';
+		xref_check_group(&xref_path_group, "path_group", cp);
+		data = NULL;
+	} else if (!strcmp(data, "allow_execute")) {
+		data = NULL;
+	}
+	if (strchr(operand, ' '))
+		return;
+	xref_check_group(&xref_path_group, "path_group", operand);
+	if (data && *operand != '@' && is_correct_path(operand, 0, 0, 0))
+		xref_add_acl(domain, data, condition, operand);
+}
+
+static void xref_domain_policy(char *data)
+{
+	static int domain = EOF;
+	_Bool is_delete = false;
+	_Bool is_select = false;
+	if (str_starts(data, KEYWORD_DELETE))
+		is_delete = true;
+	else if (str_starts(data, KEYWORD_SELECT))
+		is_select = true;
+	if (is_domain_def((unsigned char *) data)) {
+		const int len = xref_domain.list_len;
+		domain = EOF;
+		if (is_delete || !is_correct_domain((unsigned char *) data) ||
+		    strlen(data) >= CCS_MAX_PATHNAME_LEN)
+			return;
+		domain = find_or_assign_new_domain(&xref_domain, data, false,
+						   false);
+		if (xref_domain.list_len == len)
+			return;
+		xref_domain_line = realloc(xref_domain_line,
+					   xref_domain.list_len *
+					   sizeof(unsigned int));
+		if (!xref_domain_line)
+			out_of_memory();
+		xref_domain_line[domain] = line;
+	} else if (domain != EOF && !is_delete && !is_select) {
+		xref_domain_acl(domain, data);
+	}
+}
+
+static int xref_acl_compare(const void *a, const void *b)
+{
+	const struct xref_acl *a0 = a;
+	const struct xref_acl *b0 = b;
+	if (a0->domain != b0->domain)
+		return a0->domain - b0->domain;
+	if (a0->key != b0->key)
+		return strcmp(a0->key->name, b0->key->name);
+	return a0->line < b0->line ? -1 : a0->line > b0->line;
+}
+
+static int xref_acl_line_compare(const void *a, const void *b)
+{
+	const struct xref_acl *a0 = a;
+	const struct xref_acl *b0 = b;
+	return a0->line < b0->line ? -1 : a0->line > b0->line;
+}
+
+/* Warn about ACLs which a pattern in the same domain already allows. */
+static void xref_find_covered_acls(void)
+{
+	struct pattern_index index;
+	int i = 0;
+	memset(&index, 0, sizeof(index));
+	qsort(xref_acl, xref_acl_len, sizeof(struct xref_acl),
+	      xref_acl_compare);
+	while (i < xref_acl_len) {
+		int j;
+		int end = i;
+		_Bool has_pattern = false;
+		while (end < xref_acl_len &&
+		       xref_acl[end].domain == xref_acl[i].domain &&
+		       xref_acl[end].key == xref_acl[i].key) {
+			if (xref_acl[end].name->is_patterned) {
+				pattern_index_add(&index, xref_acl[end].name,
+						  end);
+				has_pattern = true;
+			}
+			end++;
+		}
+		for (j = i; has_pattern && j < end; j++) {
+			int k;
+			if (xref_acl[j].name->is_patterned)
+				continue;
+			k = pattern_index_find(&index, xref_acl[j].name);
+			if (k == EOF)
+				continue;
+			xref_acl[j].pattern = xref_acl[k].name;
+			xref_acl[j].pattern_line = xref_acl[k].line;
+		}
+		if (has_pattern)
+			clear_pattern_index(&index);
+		i = end;
+	}
+	qsort(xref_acl, xref_acl_len, sizeof(struct xref_acl),
+	      xref_acl_line_compare);
+	for (i = 0; i < xref_acl_len; i++) {
+		const struct xref_acl *acl = &xref_acl[i];
+		if (!acl->pattern)
+			continue;
+		report("%u: WARNING: '%s' is covered by '%s' at line %u.\n",
+		       acl->line, acl->name->name, acl->pattern->name,
+		       acl->pattern_line);
+		warnings++;
+	}
+}
+
+/* Warn about domains which initialize_domain or keep_domain hides. */
+static void xref_find_unreachable_domains(void)
+{
+	struct domain_tree tree;
+	int i;
+	memset(&tree, 0, sizeof(tree));
+	build_domain_tree(&tree, &xref_domain);
+	find_unreachable_domains(&tree, &xref_initializer, &xref_keeper);
+	for (i = 0; i < tree.len; i++) {
+		const struct domain_tree_node *node = &tree.node[i];
+		const char *keyword = "keep_domain";
+		int rule = node->top_d_k;
+		if (node->domain == EOF)
+			continue;
+		if (rule == EOF) {
+			rule = node->d_k;
+			if (node->d_i != EOF) {
+				keyword = "initialize_domain";
+				rule = node->d_i;
+			}
+		}
+		if (rule == EOF)
+			continue;
+		report("%u: WARNING: '%s' is unreachable because of %s at "
+		       "line %u of exception policy.\n",
+		       xref_domain_line[node->domain], node->name->name,
+		       keyword, rule);
+		warnings++;
+	}
+	clear_domain_tree(&tree);
+}
+
+/* Feed lines of @filename to @handler. Returns number of lines. */
+static unsigned int xref_read_policy(const char *filename,
+				     void (*handler) (char *data))
+{
+	struct line_reader reader;
+	char *data;
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		fprintf(stderr, "Can't open %s\n", filename);
+		exit(1);
+	}
+	line = 0;
+	line_reader_open(&reader, fp, true);
+	while ((data = line_reader_next(&reader)) != NULL) {
+		line++;
+		handler(data);
+	}
+	line_reader_close(&reader);
+	fclose(fp);
+	return line;
+}
+
+static void xref_exception_line(char *data)
+{
+	xref_exception_policy(data, line);
+}
+
+/**
+ * check_policy_references - Check exception and domain policy together.
+ *
+ * @exception_policy: Filename of exception policy.
+ * @domain_policy:    Filename of domain policy.
+ *
+ * Returns 0 if nothing was found, 1 otherwise.
+ *
+ * Lines are expected to pass the checks of "e" and "d" mode and are
+ * skipped if they don't. Line numbers are those of domain policy.
+ */
+static int check_policy_references(const char *exception_policy,
+				   const char *domain_policy)
+{
+	unsigned int lines = xref_read_policy(exception_policy,
+					      xref_exception_line);
+	lines += xref_read_policy(domain_policy, xref_domain_policy);
+	xref_find_covered_acls();
+	xref_find_unreachable_domains();
+	printf("Total:   %u Line%s   %u Domain%s   %u Warning%s\n",
+	       lines, lines > 1 ? "s" : "", xref_domain.list_len,
+	       xref_domain.list_len > 1 ? "s" : "", warnings,
+	       warnings > 1 ? "s" : "");
+	return warnings ? 1 : 0;
+}
+
 int checkpolicy_main(int argc, char *argv[])
 {
+	struct line_reader reader;
+	char *data;
 	int policy_type = POLICY_TYPE_UNKNOWN;
+	if (argc > 3 && !strcmp(argv[1], "x"))
+		return check_policy_references(argv[2], argv[3]);
 	if (argc > 1) {
 		switch (argv[1][0]) {
 		case 's':
@@ -1020,49 +1580,22 @@ int checkpolicy_main(int argc, char *argv[])
 	}
 	if (policy_type == POLICY_TYPE_UNKNOWN) {
 		fprintf(stderr, "%s s|e|d < policy_to_check\n", argv[0]);
+		fprintf(stderr, "%s x exception_policy domain_policy\n",
+			argv[0]);
 		return 0;
 	}
-	get();
-	while (memset(shared_buffer, 0, sizeof(shared_buffer)),
-	       fgets(shared_buffer, sizeof(shared_buffer) - 1, stdin)) {
-		char *cp = strchr(shared_buffer, '\n');
-		line++;
-		if (!cp) {
-			printf("%u: ERROR: Line too long.\n", line);
-			errors++;
-			break;
-		}
-		*cp = '\0';
-		{
-			int c;
-			for (c = 1; c < 256; c++) {
-				if (c == '\t' || c == '\r' ||
-				    (c >= ' ' && c < 127))
-					continue;
-				if (!strchr(shared_buffer, c))
-					continue;
-				printf("%u: WARNING: Line contains illegal "
-				       "character (\\%03o).\n", line, c);
-				warnings++;
-				break;
-			}
-		}
-		normalize_line(shared_buffer);
-		if (!shared_buffer[0])
-			continue;
-		switch (policy_type) {
-		case POLICY_TYPE_DOMAIN_POLICY:
-			check_domain_policy();
-			break;
-		case POLICY_TYPE_EXCEPTION_POLICY:
-			check_exception_policy();
-			break;
-		case POLICY_TYPE_SYSTEM_POLICY:
-			check_system_policy();
-			break;
-		}
+	line_reader_open(&reader, stdin, false);
+	if (check_policy_parallel(policy_type, &reader))
+		line_reader_next(&reader); /* Only to see a partial line. */
+	else
+		while ((data = line_reader_next(&reader)) != NULL)
+			check_line(policy_type, data, reader.len);
+	if (reader.partial) {
+		report("%u: ERROR: Missing newline at end of input.\n",
+		       ++line);
+		errors++;
 	}
-	put();
+	line_reader_close(&reader);
 	printf("Total:   %u Line%s   %u Error%s   %u Warning%s\n",
 	       line, line > 1 ? "s" : "", errors, errors > 1 ? "s" : "",
 	       warnings, warnings > 1 ? "s" : "");
@@ -27,15 +27,22 @@ static _Bool is_initializer_source(struct domain_policy *dp, const int index);
 static _Bool is_initializer_target(struct domain_policy *dp, const int index);
 static _Bool is_domain_unreachable(struct domain_policy *dp, const int index);
 static _Bool is_deleted_domain(struct domain_policy *dp, const int index);
-static const struct domain_keeper_entry *
-is_domain_keeper(const struct path_info *domainname, const char *program);
+static void rebuild_string_hash(struct domain_info *domain);
+static int find_string_entry(struct domain_info *domain,
+			     const struct path_info *cp);
 static const struct domain_initializer_entry *
 is_domain_initializer(const struct path_info *domainname, const char *program);
 static int generic_acl_compare(const void *a, const void *b);
 static int generic_acl_compare0(const void *a, const void *b);
 static int string_acl_compare(const void *a, const void *b);
 static int profile_entry_compare(const void *a, const void *b);
+static FILE *open_policy_file(const char *select);
+static int generic_acl_list_compare(const void *a, const void *b);
+static int load_generic_policy(struct generic_acl **list);
 static void read_generic_policy(void);
+static void update_list_indent(void);
+static u32 generic_acl_hash(const struct generic_acl *acl);
+static _Bool refresh_generic_policy(void);
 static int add_domain_initializer_entry(const char *domainname,
 					const char *program,
 					const _Bool is_not);
@@ -51,8 +58,14 @@ static void assign_domain_initializer_source(struct domain_policy *dp,
 					     const char *program);
 static int domainname_attribute_compare(const void *a, const void *b);
 static void read_domain_and_exception_policy(struct domain_policy *dp);
+static u64 digest_line(const u64 digest, const char *line);
+static u64 read_transition_policy_digest(void);
+static _Bool refresh_domain_policy(struct domain_policy *dp);
 static void show_current(struct domain_policy *dp);
 static const char *eat(const char *str);
+static void build_domain_rows(struct domain_policy *dp);
+static const struct domain_row *format_domain_row(struct domain_policy *dp,
+						   const int index);
 static int show_domain_line(struct domain_policy *dp, int index);
 static int show_acl_line(int index, int list_indent);
 static int show_profile_line(int index);
@@ -67,6 +80,7 @@ static void page_down_key(struct domain_policy *dp);
 static void show_current(struct domain_policy *dp);
 static void adjust_cursor_pos(const int item_count);
 static void set_cursor_pos(const int index);
+static void move_cursor_pos(const int index);
 static int count(const unsigned char *array, const int len);
 static int count2(const struct generic_acl *array, int len);
 static int select_item(struct domain_policy *dp, const int current);
@@ -104,11 +118,7 @@ static void copy_file(const char *source, const char *dest)
 static const char *get_last_name(const struct domain_policy *dp,
 				 const int index)
 {
-	const char *cp0 = domain_name(dp, index);
-	const char *cp1 = strrchr(cp0, ' ');
-	if (cp1)
-		return cp1 + 1;
-	return cp0;
+	return domain_name(dp, index) + dp->row[index].last_name;
 }
 
 static int count(const unsigned char *array, const int len)
@@ -156,13 +166,87 @@ static _Bool is_deleted_domain(struct domain_policy *dp, const int index)
 	return dp->list[index].is_dd;
 }
 
+/* Domains with fewer entries than this are searched without string_hash. */
+#define STRING_HASH_THRESHOLD 16
+
+static void rebuild_string_hash(struct domain_info *domain)
+{
+	unsigned int size = 64;
+	int i;
+	while (size * 3 < (domain->string_count + 1) * 4)
+		size <<= 1;
+	if (size != domain->string_hash_size) {
+		free(domain->string_hash);
+		domain->string_hash = malloc(size * sizeof(int));
+		if (!domain->string_hash)
+			out_of_memory();
+		domain->string_hash_size = size;
+	}
+	memset(domain->string_hash, EOF, size * sizeof(int));
+	for (i = 0; i < domain->string_count; i++) {
+		unsigned int j;
+		if (!domain->string_ptr[i])
+			continue;
+		j = hash_slot_index(domain->string_ptr[i]->hash, size);
+		while (domain->string_hash[j] != EOF)
+			j = (j + 1) & (size - 1);
+		domain->string_hash[j] = i;
+	}
+}
+
+/* Returns index of @cp in string_ptr, EOF if not found. */
+static int find_string_entry(struct domain_info *domain,
+			     const struct path_info *cp)
+{
+	unsigned int i;
+	if (domain->string_count < STRING_HASH_THRESHOLD) {
+		int j;
+		for (j = 0; j < domain->string_count; j++)
+			/* Faster comparison, for they are savename'd. */
+			if (cp == domain->string_ptr[j])
+				return j;
+		return EOF;
+	}
+	if (!domain->string_hash)
+		rebuild_string_hash(domain);
+	i = hash_slot_index(cp->hash, domain->string_hash_size);
+	while (domain->string_hash[i] != EOF) {
+		const int j = domain->string_hash[i];
+		/* Slots of deleted entries never match. */
+		if (cp == domain->string_ptr[j])
+			return j;
+		i = (i + 1) & (domain->string_hash_size - 1);
+	}
+	return EOF;
+}
+
+/**
+ * compact_string_entries - Remove NULL entries left by del_string_entry().
+ *
+ * @domain: Pointer to "struct domain_info".
+ *
+ * The order of remaining entries is preserved.
+ */
+void compact_string_entries(struct domain_info *domain)
+{
+	int i;
+	int j = 0;
+	if (!domain->string_deleted)
+		return;
+	for (i = 0; i < domain->string_count; i++)
+		if (domain->string_ptr[i])
+			domain->string_ptr[j++] = domain->string_ptr[i];
+	domain->string_count = j;
+	domain->string_deleted = 0;
+	free(domain->string_hash);
+	domain->string_hash = NULL;
+	domain->string_hash_size = 0;
+}
+
 int add_string_entry(struct domain_policy *dp, const char *entry,
 		     const int index)
 {
-	const struct path_info **acl_ptr;
-	int acl_count;
 	const struct path_info *cp;
-	int i;
 	if (index < 0 || index >= dp->list_len) {
 		fprintf(stderr, "%s: ERROR: domain is out of range.\n",
 			__func__);
@@ -173,34 +257,54 @@ int add_string_entry(struct domain_policy *dp, const char *entry,
 	cp = savename(entry);
 	if (!cp)
 		out_of_memory();
+	return add_string_ptr(dp, cp, index);
+}
 
-	acl_ptr = dp->list[index].string_ptr;
-	acl_count = dp->list[index].string_count;
+/* Same as add_string_entry(), but @cp is already savename()d. */
+int add_string_ptr(struct domain_policy *dp, const struct path_info *cp,
+		   const int index)
+{
+	struct domain_info *domain = &dp->list[index];
 
 	/* Check for the same entry. */
-	for (i = 0; i < acl_count; i++) {
-		/* Faster comparison, for they are savename'd. */
-		if (cp == acl_ptr[i])
-			return 0;
-	}
+	if (find_string_entry(domain, cp) != EOF)
+		return 0;
 
-	acl_ptr = realloc(acl_ptr, (acl_count + 1)
-			  * sizeof(const struct path_info *));
-	if (!acl_ptr)
-		out_of_memory();
-	acl_ptr[acl_count++] = cp;
-	dp->list[index].string_ptr = acl_ptr;
-	dp->list[index].string_count = acl_count;
+	if (domain->string_count == domain->string_size) {
+		domain->string_size = domain->string_size ?
+			domain->string_size * 2 : 4;
+		domain->string_ptr = realloc(domain->string_ptr,
+					     domain->string_size *
+					     sizeof(const struct path_info *));
+		if (!domain->string_ptr)
+			out_of_memory();
+	}
+	domain->string_ptr[domain->string_count++] = cp;
+	if (domain->string_hash) {
+		if (domain->string_count * 4 >
+		    domain->string_hash_size * 3) {
+			rebuild_string_hash(domain);
+		} else {
+			unsigned int i =
+				hash_slot_index(cp->hash,
+						domain->string_hash_size);
+			while (domain->string_hash[i] != EOF)
+				i = (i + 1) & (domain->string_hash_size - 1);
+			domain->string_hash[i] = domain->string_count - 1;
+		}
+	}
 	return 0;
 }
 
+/*
+ * Deleted entries are replaced with NULL so that other entries keep their
+ * index. Callers must call compact_string_entries() before reading
+ * string_ptr.
+ */
 int del_string_entry(struct domain_policy *dp, const char *entry,
 		     const int index)
 {
-	const struct path_info **acl_ptr;
-	int acl_count;
 	const struct path_info *cp;
-	int i;
 	if (index < 0 || index >= dp->list_len) {
 		fprintf(stderr, "%s: ERROR: domain is out of range.\n",
 			__func__);
@@ -211,36 +315,32 @@ int del_string_entry(struct domain_policy *dp, const char *entry,
 	cp = savename(entry);
 	if (!cp)
 		out_of_memory();
+	return del_string_ptr(dp, cp, index);
+}
 
-	acl_ptr = dp->list[index].string_ptr;
-	acl_count = dp->list[index].string_count;
-
-	for (i = 0; i < acl_count; i++) {
-		/* Faster comparison, for they are savename'd. */
-		if (cp != acl_ptr[i])
-			continue;
-		dp->list[index].string_count--;
-		for (; i < acl_count - 1; i++)
-			acl_ptr[i] = acl_ptr[i + 1];
-		return 0;
-	}
-	return -ENOENT;
+/* Same as del_string_entry(), but @cp is already savename()d. */
+int del_string_ptr(struct domain_policy *dp, const struct path_info *cp,
+		   const int index)
+{
+	struct domain_info *domain = &dp->list[index];
+	const int i = find_string_entry(domain, cp);
+	if (i == EOF)
+		return -ENOENT;
+	domain->string_ptr[i] = NULL;
+	domain->string_deleted++;
+	/* Don't let deleted entries dominate the array. */
+	if (domain->string_deleted * 2 > domain->string_count)
+		compact_string_entries(domain);
+	return 0;
 }
 
 int find_domain(struct domain_policy *dp, const char *domainname0,
 		const _Bool is_dis, const _Bool is_dd)
 {
-	int i;
 	struct path_info domainname;
 	domainname.name = domainname0;
 	fill_path_info(&domainname);
-	for (i = 0; i < dp->list_len; i++) {
-		if (dp->list[i].is_dis == is_dis &&
-		    dp->list[i].is_dd == is_dd &&
-		    !pathcmp(&domainname, dp->list[i].domainname))
-			return i;
-	}
-	return EOF;
+	return find_domain_by_name(dp, &domainname, is_dis, is_dd);
 }
 
 int find_or_assign_new_domain(struct domain_policy *dp, const char *domainname,
@@ -255,6 +355,7 @@ int find_or_assign_new_domain(struct domain_policy *dp, const char *domainname,
 			__func__, domainname);
 		return EOF;
 	}
+	clear_domain_rows(dp);
 	dp->list = realloc(dp->list, (dp->list_len + 1) *
 			   sizeof(struct domain_info));
 	if (!dp->list)
@@ -268,6 +369,7 @@ int find_or_assign_new_domain(struct domain_policy *dp, const char *domainname,
 	dp->list[dp->list_len].is_dis = is_dis;
 	dp->list[dp->list_len].is_dd = is_dd;
 	index = dp->list_len++;
+	add_domain_hash(dp, index);
 found:
 	return index;
 }
@@ -352,14 +454,89 @@ static int domainname_attribute_compare(const void *a, const void *b)
 }
 
 
-static int show_domain_line(struct domain_policy *dp, int index)
+/* Fill the layout of each row, once "list" of @dp is complete. */
+static void build_domain_rows(struct domain_policy *dp)
 {
-	int tmp_col = 0;
+	int index;
+	clear_domain_rows(dp);
+	dp->row = calloc(dp->list_len + 1, sizeof(struct domain_row));
+	if (!dp->row)
+		out_of_memory();
+	for (index = 0; index < dp->list_len; index++) {
+		struct domain_row *row = &dp->row[index];
+		const char *name = domain_name(dp, index);
+		const char *cp = name;
+		while ((cp = strchr(cp, ' ')) != NULL) {
+			row->depth++;
+			row->last_name = ++cp - name;
+		}
+	}
+}
+
+/* Returns the row for @index, with the text after the flags filled. */
+static const struct domain_row *format_domain_row(struct domain_policy *dp,
+						   const int index)
+{
+	struct domain_row *row = &dp->row[index];
 	const struct domain_initializer_entry *domain_initializer;
 	const struct domain_keeper_entry *domain_keeper;
 	const char *sp;
+	size_t len;
+	FILE *fp;
+	int i;
+	if (row->text)
+		return row;
+	fp = open_memstream(&row->text, &len);
+	if (!fp)
+		out_of_memory();
+	for (i = 0; i < row->depth; i++)
+		fprintf(fp, "    ");
+	sp = get_last_name(dp, index);
+	if (is_deleted_domain(dp, index))
+		fprintf(fp, "( %s )", sp);
+	else
+		fprintf(fp, "%s", sp);
+	domain_initializer = dp->list[index].d_i;
+	domain_keeper = dp->list[index].d_k;
+	if (domain_initializer) {
+		if (domain_initializer->domainname)
+			fprintf(fp, " ( " KEYWORD_INITIALIZE_DOMAIN
+				"%s from %s )",
+				domain_initializer->program->name,
+				domain_initializer->domainname->name);
+		else
+			fprintf(fp, " ( " KEYWORD_INITIALIZE_DOMAIN "%s )",
+				domain_initializer->program->name);
+	} else if (domain_keeper) {
+		if (domain_keeper->program)
+			fprintf(fp, " ( " KEYWORD_KEEP_DOMAIN "%s from %s )",
+				domain_keeper->program->name,
+				domain_keeper->domainname->name);
+		else
+			fprintf(fp, " ( " KEYWORD_KEEP_DOMAIN "%s )",
+				domain_keeper->domainname->name);
+	} else if (is_initializer_source(dp, index)) {
+		int redirect_index;
+		get();
+		shprintf(ROOT_NAME "%s", strrchr(domain_name(dp, index), ' '));
+		redirect_index = find_domain(dp, shared_buffer, false, false);
+		put();
+		if (redirect_index >= 0)
+			fprintf(fp, " ( -> %d )",
+				dp->list[redirect_index].number);
+		else
+			fprintf(fp, " ( -> Not Found )");
+	}
+	if (fclose(fp))
+		out_of_memory();
+	row->text_len = len;
+	return row;
+}
+
+static int show_domain_line(struct domain_policy *dp, int index)
+{
+	const struct domain_row *row = format_domain_row(dp, index);
 	const int number = dp->list[index].number;
-	int redirect_index;
 	if (number >= 0)
 		printw("%c%4d:%3u %c%c%c ",
 			 dp->list_selected[index] ? '&' : ' ',
@@ -369,72 +546,8 @@ static int show_domain_line(struct domain_policy *dp, int index)
 			 is_domain_unreachable(dp, index) ? '!' : ' ');
 	else
 		printw("              ");
-	tmp_col += 14;
-	sp = domain_name(dp, index);
-	while (true) {
-		const char *cp = strchr(sp, ' ');
-		if (!cp)
-			break;
-		printw("%s", eat("    "));
-		tmp_col += 4;
-		sp = cp + 1;
-	}
-	if (is_deleted_domain(dp, index)) {
-		printw("%s", eat("( "));
-		tmp_col += 2;
-	}
-	printw("%s", eat(sp));
-	tmp_col += strlen(sp);
-	if (is_deleted_domain(dp, index)) {
-		printw("%s", eat(" )"));
-		tmp_col += 2;
-	}
-	domain_initializer = dp->list[index].d_i;
-	if (!domain_initializer)
-		goto not_domain_initializer;
-	get();
-	if (domain_initializer->domainname)
-		shprintf(" ( " KEYWORD_INITIALIZE_DOMAIN "%s from %s )",
-			 domain_initializer->program->name,
-			 domain_initializer->domainname->name);
-	else
-		shprintf(" ( " KEYWORD_INITIALIZE_DOMAIN "%s )",
-			 domain_initializer->program->name);
-	printw("%s", eat(shared_buffer));
-	tmp_col += strlen(shared_buffer);
-	put();
-	goto done;
-not_domain_initializer:
-	domain_keeper = dp->list[index].d_k;
-	if (!domain_keeper)
-		goto not_domain_keeper;
-	get();
-	if (domain_keeper->program)
-		shprintf(" ( " KEYWORD_KEEP_DOMAIN "%s from %s )",
-			 domain_keeper->program->name,
-			 domain_keeper->domainname->name);
-	else
-		shprintf(" ( " KEYWORD_KEEP_DOMAIN "%s )",
-			 domain_keeper->domainname->name);
-	printw("%s", eat(shared_buffer));
-	tmp_col += strlen(shared_buffer);
-	put();
-	goto done;
-not_domain_keeper:
-	if (!is_initializer_source(dp, index))
-		goto done;
-	get();
-	shprintf(ROOT_NAME "%s", strrchr(domain_name(dp, index), ' '));
-	redirect_index = find_domain(dp, shared_buffer, false, false);
-	if (redirect_index >= 0)
-		shprintf(" ( -> %d )", dp->list[redirect_index].number);
-	else
-		shprintf(" ( -> Not Found )");
-	printw("%s", eat(shared_buffer));
-	tmp_col += strlen(shared_buffer);
-	put();
-done:
-	return tmp_col;
+	printw("%s", eat(row->text));
+	return 14 + row->text_len;
 }
 
 static int show_acl_line(int index, int list_indent)
@@ -595,6 +708,8 @@ static _Bool show_command_key(const int screen, const _Bool readonly)
 static _Bool readonly_mode = false;
 static unsigned int refresh_interval = 0;
 static _Bool need_reload = false;
+/* Digest of the policy which the domain list was built from. */
+static u64 transition_policy_digest = 0;
 
 _Bool offline_mode = false;
 const char *policy_dir = NULL;
@@ -618,6 +733,8 @@ static struct domain_keeper_entry *domain_keeper_list = NULL;
 static int domain_keeper_list_len = 0;
 static struct domain_initializer_entry *domain_initializer_list = NULL;
 static int domain_initializer_list_len = 0;
+static struct transition_rule_index domain_keeper_index;
+static struct transition_rule_index domain_initializer_index;
 
 static int profile_sort_type = 0;
 static int unnumbered_domain_count = 0;
@@ -689,67 +806,13 @@ static const char *eat(const char *str)
 	return str;
 }
 
-static const struct domain_keeper_entry *
-is_domain_keeper(const struct path_info *domainname, const char *program)
-{
-	int i;
-	const struct domain_keeper_entry *flag = NULL;
-	struct path_info last_name;
-	last_name.name = strrchr(domainname->name, ' ');
-	if (last_name.name)
-		last_name.name++;
-	else
-		last_name.name = domainname->name;
-	fill_path_info(&last_name);
-	for (i = 0; i < domain_keeper_list_len; i++) {
-		struct domain_keeper_entry *ptr = &domain_keeper_list[i];
-		if (!ptr->is_last_name) {
-			if (pathcmp(ptr->domainname, domainname))
-				continue;
-		} else {
-			if (pathcmp(ptr->domainname, &last_name))
-				continue;
-		}
-		if (ptr->program && strcmp(ptr->program->name, program))
-			continue;
-		if (ptr->is_not)
-			return NULL;
-		flag = ptr;
-	}
-	return flag;
-}
-
+/* @domainname must be savename()d. */
 static const struct domain_initializer_entry *
 is_domain_initializer(const struct path_info *domainname, const char *program)
 {
-	int i;
-	const struct domain_initializer_entry *flag = NULL;
-	struct path_info last_name;
-	last_name.name = strrchr(domainname->name, ' ');
-	if (last_name.name)
-		last_name.name++;
-	else
-		last_name.name = domainname->name;
-	fill_path_info(&last_name);
-	for (i = 0; i < domain_initializer_list_len; i++) {
-		struct domain_initializer_entry *ptr
-			= &domain_initializer_list[i];
-		if (ptr->domainname) {
-			if (!ptr->is_last_name) {
-				if (pathcmp(ptr->domainname, domainname))
-					continue;
-			} else {
-				if (pathcmp(ptr->domainname, &last_name))
-					continue;
-			}
-		}
-		if (strcmp(ptr->program->name, program))
-			continue;
-		if (ptr->is_not)
-			return NULL;
-		flag = ptr;
-	}
-	return flag;
+	const int i = find_domain_initializer(&domain_initializer_index,
+					      domainname, program);
+	return i != EOF ? &domain_initializer_list[i] : NULL;
 }
 
 FILE *open_write(const char *filename)
@@ -867,14 +930,14 @@ static int profile_entry_compare(const void *a, const void *b)
 	}
 }
 
-static void read_generic_policy(void)
+/*
+ * Open policy_file for reading. If @select is not NULL, ask the kernel to
+ * print only entries which match "select @select" when possible.
+ */
+static FILE *open_policy_file(const char *select)
 {
 	FILE *fp = NULL;
-	_Bool flag = false;
-	while (generic_acl_list_count)
-		free((void *)
-		     generic_acl_list[--generic_acl_list_count].operand);
-	if (current_screen == SCREEN_ACL_LIST) {
+	if (select) {
 		if (network_mode)
 			/* We can read after write. */
 			fp = open_write(policy_file);
@@ -882,7 +945,7 @@ static void read_generic_policy(void)
 			/* Don't set error message if failed. */
 			fp = fopen(policy_file, "r+");
 		if (fp) {
-			fprintf(fp, "select domain=%s\n", current_domain);
+			fprintf(fp, "select %s\n", select);
 			if (network_mode)
 				fputc(0, fp);
 			fflush(fp);
@@ -890,13 +953,50 @@ static void read_generic_policy(void)
 	}
 	if (!fp)
 		fp = open_read(policy_file);
+	return fp;
+}
+
+static int generic_acl_list_compare(const void *a, const void *b)
+{
+	switch (current_screen) {
+	case SCREEN_ACL_LIST:
+		return generic_acl_compare(a, b);
+	case SCREEN_SYSTEM_LIST:
+	case SCREEN_EXCEPTION_LIST:
+		return generic_acl_compare0(a, b);
+	case SCREEN_PROFILE_LIST:
+		return profile_entry_compare(a, b);
+	default:
+		return string_acl_compare(a, b);
+	}
+}
+
+/*
+ * Read entries of current_screen into @list, unsorted. Returns the number of
+ * entries, EOF if policy_file could not be opened.
+ */
+static int load_generic_policy(struct generic_acl **list)
+{
+	FILE *fp;
+	int list_len = 0;
+	_Bool flag = false;
+	*list = NULL;
+	if (current_screen == SCREEN_ACL_LIST) {
+		get();
+		shprintf("domain=%s", current_domain);
+		fp = open_policy_file(shared_buffer);
+		put();
+	} else {
+		fp = open_policy_file(NULL);
+	}
 	if (!fp) {
 		set_error(policy_file);
-		return;
+		return EOF;
 	}
 	get();
 	while (freadline(fp)) {
 		u8 directive;
+		int operand = 0;
 		char *cp;
 		if (current_screen == SCREEN_ACL_LIST) {
 			if (is_domain_def(shared_buffer)) {
@@ -915,7 +1015,8 @@ static void read_generic_policy(void)
 		case SCREEN_SYSTEM_LIST:
 		case SCREEN_EXCEPTION_LIST:
 		case SCREEN_ACL_LIST:
-			directive = find_directive(true, shared_buffer);
+			directive = find_directive(true, shared_buffer,
+						   &operand);
 			if (directive == DIRECTIVE_NONE)
 				continue;
 			break;
@@ -931,40 +1032,168 @@ static void read_generic_policy(void)
 			directive = DIRECTIVE_NONE;
 			break;
 		}
-		generic_acl_list = realloc(generic_acl_list,
-					   (generic_acl_list_count + 1) *
-					   sizeof(struct generic_acl));
-		if (!generic_acl_list)
+		*list = realloc(*list, (list_len + 1) *
+				sizeof(struct generic_acl));
+		if (!*list)
 			out_of_memory();
-		cp = strdup(shared_buffer);
+		cp = strdup(shared_buffer + operand);
 		if (!cp)
 			out_of_memory();
-		generic_acl_list[generic_acl_list_count].directive = directive;
-		generic_acl_list[generic_acl_list_count].selected = 0;
-		generic_acl_list[generic_acl_list_count++].operand = cp;
+		(*list)[list_len].directive = directive;
+		(*list)[list_len].selected = 0;
+		(*list)[list_len++].operand = cp;
 	}
 	put();
 	fclose(fp);
+	return list_len;
+}
+
+static void read_generic_policy(void)
+{
+	struct generic_acl *list;
+	int list_len;
+	while (generic_acl_list_count)
+		free((void *)
+		     generic_acl_list[--generic_acl_list_count].operand);
+	list_len = load_generic_policy(&list);
+	if (list_len == EOF)
+		return;
+	free(generic_acl_list);
+	generic_acl_list = list;
+	generic_acl_list_count = list_len;
+	qsort(generic_acl_list, generic_acl_list_count,
+	      sizeof(struct generic_acl), generic_acl_list_compare);
+	update_list_indent();
+}
+
+/* Width of the widest directive, updated when the list changes. */
+static void update_list_indent(void)
+{
+	int i;
+	list_indent = 0;
 	switch (current_screen) {
-	case SCREEN_ACL_LIST:
-		qsort(generic_acl_list, generic_acl_list_count,
-		      sizeof(struct generic_acl), generic_acl_compare);
-		break;
 	case SCREEN_SYSTEM_LIST:
 	case SCREEN_EXCEPTION_LIST:
-		qsort(generic_acl_list, generic_acl_list_count,
-		      sizeof(struct generic_acl), generic_acl_compare0);
-		break;
-	case SCREEN_PROFILE_LIST:
-		qsort(generic_acl_list, generic_acl_list_count,
-		      sizeof(struct generic_acl), profile_entry_compare);
+	case SCREEN_ACL_LIST:
+		for (i = 0; i < generic_acl_list_count; i++) {
+			const u8 directive = generic_acl_list[i].directive;
+			const int len = directives[directive].alias_len;
+			if (len > list_indent)
+				list_indent = len;
+		}
 		break;
-	default:
-		qsort(generic_acl_list, generic_acl_list_count,
-		      sizeof(struct generic_acl), string_acl_compare);
 	}
 }
 
+static u32 generic_acl_hash(const struct generic_acl *acl)
+{
+	return full_name_hash((const unsigned char *) acl->operand,
+			      strlen(acl->operand)) + acl->directive;
+}
+
+/*
+ * Apply changes of policy_file to generic_acl_list, keeping the selection
+ * and the line under the cursor of entries which are still there.
+ * Returns true if the screen needs to be redrawn.
+ */
+static _Bool refresh_generic_policy(void)
+{
+	const int current = editpolicy_get_current();
+	int new_current = EOF;
+	struct generic_acl *list;
+	struct generic_acl *merged;
+	unsigned int *table;
+	unsigned int size = 16;
+	u8 *kept;
+	int list_len;
+	int added = 0;
+	int removed = generic_acl_list_count;
+	int i;
+	int j;
+	int k;
+	list_len = load_generic_policy(&list);
+	if (list_len == EOF)
+		return true;
+	/* Index old entries by content. Slots hold index + 1. */
+	while (size < generic_acl_list_count * 2)
+		size <<= 1;
+	table = calloc(size, sizeof(unsigned int));
+	kept = calloc(generic_acl_list_count + 1, 1);
+	if (!table || !kept)
+		out_of_memory();
+	for (i = 0; i < generic_acl_list_count; i++) {
+		unsigned int slot = hash_slot_index(generic_acl_hash
+						    (&generic_acl_list[i]),
+						    size);
+		while (table[slot])
+			slot = (slot + 1) & (size - 1);
+		table[slot] = i + 1;
+	}
+	/* Keep old entries which are still there and collect new entries. */
+	for (i = 0; i < list_len; i++) {
+		struct generic_acl *acl = &list[i];
+		unsigned int slot = hash_slot_index(generic_acl_hash(acl),
+						    size);
+		for (; table[slot]; slot = (slot + 1) & (size - 1)) {
+			const int old = table[slot] - 1;
+			if (kept[old] ||
+			    generic_acl_list[old].directive != acl->directive ||
+			    strcmp(generic_acl_list[old].operand,
+				   acl->operand))
+				continue;
+			kept[old] = 1;
+			removed--;
+			break;
+		}
+		if (table[slot])
+			free((void *) acl->operand);
+		else
+			list[added++] = *acl;
+	}
+	free(table);
+	if (!added && !removed) {
+		free(kept);
+		free(list);
+		return false;
+	}
+	/* Merge new entries into the sorted list. */
+	qsort(list, added, sizeof(struct generic_acl),
+	      generic_acl_list_compare);
+	merged = malloc((generic_acl_list_count - removed + added) *
+			sizeof(struct generic_acl) + 1);
+	if (!merged)
+		out_of_memory();
+	i = 0;
+	j = 0;
+	k = 0;
+	while (i < generic_acl_list_count || j < added) {
+		if (i < generic_acl_list_count && !kept[i]) {
+			free((void *) generic_acl_list[i++].operand);
+			continue;
+		}
+		if (j == added ||
+		    (i < generic_acl_list_count &&
+		     generic_acl_list_compare(&generic_acl_list[i],
+					      &list[j]) <= 0)) {
+			if (i == current)
+				new_current = k;
+			merged[k++] = generic_acl_list[i++];
+		} else {
+			merged[k++] = list[j++];
+		}
+	}
+	free(kept);
+	free(list);
+	free(generic_acl_list);
+	generic_acl_list = merged;
+	generic_acl_list_count = k;
+	update_list_indent();
+	if (new_current != EOF)
+		move_cursor_pos(new_current);
+	adjust_cursor_pos(generic_acl_list_count);
+	return true;
+}
+
 static int add_domain_initializer_entry(const char *domainname,
 					const char *program, const _Bool is_not)
 {
@@ -997,6 +1226,12 @@ static int add_domain_initializer_entry(const char *domainname,
 	}
 	ptr->is_not = is_not;
 	ptr->is_last_name = is_last_name;
+	add_transition_rule(&domain_initializer_index, ptr->program,
+			    ptr->domainname, is_last_name, is_not,
+			    domain_initializer_list_len - 1);
+	if (!is_not)
+		*name_map_value(&domain_initializer_index.positive,
+				ptr->program, true) = 1;
 	return 0;
 }
 
@@ -1028,6 +1263,12 @@ static int add_domain_keeper_entry(const char *domainname, const char *program,
 	}
 	ptr->is_not = is_not;
 	ptr->is_last_name = is_last_name;
+	add_transition_rule(&domain_keeper_index, ptr->program,
+			    ptr->domainname, is_last_name, is_not,
+			    domain_keeper_list_len - 1);
+	if (!is_not)
+		*name_map_value(&domain_keeper_index.positive,
+				ptr->domainname, true) |= is_last_name ? 2 : 1;
 	return 0;
 }
 
@@ -1055,10 +1296,14 @@ static int add_path_group_entry(const char *group_name, const char *member_name,
 				continue;
 			if (!is_delete)
 				return 0;
-			while (j < group->member_name_len - 1)
+			for (group->member_name_len--;
+			     j < group->member_name_len; j++)
 				group->member_name[j] =
 					group->member_name[j + 1];
-			group->member_name_len--;
+			clear_pattern_index(&group->member_index);
+			for (j = 0; j < group->member_name_len; j++)
+				pattern_index_add(&group->member_index,
+						  group->member_name[j], j);
 			return 0;
 		}
 		break;
@@ -1080,27 +1325,36 @@ static int add_path_group_entry(const char *group_name, const char *member_name,
 				     * sizeof(const struct path_info *));
 	if (!group->member_name)
 		out_of_memory();
+	pattern_index_add(&group->member_index, saved_member_name,
+			  group->member_name_len);
 	group->member_name[group->member_name_len++] = saved_member_name;
 	return 0;
 }
 
 static void read_domain_and_exception_policy(struct domain_policy *dp)
 {
+	struct domain_tree tree;
 	FILE *fp;
 	int i;
 	int j;
 	int index;
 	int max_index;
+	u64 digest = 0;
+	memset(&tree, 0, sizeof(tree));
 	clear_domain_policy(dp);
 	domain_keeper_list_len = 0;
 	domain_initializer_list_len = 0;
-	while (path_group_list_len)
-		free(path_group_list[--path_group_list_len].member_name);
-	/*
-	while (address_group_list_len)
-		free(address_group_list[--address_group_list_len].member_name);
-	*/
-	address_group_list_len = 0;
+	clear_transition_rule_index(&domain_keeper_index);
+	clear_transition_rule_index(&domain_initializer_index);
+	while (path_group_list_len) {
+		struct path_group_entry *group =
+			&path_group_list[--path_group_list_len];
+		free(group->member_name);
+		clear_pattern_index(&group->member_index);
+	}
+	clear_address_group_list();
+	/* Nothing refers to names of the previous generation now. */
+	savename_reset();
 	find_or_assign_new_domain(dp, ROOT_NAME, false, false);
 
 	/* Load domain_initializer list, domain_keeper list. */
@@ -1111,6 +1365,7 @@ static void read_domain_and_exception_policy(struct domain_policy *dp)
 	}
 	get();
 	while (freadline(fp)) {
+		digest = digest_line(digest, shared_buffer);
 		if (str_starts(shared_buffer, KEYWORD_INITIALIZE_DOMAIN))
 			add_domain_initializer_policy(shared_buffer, false);
 		else if (str_starts(shared_buffer,
@@ -1130,21 +1385,7 @@ static void read_domain_and_exception_policy(struct domain_policy *dp)
 no_exception:
 
 	/* Load all domain list. */
-	fp = NULL;
-	if (network_mode)
-		/* We can read after write. */
-		fp = open_write(policy_file);
-	else if (!offline_mode)
-		/* Don't set error message if failed. */
-		fp = fopen(policy_file, "r+");
-	if (fp) {
-		fprintf(fp, "select allow_execute\n");
-		if (network_mode)
-			fputc(0, fp);
-		fflush(fp);
-	}
-	if (!fp)
-		fp = open_read(proc_policy_domain_policy);
+	fp = open_policy_file("allow_execute");
 	if (!fp) {
 		set_error(proc_policy_domain_policy);
 		goto no_domain;
@@ -1155,6 +1396,7 @@ no_exception:
 		char *cp;
 		char *cp2;
 		unsigned int profile;
+		digest = digest_line(digest, shared_buffer);
 		if (is_domain_def(shared_buffer)) {
 			index = find_or_assign_new_domain(dp, shared_buffer,
 							  false, false);
@@ -1186,80 +1428,61 @@ no_exception:
 	put();
 	fclose(fp);
 no_domain:
+	transition_policy_digest = digest;
 
 	max_index = dp->list_len;
-
-	/* Find unreachable domains. */
-	for (index = 0; index < max_index; index++) {
-		get();
-		shprintf("%s", domain_name(dp, index));
-		while (true) {
-			const struct domain_initializer_entry *d_i;
-			const struct domain_keeper_entry *d_k;
-			struct path_info parent;
-			char *cp = strrchr(shared_buffer, ' ');
-			if (!cp)
-				break;
-			*cp++ = '\0';
-			parent.name = shared_buffer;
-			fill_path_info(&parent);
-			d_i = is_domain_initializer(&parent, cp);
-			if (d_i) {
-				/* Initializer under <kernel> is reachable. */
-				if (parent.total_len == ROOT_NAME_LEN)
-					break;
-				dp->list[index].d_i = d_i;
-				dp->list[index].d_k = NULL;
-				continue;
-			}
-			d_k = is_domain_keeper(&parent, cp);
-			if (d_k) {
-				dp->list[index].d_i = NULL;
-				dp->list[index].d_k = d_k;
-			}
+	build_domain_tree(&tree, dp);
+
+	find_unreachable_domains(&tree, &domain_initializer_index,
+				 &domain_keeper_index);
+	for (i = 0; i < tree.len; i++) {
+		const struct domain_tree_node *node = &tree.node[i];
+		struct domain_info *domain;
+		if (node->domain == EOF)
+			continue;
+		domain = &dp->list[node->domain];
+		if (node->top_d_k != EOF) {
+			domain->d_k = &domain_keeper_list[node->top_d_k];
+		} else {
+			domain->d_i = node->d_i == EOF ? NULL :
+				&domain_initializer_list[node->d_i];
+			domain->d_k = node->d_k == EOF ? NULL :
+				&domain_keeper_list[node->d_k];
 		}
-		put();
-		if (dp->list[index].d_i || dp->list[index].d_k)
-			dp->list[index].is_du = true;
+		if (domain->d_i || domain->d_k)
+			domain->is_du = true;
 	}
 
 	/* Find domain initializer target domains. */
 	for (index = 0; index < max_index; index++) {
+		const struct path_info *program;
 		char *cp = strchr(domain_name(dp, index), ' ');
 		if (!cp || strchr(cp + 1, ' '))
 			continue;
-		for (i = 0; i < domain_initializer_list_len; i++) {
-			struct domain_initializer_entry *ptr
-				= &domain_initializer_list[i];
-			if (ptr->is_not)
-				continue;
-			if (strcmp(ptr->program->name, cp + 1))
-				continue;
+		program = savename(cp + 1);
+		if (!program)
+			out_of_memory();
+		if (name_map_value(&domain_initializer_index.positive, program,
+				   false))
 			dp->list[index].is_dit = true;
-		}
 	}
 
 	/* Find domain keeper domains. */
 	for (index = 0; index < max_index; index++) {
-		for (i = 0; i < domain_keeper_list_len; i++) {
-			struct domain_keeper_entry *ptr
-				= &domain_keeper_list[i];
-			char *cp;
-			if (ptr->is_not)
-				continue;
-			if (!ptr->is_last_name) {
-				if (pathcmp(ptr->domainname,
-					    dp->list[index].domainname))
-					continue;
-				dp->list[index].is_dk = true;
-				continue;
-			}
-			cp = strrchr(dp->list[index].domainname->name,
-				     ' ');
-			if (!cp || strcmp(ptr->domainname->name, cp + 1))
-				continue;
+		const struct path_info *domainname = dp->list[index].domainname;
+		const int *flags;
+		flags = name_map_value(&domain_keeper_index.positive,
+				       domainname, false);
+		if (flags && (*flags & 1)) {
 			dp->list[index].is_dk = true;
+			continue;
 		}
+		if (!strchr(domainname->name, ' '))
+			continue;
+		flags = name_map_value(&domain_keeper_index.positive,
+				       last_name_of(domainname), false);
+		if (flags && (*flags & 2))
+			dp->list[index].is_dk = true;
 	}
 
 	/* Create domain initializer source domains. */
@@ -1293,27 +1516,17 @@ no_domain:
 	}
 
 	/* Create missing parent domains. */
-	for (index = 0; index < max_index; index++) {
-		get();
-		shprintf("%s", domain_name(dp, index));
-		while (true) {
-			char *cp = strrchr(shared_buffer, ' ');
-			if (!cp)
-				break;
-			*cp = '\0';
-			if (find_domain(dp, shared_buffer, false, false) != EOF)
-				continue;
-			if (find_or_assign_new_domain(dp, shared_buffer, false,
-						      true)
-			    == EOF)
-				out_of_memory();
-		}
-		put();
-	}
+	for (i = 0; i < tree.len; i++)
+		if (tree.node[i].domain == EOF &&
+		    find_or_assign_new_domain(dp, tree.node[i].name->name,
+					      false, true) == EOF)
+			out_of_memory();
+	clear_domain_tree(&tree);
 
 	/* Sort by domain name. */
 	qsort(dp->list, dp->list_len, sizeof(struct domain_info),
 	      domainname_attribute_compare);
+	rebuild_domain_hash(dp);
 
 	/* Assign domain numbers. */
 	{
@@ -1335,9 +1548,97 @@ no_domain:
 	if (dp->list_len && !dp->list_selected)
 		out_of_memory();
 	memset(dp->list_selected, 0, dp->list_len);
+	build_domain_rows(dp);
 }
 
 
+static u64 digest_line(const u64 digest, const char *line)
+{
+	return digest * 1000003 +
+		full_name_hash((const unsigned char *) line, strlen(line));
+}
+
+/*
+ * Returns the digest of what read_domain_and_exception_policy() would read
+ * now, without parsing it.
+ */
+static u64 read_transition_policy_digest(void)
+{
+	u64 digest = 0;
+	FILE *fp = open_read(proc_policy_exception_policy);
+	if (fp) {
+		get();
+		while (freadline(fp))
+			digest = digest_line(digest, shared_buffer);
+		put();
+		fclose(fp);
+	}
+	fp = open_policy_file("allow_execute");
+	if (fp) {
+		get();
+		while (freadline(fp))
+			digest = digest_line(digest, shared_buffer);
+		put();
+		fclose(fp);
+	}
+	return digest;
+}
+
+/*
+ * Re-read the domain list only if the policy was changed since it was last
+ * read, keeping the selection and the line under the cursor.
+ * Returns true if the screen needs to be redrawn.
+ */
+static _Bool refresh_domain_policy(struct domain_policy *dp)
+{
+	const int current = editpolicy_get_current();
+	char *current_name = NULL;
+	_Bool current_is_dis = false;
+	_Bool current_is_dd = false;
+	char **selected = NULL;
+	int selected_len = 0;
+	int index;
+	if (read_transition_policy_digest() == transition_policy_digest)
+		return false;
+	for (index = 0; index < dp->list_len; index++) {
+		if (!dp->list_selected[index])
+			continue;
+		selected = realloc(selected,
+				   (selected_len + 1) * sizeof(char *));
+		if (!selected)
+			out_of_memory();
+		selected[selected_len] = strdup(domain_name(dp, index));
+		if (!selected[selected_len++])
+			out_of_memory();
+	}
+	if (current != EOF) {
+		current_name = strdup(domain_name(dp, current));
+		if (!current_name)
+			out_of_memory();
+		current_is_dis = dp->list[current].is_dis;
+		current_is_dd = dp->list[current].is_dd;
+	}
+	read_domain_and_exception_policy(dp);
+	/* Only ordinary domains can be selected. */
+	while (selected_len) {
+		char *name = selected[--selected_len];
+		index = find_domain(dp, name, false, false);
+		if (index != EOF)
+			dp->list_selected[index] = 1;
+		free(name);
+	}
+	free(selected);
+	if (current_name) {
+		index = find_domain(dp, current_name, current_is_dis,
+				    current_is_dd);
+		if (index != EOF)
+			move_cursor_pos(index);
+		free(current_name);
+	}
+	adjust_cursor_pos(dp->list_len);
+	return true;
+}
+
 static void show_list(struct domain_policy *dp)
 {
 	const int offset = current_item_index[current_screen];
@@ -1382,19 +1683,6 @@ static void show_list(struct domain_policy *dp)
 		editpolicy_attr_change(A_REVERSE, false); /* add color */
 		put();
 	}
-	list_indent = 0;
-	switch (current_screen) {
-	case SCREEN_SYSTEM_LIST:
-	case SCREEN_EXCEPTION_LIST:
-	case SCREEN_ACL_LIST:
-		for (i = 0; i < list_item_count[current_screen]; i++) {
-			const u8 directive = generic_acl_list[i].directive;
-			const int len = directives[directive].alias_len;
-			if (len > list_indent)
-				list_indent = len;
-		}
-		break;
-	}
 	for (i = 0; i < body_lines; i++) {
 		const int index = offset + i;
 		eat_col = max_eat_col[current_screen];
@@ -1573,6 +1861,16 @@ static void set_cursor_pos(const int index)
 	}
 }
 
+/* Put the cursor on @index without moving it to another line if possible. */
+static void move_cursor_pos(const int index)
+{
+	current_item_index[current_screen] = index - current_y[current_screen];
+	while (current_item_index[current_screen] < 0) {
+		current_item_index[current_screen]++;
+		current_y[current_screen]--;
+	}
+}
+
 static int select_item(struct domain_policy *dp, const int current)
 {
 	if (current >= 0) {
@@ -1689,6 +1987,7 @@ static void add_entry(struct readline_data *rl)
 {
 	FILE *fp;
 	char *line;
+	int operand = 0;
 	editpolicy_attr_change(A_BOLD, true);  /* add color */
 	line = simple_readline(window_height - 1, 0, "Enter new entry> ",
 			       rl->history, rl->count, 8192, 8);
@@ -1718,7 +2017,7 @@ static void add_entry(struct readline_data *rl)
 		/* Fall through. */
 	case SCREEN_SYSTEM_LIST:
 	case SCREEN_EXCEPTION_LIST:
-		directive = find_directive(false, line);
+		directive = find_directive(false, line, &operand);
 		if (directive != DIRECTIVE_NONE)
 			fprintf(fp, "%s ",
 				directives[directive].original);
@@ -1728,7 +2027,7 @@ static void add_entry(struct readline_data *rl)
 			fprintf(fp, "%s-COMMENT=\n", line);
 		break;
 	}
-	fprintf(fp, "%s\n", line);
+	fprintf(fp, "%s\n", line + operand);
 	close_write(fp);
 out:
 	free(line);
@@ -2041,8 +2340,14 @@ start2:
 			}
 		}
 		if (need_reload) {
+			_Bool changed;
 			need_reload = false;
-			goto start;
+			if (current_screen == SCREEN_DOMAIN_LIST)
+				changed = refresh_domain_policy(dp);
+			else
+				changed = refresh_generic_policy();
+			if (changed)
+				goto start2;
 		}
 		if (c == ERR)
 			continue; /* Ignore invalid key. */
@@ -2164,13 +2469,7 @@ start2:
 				put();
 				if (redirect_index == EOF)
 					break;
-				current_item_index[current_screen]
-					= redirect_index
-					- current_y[current_screen];
-				while (current_item_index[current_screen] < 0) {
-					current_item_index[current_screen]++;
-					current_y[current_screen]--;
-				}
+				move_cursor_pos(redirect_index);
 				show_list(dp);
 			} else if (!is_deleted_domain(dp, current)) {
 				free(current_domain);
@@ -2425,60 +2724,21 @@ usage:
 	endwin();
 	if (offline_mode && !readonly_mode) {
 		time_t now = time(NULL);
-		char *filename = make_filename("system_policy", now);
-		if (move_proc_to_file(proc_policy_system_policy,
-				      BASE_POLICY_SYSTEM_POLICY, filename)) {
-			if (is_identical_file("system_policy.conf", filename)) {
-				unlink(filename);
-			} else {
-				unlink("system_policy.conf");
-				symlink(filename, "system_policy.conf");
-			}
-		}
-		filename = make_filename("exception_policy", now);
-		if (move_proc_to_file(proc_policy_exception_policy,
-				      BASE_POLICY_EXCEPTION_POLICY, filename)) {
-			if (is_identical_file("exception_policy.conf",
-					      filename)) {
-				unlink(filename);
-			} else {
-				unlink("exception_policy.conf");
-				symlink(filename, "exception_policy.conf");
-			}
-		}
+		move_proc_to_store(proc_policy_system_policy,
+				   BASE_POLICY_SYSTEM_POLICY, "system_policy",
+				   now, false);
+		move_proc_to_store(proc_policy_exception_policy,
+				   BASE_POLICY_EXCEPTION_POLICY,
+				   "exception_policy", now, false);
 		clear_domain_policy(&dp);
-		filename = make_filename("domain_policy", now);
-		if (save_domain_policy_with_diff(&dp, &bp,
-						 proc_policy_domain_policy,
-						 BASE_POLICY_DOMAIN_POLICY,
-						 filename)) {
-			if (is_identical_file("domain_policy.conf", filename)) {
-				unlink(filename);
-			} else {
-				unlink("domain_policy.conf");
-				symlink(filename, "domain_policy.conf");
-			}
-		}
-		filename = make_filename("profile", now);
-		if (move_proc_to_file(proc_policy_profile, BASE_POLICY_PROFILE,
-				      filename)) {
-			if (is_identical_file("profile.conf", filename)) {
-				unlink(filename);
-			} else {
-				unlink("profile.conf");
-				symlink(filename, "profile.conf");
-			}
-		}
-		filename = make_filename("manager", now);
-		if (move_proc_to_file(proc_policy_manager, BASE_POLICY_MANAGER,
-				      filename)) {
-			if (is_identical_file("manager.conf", filename)) {
-				unlink(filename);
-			} else {
-				unlink("manager.conf");
-				symlink(filename, "manager.conf");
-			}
-		}
+		save_domain_policy_to_store(&dp, &bp,
+					    proc_policy_domain_policy,
+					    BASE_POLICY_DOMAIN_POLICY, now,
+					    false);
+		move_proc_to_store(proc_policy_profile, BASE_POLICY_PROFILE,
+				   "profile", now, false);
+		move_proc_to_store(proc_policy_manager, BASE_POLICY_MANAGER,
+				   "manager", now, false);
 	}
 	clear_domain_policy(&bp);
 	clear_domain_policy(&dp);
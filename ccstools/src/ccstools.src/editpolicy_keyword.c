@@ -72,37 +72,46 @@ struct editpolicy_directive directives[MAX_DIRECTIVE_INDEX] = {
 	[DIRECTIVE_TRANSITION_FAILED] = { "transition_failed", NULL, 0, 0 },
 };
 
+/* Lookup of directives[].original and directives[].alias. */
+static struct keyword_trie directive_trie[2];
+
+/* Utility functions */
+
+/* Build directive_trie[] once aliases are known. */
+static void build_directive_tries(void)
+{
+	const char *name[MAX_DIRECTIVE_INDEX];
+	int i;
+	name[DIRECTIVE_NONE] = NULL;
+	for (i = 1; i < MAX_DIRECTIVE_INDEX; i++)
+		name[i] = directives[i].alias;
+	build_keyword_trie(&directive_trie[false], name, MAX_DIRECTIVE_INDEX);
+	for (i = 1; i < MAX_DIRECTIVE_INDEX; i++)
+		name[i] = directives[i].original;
+	build_keyword_trie(&directive_trie[true], name, MAX_DIRECTIVE_INDEX);
+}
+
 /* Main functions */
 
-u8 find_directive(const _Bool forward, char *line)
+/**
+ * find_directive - Find the directive a line starts with.
+ *
+ * @forward: True if @line uses original names, false if it uses aliases.
+ * @line:    A line of policy.
+ * @operand: Pointer to offset of the operand part of @line.
+ *
+ * Returns index of directives[], DIRECTIVE_NONE if not found.
+ */
+u8 find_directive(const _Bool forward, const char *line, int *operand)
 {
-	u8 i;
-	for (i = 1; i < MAX_DIRECTIVE_INDEX; i++) {
-		if (forward) {
-			const int len = directives[i].original_len;
-			if (strncmp(line, directives[i].original, len) ||
-			    (line[len] != ' ' && line[len]))
-				continue;
-			if (line[len])
-				memmove(line, line + len + 1,
-					strlen(line + len + 1) + 1);
-			else
-				line[0] = '\0';
-			return i;
-		} else {
-			const int len = directives[i].alias_len;
-			if (strncmp(line, directives[i].alias, len) ||
-			    (line[len] != ' ' && line[len]))
-				continue;
-			if (line[len])
-				memmove(line, line + len + 1,
-					strlen(line + len + 1) + 1);
-			else
-				line[0] = '\0';
-			return i;
-		}
-	}
-	return DIRECTIVE_NONE;
+	int len;
+	const int i = keyword_trie_find(&directive_trie[forward], line, true,
+					&len);
+	*operand = 0;
+	if (i == EOF)
+		return DIRECTIVE_NONE;
+	*operand = line[len] ? len + 1 : len;
+	return i;
 }
 
 void editpolicy_init_keyword_map(void)
@@ -146,5 +155,6 @@ use_default:
 		directives[i].original_len = strlen(directives[i].original);
 		directives[i].alias_len = strlen(directives[i].alias);
 	}
+	build_directive_tries();
 }
 
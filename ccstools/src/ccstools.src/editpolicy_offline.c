@@ -11,17 +11,36 @@
 #include "ccstools.h"
 
 struct misc_policy {
-	const struct path_info **list;
+	const struct path_info **list; /* NULL for deleted entries.        */
 	int list_len;
+	int list_size;
+	int list_deleted;
+	struct name_map map;           /* Index in list + 1, 0 if deleted. */
 };
 
 /* Prototypes */
 
+static void compact_misc_policy(struct misc_policy *mp);
 static void handle_misc_policy(struct misc_policy *mp, FILE *fp,
 			       _Bool is_write);
 
 /* Utility functions */
 
+static void compact_misc_policy(struct misc_policy *mp)
+{
+	int i;
+	int j = 0;
+	for (i = 0; i < mp->list_len; i++) {
+		const struct path_info *cp = mp->list[i];
+		if (!cp)
+			continue;
+		mp->list[j++] = cp;
+		*name_map_value(&mp->map, cp, false) = j;
+	}
+	mp->list_len = j;
+	mp->list_deleted = 0;
+}
+
 static void handle_misc_policy(struct misc_policy *mp, FILE *fp, _Bool is_write)
 {
 	int i;
@@ -30,39 +49,43 @@ static void handle_misc_policy(struct misc_policy *mp, FILE *fp, _Bool is_write)
 	while (freadline(fp)) {
 		const struct path_info *cp;
 		_Bool is_delete;
+		int *index;
 		if (!shared_buffer[0])
 			continue;
 		is_delete = str_starts(shared_buffer, "delete ");
 		cp = savename(shared_buffer);
 		if (!cp)
 			out_of_memory();
+		index = name_map_value(&mp->map, cp, !is_delete);
 		if (!is_delete)
 			goto append_policy;
-		for (i = 0; i < mp->list_len; i++)
-			/* Faster comparison, for they are savename'd. */
-			if (mp->list[i] == cp)
-				break;
-		if (i < mp->list_len)
-			for (mp->list_len--; i < mp->list_len; i++)
-				mp->list[i] = mp->list[i + 1];
+		if (!index || !*index)
+			continue;
+		mp->list[*index - 1] = NULL;
+		*index = 0;
+		mp->list_deleted++;
+		if (mp->list_deleted * 2 > mp->list_len)
+			compact_misc_policy(mp);
 		continue;
 append_policy:
-		for (i = 0; i < mp->list_len; i++)
-			/* Faster comparison, for they are savename'd. */
-			if (mp->list[i] == cp)
-				break;
-		if (i < mp->list_len)
+		if (*index)
 			continue;
-		mp->list = realloc(mp->list, (mp->list_len + 1)
-				   * sizeof(const struct path_info *));
-		if (!mp->list)
-			out_of_memory();
+		if (mp->list_len == mp->list_size) {
+			mp->list_size = mp->list_size ?
+				mp->list_size * 2 : 64;
+			mp->list = realloc(mp->list, mp->list_size
+					   * sizeof(const struct path_info *));
+			if (!mp->list)
+				out_of_memory();
+		}
 		mp->list[mp->list_len++] = cp;
+		*index = mp->list_len;
 	}
 	return;
 read_policy:
 	for (i = 0; i < mp->list_len; i++)
-		fprintf(fp, "%s\n", mp->list[i]->name);
+		if (mp->list[i])
+			fprintf(fp, "%s\n", mp->list[i]->name);
 }
 
 /* Variables */
@@ -162,10 +185,11 @@ void editpolicy_offline_daemon(void)
 	clear_domain_policy(&dp);
 	{
 		int i;
-		for (i = 0; i < 3; i++) {
+		for (i = 0; i < 4; i++) {
 			free(mp[i].list);
 			mp[i].list = NULL;
 			mp[i].list_len = 0;
+			clear_name_map(&mp[i].map);
 		}
 	}
 	_exit(0);
@@ -87,7 +87,6 @@ int add_address_group_policy(char *data, const _Bool is_delete)
 static _Bool compare_path(struct path_info *sarg, struct path_info *darg,
 			 u8 directive)
 {
-	int i;
 	struct path_group_entry *group;
 	_Bool may_use_pattern = !darg->is_patterned
 		&& (directive != DIRECTIVE_1)
@@ -107,15 +106,10 @@ static _Bool compare_path(struct path_info *sarg, struct path_info *darg,
 	group = find_path_group(sarg->name + 1);
 	if (!group)
 		return false;
-	for (i = 0; i < group->member_name_len; i++) {
-		const struct path_info *member_name;
-		member_name = group->member_name[i];
-		if (!pathcmp(member_name, darg))
-			return true;
-		if (may_use_pattern && path_matches_pattern(darg, member_name))
-			return true;
-	}
-	return false;
+	if (pattern_index_find_name(&group->member_index, darg) != EOF)
+		return true;
+	return may_use_pattern &&
+		pattern_index_find(&group->member_index, darg) != EOF;
 }
 
 static _Bool compare_address(struct path_info *sarg, struct path_info *darg)
@@ -238,6 +232,9 @@ void editpolicy_try_optimize(struct domain_policy *dp, const int current,
 		return;
 
 	subtype1 = split_acl(s_index, cp, &sarg1, &sarg2, &sarg3);
+	/* Compile the patterns once for all entries of the list. */
+	compile_path_info(&sarg1);
+	compile_path_info(&sarg2);
 
 	get();
 	for (index = 0; index < list_item_count[screen]; index++) {
@@ -422,6 +419,8 @@ void editpolicy_try_optimize(struct domain_policy *dp, const int current,
 		generic_acl_list[index].selected = 1;
 	}
 	put();
+	free_path_info_program(&sarg1);
+	free_path_info_program(&sarg2);
 	free(cp);
 }
 
@@ -489,6 +488,12 @@ static int add_address_group_entry(const char *group_name,
 	return 0;
 }
 
+void clear_address_group_list(void)
+{
+	while (address_group_list_len)
+		free(address_group_list[--address_group_list_len].member_name);
+}
+
 static struct address_group_entry *find_address_group(const char *group_name)
 {
 	int i;
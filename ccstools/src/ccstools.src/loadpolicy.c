@@ -20,35 +20,508 @@ static void close_write(FILE *fp)
 	fclose(fp);
 }
 
+/* Returns 0 on success, negative errno otherwise. */
 static int write_domain_policy(struct domain_policy *dp, const int fd)
 {
+	struct policy_writer writer;
 	int i;
 	int j;
+	policy_writer_open(&writer, fd);
 	for (i = 0; i < dp->list_len; i++) {
 		const struct path_info **string_ptr
 			= dp->list[i].string_ptr;
 		const int string_count = dp->list[i].string_count;
-		write(fd, dp->list[i].domainname->name,
-		      dp->list[i].domainname->total_len);
-		write(fd, "\n\n", 2);
+		policy_writer_write(&writer, dp->list[i].domainname->name,
+				    dp->list[i].domainname->total_len);
+		policy_writer_write(&writer, "\n\n", 2);
 		for (j = 0; j < string_count; j++) {
-			write(fd, string_ptr[j]->name,
-			      string_ptr[j]->total_len);
-			write(fd, "\n", 1);
+			policy_writer_write(&writer, string_ptr[j]->name,
+					    string_ptr[j]->total_len);
+			policy_writer_write(&writer, "\n", 1);
 		}
-		write(fd, "\n", 1);
+		policy_writer_write(&writer, "\n", 1);
 	}
-	return 0;
+	return policy_writer_close(&writer);
 }
 
 /***** sortpolicy start *****/
 
+/*
+ * With "--max-memory=", only domainnames are kept in memory. ACL entries are
+ * recorded with their domain and line number, sorted in batches which fit in
+ * the budget and spilled to temporary files, and the runs are merged by
+ * (domainname, entry, line number). An entry exists if the last line which
+ * added or deleted it added it, unless its domain was deleted after that.
+ */
+static struct sort_domain *sort_domain_list = NULL;
+static u32 sort_domain_list_len = 0;
+static struct name_map sort_domain_map;
+static struct sort_record *sort_record_list = NULL;
+static u32 sort_record_list_len = 0;
+static u32 sort_record_list_size = 0;
+static char *sort_arena = NULL;
+static size_t sort_arena_len = 0;
+static size_t sort_arena_size = 0;
+static FILE **sort_run_list = NULL;
+static int sort_run_list_len = 0;
+static u32 *sort_order = NULL;         /* Existing domains, sorted.         */
+static u32 sort_order_len = 0;
+static u32 sort_order_pos = 0;
+static _Bool sort_order_opened = false;
+static struct policy_writer sort_writer;  /* Standard output.               */
+
+/* Returns bytes in "--max-memory=" value, 0 if invalid. */
+static u64 parse_memory_size(const char *str)
+{
+	char *end;
+	u64 size = strtoull(str, &end, 10);
+	if (end == str)
+		return 0;
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K':
+	case 'k':
+		size <<= 10;
+		end++;
+	}
+	if (*end)
+		return 0;
+	return size;
+}
+
+/* Returns index of domain @name, EOF if there is none and !@create. */
+static int sort_domain_index(const char *name, const _Bool create)
+{
+	const struct path_info *cp = savename(name);
+	int *value;
+	if (!cp)
+		out_of_memory();
+	value = name_map_value(&sort_domain_map, cp, create);
+	if (!value)
+		return EOF;
+	if (!*value) {
+		if (!(sort_domain_list_len & (sort_domain_list_len + 1))) {
+			sort_domain_list = realloc(sort_domain_list,
+						   (sort_domain_list_len + 1)
+						   * 2 *
+						   sizeof(struct sort_domain));
+			if (!sort_domain_list)
+				out_of_memory();
+		}
+		sort_domain_list[sort_domain_list_len].domainname = cp;
+		sort_domain_list[sort_domain_list_len].delete_line = 0;
+		sort_domain_list[sort_domain_list_len].exists = false;
+		*value = ++sort_domain_list_len;
+	}
+	return *value - 1;
+}
+
+static int sort_domain_compare(const void *a, const void *b)
+{
+	return strcmp(sort_domain_list[*(u32 *) a].domainname->name,
+		      sort_domain_list[*(u32 *) b].domainname->name);
+}
+
+static _Bool same_sort_key(const struct sort_record *a,
+			   const struct sort_record *b)
+{
+	return a->domain == b->domain && !strcmp(a->entry, b->entry);
+}
+
+static int sort_record_compare(const void *a, const void *b)
+{
+	const struct sort_record *a0 = (struct sort_record *) a;
+	const struct sort_record *b0 = (struct sort_record *) b;
+	int ret;
+	if (a0->domain != b0->domain)
+		return sort_domain_compare(&a0->domain, &b0->domain);
+	ret = strcmp(a0->entry, b0->entry);
+	if (ret)
+		return ret;
+	return a0->line < b0->line ? -1 : a0->line > b0->line;
+}
+
+/* Returns a temporary file which is removed when closed. */
+static FILE *open_sort_run(void)
+{
+	const char *dir = getenv("TMPDIR");
+	FILE *fp;
+	int fd;
+	if (!dir || !*dir)
+		dir = "/tmp";
+	get();
+	shprintf("%s/ccs-sortpolicy.XXXXXX", dir);
+	fd = mkstemp(shared_buffer);
+	if (fd != EOF)
+		unlink(shared_buffer);
+	put();
+	if (fd == EOF) {
+		fprintf(stderr, "Can't create temporary file in %s\n", dir);
+		exit(1);
+	}
+	fp = fdopen(fd, "w+");
+	if (!fp)
+		out_of_memory();
+	return fp;
+}
+
+/* Rewind @fp so that it can be merged. */
+static void close_sort_run(FILE *fp)
+{
+	if (fflush(fp) || ferror(fp) || fseek(fp, 0, SEEK_SET)) {
+		fprintf(stderr, "Can't write temporary file.\n");
+		exit(1);
+	}
+}
+
+static void write_sort_record(FILE *fp, const struct sort_record *record)
+{
+	fwrite(&record->domain, sizeof(record->domain), 1, fp);
+	fwrite(&record->line, sizeof(record->line), 1, fp);
+	fwrite(&record->len, sizeof(record->len), 1, fp);
+	fwrite(&record->is_delete, sizeof(record->is_delete), 1, fp);
+	fwrite(record->entry, 1, record->len, fp);
+}
+
+static _Bool read_sort_record(struct sort_run *run)
+{
+	struct sort_record *record = &run->record;
+	if (fread(&record->domain, sizeof(record->domain), 1, run->fp) != 1 ||
+	    fread(&record->line, sizeof(record->line), 1, run->fp) != 1 ||
+	    fread(&record->len, sizeof(record->len), 1, run->fp) != 1 ||
+	    fread(&record->is_delete, sizeof(record->is_delete), 1, run->fp)
+	    != 1)
+		return false;
+	if (record->len >= run->buffer_size) {
+		run->buffer_size = record->len + 1;
+		run->buffer = realloc(run->buffer, run->buffer_size);
+		if (!run->buffer)
+			out_of_memory();
+	}
+	if (fread(run->buffer, 1, record->len, run->fp) != record->len)
+		return false;
+	run->buffer[record->len] = '\0';
+	record->entry = run->buffer;
+	return true;
+}
+
+/* Print domains which come before @domain, then the header of @domain. */
+static void print_sort_domains(const int domain)
+{
+	while (sort_order_pos < sort_order_len) {
+		const int index = sort_order[sort_order_pos];
+		if (!sort_order_opened) {
+			const struct path_info *domainname =
+				sort_domain_list[index].domainname;
+			policy_writer_write(&sort_writer, domainname->name,
+					    domainname->total_len);
+			policy_writer_write(&sort_writer, "\n\n", 2);
+			sort_order_opened = true;
+		}
+		if (index == domain)
+			return;
+		policy_writer_write(&sort_writer, "\n", 1);
+		sort_order_opened = false;
+		sort_order_pos++;
+	}
+}
+
+/*
+ * Handle the last record of an entry. It goes to @fp if not NULL, otherwise
+ * the entry is printed if it exists.
+ */
+static void emit_sort_record(const struct sort_record *record, FILE *fp)
+{
+	const struct sort_domain *domain = &sort_domain_list[record->domain];
+	if (fp) {
+		write_sort_record(fp, record);
+		return;
+	}
+	if (!domain->exists || record->is_delete ||
+	    record->line < domain->delete_line)
+		return;
+	print_sort_domains(record->domain);
+	policy_writer_write(&sort_writer, record->entry, record->len);
+	policy_writer_write(&sort_writer, "\n", 1);
+}
+
+/* Sort buffered records and write them to a new run. */
+static void spill_sort_records(void)
+{
+	FILE *fp;
+	u32 i;
+	if (!sort_record_list_len)
+		return;
+	qsort(sort_record_list, sort_record_list_len,
+	      sizeof(struct sort_record), sort_record_compare);
+	fp = open_sort_run();
+	for (i = 0; i < sort_record_list_len; i++)
+		if (i + 1 == sort_record_list_len ||
+		    !same_sort_key(&sort_record_list[i],
+				   &sort_record_list[i + 1]))
+			write_sort_record(fp, &sort_record_list[i]);
+	close_sort_run(fp);
+	sort_run_list = realloc(sort_run_list, (sort_run_list_len + 1) *
+				sizeof(FILE *));
+	if (!sort_run_list)
+		out_of_memory();
+	sort_run_list[sort_run_list_len++] = fp;
+	sort_record_list_len = 0;
+	sort_arena_len = 0;
+}
+
+static void add_sort_record(const int domain, const char *entry,
+			    const u64 line, const _Bool is_delete)
+{
+	const u32 len = strlen(entry);
+	struct sort_record *record;
+	if (sort_record_list_len == sort_record_list_size ||
+	    sort_arena_len + len + 1 > sort_arena_size)
+		spill_sort_records();
+	if (len + 1 > sort_arena_size) {
+		/* Nothing points to the arena after spilling. */
+		sort_arena_size = len + 1;
+		sort_arena = realloc(sort_arena, sort_arena_size);
+		if (!sort_arena)
+			out_of_memory();
+	}
+	record = &sort_record_list[sort_record_list_len++];
+	record->entry = sort_arena + sort_arena_len;
+	memcpy(sort_arena + sort_arena_len, entry, len + 1);
+	sort_arena_len += len + 1;
+	record->line = line;
+	record->domain = domain;
+	record->len = len;
+	record->is_delete = is_delete;
+}
+
+static int sort_run_compare(const struct sort_run *a, const struct sort_run *b)
+{
+	return sort_record_compare(&a->record, &b->record);
+}
+
+static void sift_sort_runs(struct sort_run **heap, const int len, int i)
+{
+	while (true) {
+		struct sort_run *run;
+		int child = i * 2 + 1;
+		if (child >= len)
+			break;
+		if (child + 1 < len &&
+		    sort_run_compare(heap[child + 1], heap[child]) < 0)
+			child++;
+		if (sort_run_compare(heap[i], heap[child]) <= 0)
+			break;
+		run = heap[i];
+		heap[i] = heap[child];
+		heap[child] = run;
+		i = child;
+	}
+}
+
+/*
+ * Merge and close @run_len runs in @run_list, passing the last record of each
+ * entry to emit_sort_record().
+ */
+static void merge_sort_runs(FILE **run_list, const int run_len, FILE *fp)
+{
+	struct sort_run *run = calloc(run_len + 1, sizeof(struct sort_run));
+	struct sort_run **heap = calloc(run_len + 1, sizeof(struct sort_run *));
+	struct sort_run last;
+	int heap_len = 0;
+	int i;
+	if (!run || !heap)
+		out_of_memory();
+	memset(&last, 0, sizeof(last));
+	for (i = 0; i < run_len; i++) {
+		run[i].fp = run_list[i];
+		if (read_sort_record(&run[i]))
+			heap[heap_len++] = &run[i];
+	}
+	for (i = heap_len / 2 - 1; i >= 0; i--)
+		sift_sort_runs(heap, heap_len, i);
+	while (heap_len) {
+		struct sort_run *top = heap[0];
+		if (last.record.entry &&
+		    !same_sort_key(&last.record, &top->record))
+			emit_sort_record(&last.record, fp);
+		/* Keep a copy, for the buffer of @top is reused. */
+		if (top->record.len >= last.buffer_size) {
+			last.buffer_size = top->record.len + 1;
+			last.buffer = realloc(last.buffer, last.buffer_size);
+			if (!last.buffer)
+				out_of_memory();
+		}
+		memcpy(last.buffer, top->record.entry, top->record.len + 1);
+		last.record = top->record;
+		last.record.entry = last.buffer;
+		if (!read_sort_record(top))
+			heap[0] = heap[--heap_len];
+		sift_sort_runs(heap, heap_len, 0);
+	}
+	if (last.record.entry)
+		emit_sort_record(&last.record, fp);
+	for (i = 0; i < run_len; i++) {
+		fclose(run[i].fp);
+		free(run[i].buffer);
+	}
+	free(last.buffer);
+	free(heap);
+	free(run);
+}
+
+/**
+ * sort_domain_policy_bounded - Sort domain policy within a memory budget.
+ *
+ * @max_memory: Bytes to use for buffering ACL entries.
+ *
+ * Reads standard input and writes the same as write_domain_policy() would
+ * write after read_domain_policy().
+ *
+ * Returns 0 on success, negative errno if standard output failed.
+ */
+static int sort_domain_policy_bounded(u64 max_memory)
+{
+	struct line_reader reader;
+	char *line;
+	u64 line_no = 0;
+	int index = EOF;
+	u32 i;
+	if (max_memory < SORTPOLICY_MIN_MEMORY)
+		max_memory = SORTPOLICY_MIN_MEMORY;
+	if (max_memory > (size_t) -1 / 2)
+		max_memory = (size_t) -1 / 2;
+	sort_arena_size = max_memory / 2;
+	sort_record_list_size = max_memory / 2 / sizeof(struct sort_record);
+	sort_arena = malloc(sort_arena_size);
+	sort_record_list = malloc(sort_record_list_size *
+				  sizeof(struct sort_record));
+	if (!sort_arena || !sort_record_list)
+		out_of_memory();
+	policy_writer_open(&sort_writer, 1);
+	line_reader_open(&reader, stdin, true);
+	while ((line = line_reader_next(&reader)) != NULL) {
+		_Bool is_delete = false;
+		_Bool is_select = false;
+		unsigned int profile;
+		line_no++;
+		if (str_starts(line, "delete "))
+			is_delete = true;
+		else if (str_starts(line, "select "))
+			is_select = true;
+		if (is_domain_def((unsigned char *) line)) {
+			if (is_delete || is_select) {
+				index = sort_domain_index(line, false);
+				if (index != EOF &&
+				    !sort_domain_list[index].exists)
+					index = EOF;
+				if (is_delete && index != EOF) {
+					sort_domain_list[index].exists = false;
+					sort_domain_list[index].delete_line
+						= line_no;
+					index = EOF;
+				}
+				continue;
+			}
+			if (!is_correct_domain((unsigned char *) line)) {
+				fprintf(stderr, "%s: Invalid domainname '%s'\n",
+					__func__, line);
+				index = EOF;
+				continue;
+			}
+			index = sort_domain_index(line, true);
+			sort_domain_list[index].exists = true;
+			continue;
+		}
+		if (index == EOF || !line[0] ||
+		    sscanf(line, KEYWORD_USE_PROFILE "%u", &profile) == 1)
+			continue;
+		add_sort_record(index, line, line_no, is_delete);
+	}
+	line_reader_close(&reader);
+
+	sort_order = malloc((sort_domain_list_len + 1) * sizeof(u32));
+	if (!sort_order)
+		out_of_memory();
+	for (i = 0; i < sort_domain_list_len; i++)
+		if (sort_domain_list[i].exists)
+			sort_order[sort_order_len++] = i;
+	qsort(sort_order, sort_order_len, sizeof(u32), sort_domain_compare);
+
+	if (!sort_run_list_len) {
+		/* Everything fit in memory. */
+		qsort(sort_record_list, sort_record_list_len,
+		      sizeof(struct sort_record), sort_record_compare);
+		for (i = 0; i < sort_record_list_len; i++)
+			if (i + 1 == sort_record_list_len ||
+			    !same_sort_key(&sort_record_list[i],
+					   &sort_record_list[i + 1]))
+				emit_sort_record(&sort_record_list[i], NULL);
+	} else {
+		spill_sort_records();
+		free(sort_arena);
+		free(sort_record_list);
+		sort_arena = NULL;
+		sort_record_list = NULL;
+		while (sort_run_list_len > SORTPOLICY_MERGE_WAYS) {
+			FILE *fp = open_sort_run();
+			merge_sort_runs(sort_run_list, SORTPOLICY_MERGE_WAYS,
+					fp);
+			close_sort_run(fp);
+			sort_run_list_len -= SORTPOLICY_MERGE_WAYS;
+			memmove(sort_run_list,
+				sort_run_list + SORTPOLICY_MERGE_WAYS,
+				sort_run_list_len * sizeof(FILE *));
+			sort_run_list[sort_run_list_len++] = fp;
+		}
+		merge_sort_runs(sort_run_list, sort_run_list_len, NULL);
+	}
+	print_sort_domains(EOF);
+	free(sort_order);
+	free(sort_run_list);
+	free(sort_arena);
+	free(sort_record_list);
+	free(sort_domain_list);
+	clear_name_map(&sort_domain_map);
+	return policy_writer_close(&sort_writer);
+}
+
 int sortpolicy_main(int argc, char *argv[])
 {
 	struct domain_policy dp = { NULL, 0, NULL };
-	read_domain_policy(&dp, NULL);
-	write_domain_policy(&dp, 1);
-	clear_domain_policy(&dp);
+	u64 max_memory = 0;
+	int ret;
+	int i;
+	for (i = 1; i < argc; i++) {
+		char *ptr = argv[i];
+		if (!str_starts(ptr, "--max-memory="))
+			continue;
+		max_memory = parse_memory_size(ptr);
+		if (!max_memory) {
+			fprintf(stderr, "Usage: %s [--max-memory=size[KMG]] "
+				"< domain_policy\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_memory) {
+		ret = sort_domain_policy_bounded(max_memory);
+	} else {
+		read_domain_policy(&dp, NULL);
+		ret = write_domain_policy(&dp, 1);
+		clear_domain_policy(&dp);
+	}
+	if (ret) {
+		fprintf(stderr, "Can't write domain policy: %s\n",
+			strerror(-ret));
+		return 1;
+	}
 	return 0;
 }
 
@@ -101,7 +574,6 @@ int savepolicy_main(int argc, char *argv[])
 {
 	struct domain_policy dp = { NULL, 0, NULL };
 	struct domain_policy bp = { NULL, 0, NULL };
-	char *filename;
 	_Bool write_to_stdout = false;
 	int save_profile = 0;
 	int save_manager = 0;
@@ -232,53 +704,23 @@ int savepolicy_main(int argc, char *argv[])
 		move_proc_to_file(proc_policy_manager, BASE_POLICY_MANAGER,
 				  DISK_POLICY_MANAGER);
 
-	if (save_system_policy) {
-		filename = make_filename("system_policy", now);
-		if (move_proc_to_file(proc_policy_system_policy,
-				      BASE_POLICY_SYSTEM_POLICY, filename)
-		    && !write_to_stdout) {
-			if (!force_save &&
-			    is_identical_file("system_policy.conf", filename)) {
-				unlink(filename);
-			} else {
-				unlink("system_policy.conf");
-				symlink(filename, "system_policy.conf");
-			}
-		}
-	}
+	if (save_system_policy)
+		move_proc_to_store(proc_policy_system_policy,
+				   BASE_POLICY_SYSTEM_POLICY, "system_policy",
+				   now, force_save);
 
-	if (save_exception_policy) {
-		filename = make_filename("exception_policy", now);
-		if (move_proc_to_file(proc_policy_exception_policy,
-				      BASE_POLICY_EXCEPTION_POLICY, filename)
-		    && !write_to_stdout) {
-			if (!force_save &&
-			    is_identical_file("exception_policy.conf",
-					      filename)) {
-				unlink(filename);
-			} else {
-				unlink("exception_policy.conf");
-				symlink(filename, "exception_policy.conf");
-			}
-		}
-	}
+	if (save_exception_policy)
+		move_proc_to_store(proc_policy_exception_policy,
+				   BASE_POLICY_EXCEPTION_POLICY,
+				   "exception_policy", now, force_save);
 
-	if (save_domain_policy) {
-		filename = make_filename("domain_policy", now);
-		if (save_domain_policy_with_diff(&dp, &bp,
-						 proc_policy_domain_policy,
-						 BASE_POLICY_DOMAIN_POLICY,
-						 filename)
-		    && !write_to_stdout) {
-			if (!force_save &&
-			    is_identical_file("domain_policy.conf", filename)) {
-				unlink(filename);
-			} else {
-				unlink("domain_policy.conf");
-				symlink(filename, "domain_policy.conf");
-			}
-		}
-	}
+	if (save_domain_policy &&
+	    save_domain_policy_to_store(&dp, &bp, proc_policy_domain_policy,
+					BASE_POLICY_DOMAIN_POLICY, now,
+					force_save))
+		write_domain_snapshot(&dp, SNAPSHOT_DOMAIN_POLICY,
+				      BASE_POLICY_DOMAIN_POLICY,
+				      DISK_POLICY_DOMAIN_POLICY);
 done:
 	return 0;
 usage:
@@ -302,14 +744,234 @@ usage:
 
 /***** savepolicy end *****/
 
+/***** restorepolicy start *****/
+
+int restorepolicy_main(int argc, char *argv[])
+{
+	FILE *fp = stdout;
+	_Bool result;
+	if (argc != 2 && argc != 3) {
+		printf("%s manifest [output]\n"
+		       "Rebuild policy saved by savepolicy from manifest, "
+		       "which is in " STORE_DIR " directory of policy_dir.\n"
+		       "Policy is written to stdout if output is not given."
+		       "\n", argv[0]);
+		return 0;
+	}
+	if (argc == 3) {
+		fp = fopen(argv[2], "w");
+		if (!fp) {
+			fprintf(stderr, "Can't open %s\n", argv[2]);
+			return 1;
+		}
+	}
+	result = restore_policy_store(argv[1], fp);
+	if (fclose(fp))
+		result = false;
+	return !result;
+}
+
+/***** restorepolicy end *****/
+
 /***** loadpolicy start *****/
 
+static enum load_check_mode load_check_mode = LOAD_CHECK_NONE;
+static _Bool check_skip_domain = false; /* Selected domain was rejected. */
+static char *held_lines = NULL;         /* Lines waiting for the check.  */
+static size_t held_lines_len = 0;
+static size_t held_lines_size = 0;
+
+static int policy_type_of(const char *dest)
+{
+	if (!strcmp(dest, proc_policy_domain_policy))
+		return POLICY_TYPE_DOMAIN_POLICY;
+	if (!strcmp(dest, proc_policy_exception_policy))
+		return POLICY_TYPE_EXCEPTION_POLICY;
+	if (!strcmp(dest, proc_policy_system_policy))
+		return POLICY_TYPE_SYSTEM_POLICY;
+	return POLICY_TYPE_UNKNOWN;
+}
+
+static void hold_line(const char *data, const size_t len)
+{
+	if (held_lines_len + len + 1 > held_lines_size) {
+		while (held_lines_len + len + 1 > held_lines_size)
+			held_lines_size = held_lines_size ?
+				held_lines_size * 2 : 65536;
+		held_lines = realloc(held_lines, held_lines_size);
+		if (!held_lines)
+			out_of_memory();
+	}
+	memcpy(held_lines + held_lines_len, data, len);
+	held_lines_len += len;
+	held_lines[held_lines_len++] = '\n';
+}
+
+/*
+ * Check @data, a normalized line numbered @line_no, as @policy_type. @copy
+ * is a scratch buffer for the checkers, which modify what they parse.
+ * Returns true if the line may be loaded.
+ */
+static _Bool check_load_line(const int policy_type, const char *data,
+			     const unsigned int line_no, char **copy,
+			     size_t *copy_size)
+{
+	const size_t len = strlen(data);
+	_Bool selects = false;
+	_Bool accepted;
+	if (policy_type == POLICY_TYPE_DOMAIN_POLICY) {
+		const char *cp = data;
+		if (!strncmp(cp, KEYWORD_DELETE, sizeof(KEYWORD_DELETE) - 1))
+			cp += sizeof(KEYWORD_DELETE) - 1;
+		selects = is_domain_def((const unsigned char *) cp) ||
+			!strncmp(cp, KEYWORD_SELECT,
+				 sizeof(KEYWORD_SELECT) - 1);
+		/* Lines after a rejected domain would go to another one. */
+		if (!selects && check_skip_domain) {
+			printf("%u: ERROR: Skipped, for the domain was "
+			       "rejected.\n", line_no);
+			return false;
+		}
+	}
+	if (len >= *copy_size) {
+		*copy_size = len + 1;
+		*copy = realloc(*copy, *copy_size);
+		if (!*copy)
+			out_of_memory();
+	}
+	memcpy(*copy, data, len + 1);
+	accepted = !check_policy_line(policy_type, *copy, line_no);
+	if (selects)
+		check_skip_domain = !accepted;
+	return accepted;
+}
+
+/*
+ * Check lines read from @fp as @policy_type, reporting errors with line
+ * numbers under @name. Accepted lines go to @writer, or to held_lines if
+ * @writer is NULL. Returns the number of rejected lines.
+ */
+static unsigned int load_checked_lines(FILE *fp, const char *name,
+				       const int policy_type,
+				       struct policy_writer *writer)
+{
+	struct line_reader reader;
+	char *copy = NULL;
+	size_t copy_size = 0;
+	unsigned int line_no = 0;
+	unsigned int rejected = 0;
+	char *data;
+	line_reader_open(&reader, fp, true);
+	while ((data = line_reader_next(&reader)) != NULL) {
+		size_t len;
+		line_no++;
+		if (!data[0])
+			continue;
+		if (!check_load_line(policy_type, data, line_no, &copy,
+				     &copy_size)) {
+			rejected++;
+			continue;
+		}
+		len = strlen(data);
+		if (!writer) {
+			hold_line(data, len);
+			continue;
+		}
+		policy_writer_write(writer, data, len);
+		policy_writer_write(writer, "\n", 1);
+	}
+	if (reader.partial) {
+		printf("%u: ERROR: Missing newline at end of input.\n",
+		       line_no + 1);
+		rejected++;
+	}
+	line_reader_close(&reader);
+	free(copy);
+	if (rejected)
+		printf("%s: %u line%s rejected.\n", name, rejected,
+		       rejected > 1 ? "s" : "");
+	return rejected;
+}
+
+/*
+ * Load @base and @src (standard input if @src is NULL) into @dest, checking
+ * each line once on the way. Accepted lines are written in large batches
+ * while reading, or all at once after reading with LOAD_CHECK_ABORT, which
+ * writes nothing if any line is rejected.
+ */
+static void check_file_to_proc(const char *base, const char *src,
+			       const char *dest, const int policy_type)
+{
+	struct policy_writer writer;
+	struct policy_writer *wp = NULL;
+	FILE *file_fp = stdin;
+	FILE *base_fp;
+	FILE *proc_fp = NULL;
+	unsigned int rejected = 0;
+	int error;
+	if (src) {
+		file_fp = fopen(src, "r");
+		if (!file_fp) {
+			fprintf(stderr, "Can't open %s\n", src);
+			return;
+		}
+	}
+	if (load_check_mode == LOAD_CHECK_SKIP) {
+		proc_fp = open_write(dest);
+		if (!proc_fp) {
+			fprintf(stderr, "Can't open %s\n", dest);
+			goto out;
+		}
+		policy_writer_open(&writer, fileno(proc_fp));
+		wp = &writer;
+	}
+	check_skip_domain = false;
+	base_fp = base ? fopen(base, "r") : NULL;
+	if (base_fp) {
+		rejected += load_checked_lines(base_fp, base, policy_type, wp);
+		fclose(base_fp);
+	}
+	rejected += load_checked_lines(file_fp, src ? src : "stdin",
+				       policy_type, wp);
+	if (!wp) {
+		if (rejected) {
+			printf("%s is not loaded.\n", dest);
+			goto out;
+		}
+		proc_fp = open_write(dest);
+		if (!proc_fp) {
+			fprintf(stderr, "Can't open %s\n", dest);
+			goto out;
+		}
+		policy_writer_open(&writer, fileno(proc_fp));
+		policy_writer_write(&writer, held_lines, held_lines_len);
+	}
+	error = policy_writer_close(&writer);
+	if (error)
+		fprintf(stderr, "Can't write %s: %s\n", dest,
+			strerror(-error));
+	close_write(proc_fp);
+out:
+	free(held_lines);
+	held_lines = NULL;
+	held_lines_len = 0;
+	held_lines_size = 0;
+	if (file_fp != stdin)
+		fclose(file_fp);
+}
+
 static void move_file_to_proc(const char *base, const char *src,
 			      const char *dest)
 {
 	FILE *file_fp = stdin;
 	FILE *base_fp;
-	FILE *proc_fp = open_write(dest);
+	FILE *proc_fp;
+	if (load_check_mode != LOAD_CHECK_NONE &&
+	    policy_type_of(dest) != POLICY_TYPE_UNKNOWN) {
+		check_file_to_proc(base, src, dest, policy_type_of(dest));
+		return;
+	}
+	proc_fp = open_write(dest);
 	if (!proc_fp) {
 		fprintf(stderr, "Can't open %s\n", dest);
 		return;
@@ -341,31 +1003,174 @@ static void move_file_to_proc(const char *base, const char *src,
 		fclose(file_fp);
 }
 
-static void delete_proc_policy(const char *name)
+/*
+ * Add lines read from @fp to @list, which has room for @list_size entries,
+ * skipping empty lines and lines which already have @flag set in @map. Unless @policy_type is
+ * POLICY_TYPE_UNKNOWN, lines are checked first and rejected ones are
+ * reported under @name and skipped. Returns the number of rejected lines.
+ */
+static unsigned int read_policy_lines(FILE *fp, struct name_map *map,
+				      const int flag,
+				      const struct path_info ***list,
+				      int *list_len, int *list_size,
+				      const int policy_type, const char *name)
 {
-	FILE *fp_in;
-	FILE *fp_out;
-	if (network_mode) {
-		fp_in = open_read(name);
-		fp_out = open_write(name);
-	} else {
-		fp_in = fopen(name, "r");
-		fp_out = fopen(name, "w");
-	}
-	if (!fp_in || !fp_out) {
-		fprintf(stderr, "Can't open %s\n", name);
-		if (fp_in)
-			fclose(fp_in);
-		if (fp_out)
-			fclose(fp_out);
-		return;
-	}
+	char *copy = NULL;
+	size_t copy_size = 0;
+	unsigned int line_no = 0;
+	unsigned int rejected = 0;
 	get();
-	while (freadline(fp_in))
-		fprintf(fp_out, "delete %s\n", shared_buffer);
+	while (freadline(fp)) {
+		const struct path_info *line;
+		int *flags;
+		line_no++;
+		if (!shared_buffer[0])
+			continue;
+		if (policy_type != POLICY_TYPE_UNKNOWN &&
+		    !check_load_line(policy_type, shared_buffer, line_no,
+				     &copy, &copy_size)) {
+			rejected++;
+			continue;
+		}
+		line = savename(shared_buffer);
+		if (!line)
+			out_of_memory();
+		flags = name_map_value(map, line, true);
+		if (*flags & flag)
+			continue;
+		*flags |= flag;
+		if (*list_len == *list_size) {
+			*list_size = *list_size ? *list_size * 2 : 64;
+			*list = realloc(*list, *list_size * sizeof(**list));
+			if (!*list)
+				out_of_memory();
+		}
+		(*list)[(*list_len)++] = line;
+	}
 	put();
-	fclose(fp_in);
-	close_write(fp_out);
+	free(copy);
+	if (rejected)
+		printf("%s: %u line%s rejected.\n", name, rejected,
+		       rejected > 1 ? "s" : "");
+	return rejected;
+}
+
+/*
+ * Bring line oriented policy @dest up to date with @base and @src (standard
+ * input if @src is NULL), writing "delete " only for lines which are gone and
+ * writing only lines which are new. Lines which are in both stay loaded all
+ * the time.
+ */
+static void update_misc_policy(const char *base, const char *src,
+			       const char *dest)
+{
+	struct name_map map;
+	const struct path_info **proc_list = NULL;
+	const struct path_info **file_list = NULL;
+	int proc_list_len = 0;
+	int proc_list_size = 0;
+	int file_list_len = 0;
+	int file_list_size = 0;
+	FILE *file_fp = stdin;
+	FILE *fp;
+	const int policy_type = load_check_mode == LOAD_CHECK_NONE ?
+		POLICY_TYPE_UNKNOWN : policy_type_of(dest);
+	unsigned int rejected = 0;
+	int i;
+	memset(&map, 0, sizeof(map));
+	if (src) {
+		file_fp = fopen(src, "r");
+		if (!file_fp) {
+			fprintf(stderr, "Can't open %s\n", src);
+			return;
+		}
+	}
+	fp = base ? fopen(base, "r") : NULL;
+	if (fp) {
+		rejected += read_policy_lines(fp, &map, 2, &file_list,
+					      &file_list_len, &file_list_size,
+					      policy_type, base);
+		fclose(fp);
+	}
+	rejected += read_policy_lines(file_fp, &map, 2, &file_list,
+				      &file_list_len, &file_list_size,
+				      policy_type, src ? src : "stdin");
+	if (file_fp != stdin)
+		fclose(file_fp);
+	if (rejected && load_check_mode == LOAD_CHECK_ABORT) {
+		printf("%s is not loaded.\n", dest);
+		goto out;
+	}
+	fp = network_mode ? open_read(dest) : fopen(dest, "r");
+	if (fp) {
+		read_policy_lines(fp, &map, 1, &proc_list, &proc_list_len,
+				  &proc_list_size, POLICY_TYPE_UNKNOWN, dest);
+		fclose(fp);
+		fp = open_write(dest);
+	}
+	if (!fp) {
+		fprintf(stderr, "Can't open %s\n", dest);
+		goto out;
+	}
+	/* Delete first, for the kernel may print a line differently. */
+	for (i = 0; i < proc_list_len; i++)
+		if (!(*name_map_value(&map, proc_list[i], false) & 2))
+			fprintf(fp, "delete %s\n", proc_list[i]->name);
+	for (i = 0; i < file_list_len; i++)
+		if (!(*name_map_value(&map, file_list[i], false) & 1))
+			fprintf(fp, "%s\n", file_list[i]->name);
+	close_write(fp);
+out:
+	free(proc_list);
+	free(file_list);
+	clear_name_map(&map);
+}
+
+/*
+ * Read @base and @src (standard input if @src is NULL) into @dp, checking
+ * each line as check_file_to_proc() does. Returns false if nothing may be
+ * loaded.
+ */
+static _Bool read_checked_domain_policy(struct domain_policy *dp,
+				       const char *base, const char *src)
+{
+	FILE *file_fp = stdin;
+	FILE *fp;
+	unsigned int rejected = 0;
+	_Bool loaded = false;
+	if (src) {
+		file_fp = fopen(src, "r");
+		if (!file_fp) {
+			fprintf(stderr, "Can't open %s\n", src);
+			return false;
+		}
+	}
+	check_skip_domain = false;
+	fp = base ? fopen(base, "r") : NULL;
+	if (fp) {
+		rejected += load_checked_lines(fp, base,
+					       POLICY_TYPE_DOMAIN_POLICY, NULL);
+		fclose(fp);
+	}
+	rejected += load_checked_lines(file_fp, src ? src : "stdin",
+				       POLICY_TYPE_DOMAIN_POLICY, NULL);
+	if (file_fp != stdin)
+		fclose(file_fp);
+	if (rejected && load_check_mode == LOAD_CHECK_ABORT)
+		goto out;
+	fp = held_lines_len ? fmemopen(held_lines, held_lines_len, "r") : NULL;
+	if (fp) {
+		handle_domain_policy(dp, fp, true);
+		fclose(fp);
+	}
+	sort_domain_policy(dp);
+	loaded = true;
+out:
+	free(held_lines);
+	held_lines = NULL;
+	held_lines_len = 0;
+	held_lines_size = 0;
+	return loaded;
 }
 
 static void update_domain_policy(struct domain_policy *proc_policy,
@@ -375,13 +1180,24 @@ static void update_domain_policy(struct domain_policy *proc_policy,
 {
 	int base_index;
 	int proc_index;
+	_Bool *proc_is_used;
 	FILE *proc_fp;
 	_Bool nm = network_mode;
 	/* Load base and diff policy to file_policy->list. */
 	network_mode = false;
-	if (base && !access(base, R_OK))
-		read_domain_policy(file_policy, base);
-	read_domain_policy(file_policy, src);
+	if (load_check_mode != LOAD_CHECK_NONE) {
+		if (!read_checked_domain_policy(file_policy, base, src)) {
+			network_mode = nm;
+			printf("%s is not loaded.\n", dest);
+			return;
+		}
+	} else if (!src || !read_domain_snapshot(file_policy,
+						 SNAPSHOT_DOMAIN_POLICY,
+						 base, src)) {
+		if (base && !access(base, R_OK))
+			read_domain_policy(file_policy, base);
+		read_domain_policy(file_policy, src);
+	}
 	network_mode = nm;
 	/* Load proc policy to proc_policy->list. */
 	read_domain_policy(proc_policy, dest);
@@ -390,49 +1206,61 @@ static void update_domain_policy(struct domain_policy *proc_policy,
 		fprintf(stderr, "Can't open %s\n", dest);
 		return;
 	}
+	proc_is_used = calloc(proc_policy->list_len + 1, sizeof(_Bool));
+	if (!proc_is_used)
+		out_of_memory();
+	/*
+	 * Both policies are sorted by domainname, so pair domains with one
+	 * merge walk and write only the difference.
+	 */
+	proc_index = 0;
 	for (base_index = 0; base_index < file_policy->list_len; base_index++) {
 		int i;
-		int j;
-		const struct path_info *domainname
-			= file_policy->list[base_index].domainname;
-		const u8 profile = file_policy->list[base_index].profile;
-		const struct path_info **base_string_ptr
-			= file_policy->list[base_index].string_ptr;
-		const int base_string_count
-			= file_policy->list[base_index].string_count;
-		const struct path_info **proc_string_ptr;
-		int proc_string_count;
-		proc_index = find_domain_by_ptr(proc_policy, domainname);
-		fprintf(proc_fp, "%s\n", domainname->name);
-		if (proc_index == EOF)
-			goto not_found;
-
-		/* Proc policy for this domain found. */
-		proc_string_ptr = proc_policy->list[proc_index].string_ptr;
-		proc_string_count = proc_policy->list[proc_index].string_count;
-		for (j = 0; j < proc_string_count; j++) {
-			for (i = 0; i < base_string_count; i++) {
-				if (base_string_ptr[i] == proc_string_ptr[j])
-					break;
-			}
-			/* Delete this entry from proc policy if not found
-			   in base policy. */
-			if (i == base_string_count)
-				fprintf(proc_fp, "delete %s\n",
-					proc_string_ptr[j]->name);
+		const struct domain_info *base_domain
+			= &file_policy->list[base_index];
+		const struct domain_info *proc_domain = NULL;
+		const struct path_info *domainname = base_domain->domainname;
+		_Bool first = true;
+		while (proc_index < proc_policy->list_len &&
+		       strcmp(proc_policy->list[proc_index].domainname->name,
+			      domainname->name) < 0)
+			proc_index++;
+		if (proc_index < proc_policy->list_len &&
+		    proc_policy->list[proc_index].domainname == domainname) {
+			proc_domain = &proc_policy->list[proc_index];
+			proc_is_used[proc_index] = true;
+		}
+		if (!proc_domain) {
+			/* Append entries defined in base policy. */
+			fprintf(proc_fp, "%s\n", domainname->name);
+			for (i = 0; i < base_domain->string_count; i++)
+				fprintf(proc_fp, "%s\n",
+					base_domain->string_ptr[i]->name);
+			fprintf(proc_fp, "use_profile %u\n",
+				base_domain->profile);
+			continue;
+		}
+		/* Delete entries from proc policy if not in base policy. */
+		print_missing_entries(proc_fp, "delete ", proc_domain,
+				      base_domain, "", &first);
+		/* Append entries defined only in base policy. */
+		print_missing_entries(proc_fp, "", base_domain, proc_domain,
+				      "", &first);
+		if (proc_domain->profile != base_domain->profile) {
+			if (first)
+				fprintf(proc_fp, "%s\n", domainname->name);
+			fprintf(proc_fp, "use_profile %u\n",
+				base_domain->profile);
 		}
-		delete_domain(proc_policy, proc_index);
-not_found:
-		/* Append entries defined in base policy. */
-		for (i = 0; i < base_string_count; i++)
-			fprintf(proc_fp, "%s\n", base_string_ptr[i]->name);
-		fprintf(proc_fp, "use_profile %u\n", profile);
 	}
 	/* Delete all domains that are not defined in base policy. */
 	for (proc_index = 0; proc_index < proc_policy->list_len; proc_index++) {
+		if (proc_is_used[proc_index])
+			continue;
 		fprintf(proc_fp, "delete %s\n",
 			proc_policy->list[proc_index].domainname->name);
 	}
+	free(proc_is_used);
 	close_write(proc_fp);
 }
 
@@ -483,6 +1311,8 @@ int loadpolicy_main(int argc, char *argv[])
 		char *m = strchr(ptr, 'm');
 		char *u = strchr(ptr, 'u');
 		char *i = strchr(ptr, '-');
+		char *c = strchr(ptr, 'c');
+		char *k = strchr(ptr, 'k');
 		if (s || a)
 			load_system_policy = 1;
 		if (e || a)
@@ -499,7 +1329,11 @@ int loadpolicy_main(int argc, char *argv[])
 			refresh_policy = true;
 		if (i)
 			read_from_stdin = true;
-		if (strcspn(ptr, "sedafpmu-"))
+		if (c)
+			load_check_mode = LOAD_CHECK_ABORT;
+		if (k)
+			load_check_mode = LOAD_CHECK_SKIP;
+		if ((c && k) || strcspn(ptr, "sedafpmuck-"))
 			goto usage;
 	}
 	if (!read_from_stdin && !policy_dir)
@@ -549,27 +1383,43 @@ int loadpolicy_main(int argc, char *argv[])
 	}
 
 	if (load_system_policy) {
-		if (refresh_policy)
-			delete_proc_policy(proc_policy_system_policy);
-		if (read_from_stdin)
-			move_file_to_proc(NULL, NULL,
-					  proc_policy_system_policy);
-		else
-			move_file_to_proc(BASE_POLICY_SYSTEM_POLICY,
-					  DISK_POLICY_SYSTEM_POLICY,
-					  proc_policy_system_policy);
+		if (refresh_policy) {
+			if (read_from_stdin)
+				update_misc_policy(NULL, NULL,
+						   proc_policy_system_policy);
+			else
+				update_misc_policy(BASE_POLICY_SYSTEM_POLICY,
+						   DISK_POLICY_SYSTEM_POLICY,
+						   proc_policy_system_policy);
+		} else {
+			if (read_from_stdin)
+				move_file_to_proc(NULL, NULL,
+						  proc_policy_system_policy);
+			else
+				move_file_to_proc(BASE_POLICY_SYSTEM_POLICY,
+						  DISK_POLICY_SYSTEM_POLICY,
+						  proc_policy_system_policy);
+		}
 	}
 
 	if (load_exception_policy) {
-		if (refresh_policy)
-			delete_proc_policy(proc_policy_exception_policy);
-		if (read_from_stdin)
-			move_file_to_proc(NULL, NULL,
-					  proc_policy_exception_policy);
-		else
-			move_file_to_proc(BASE_POLICY_EXCEPTION_POLICY,
-					  DISK_POLICY_EXCEPTION_POLICY,
-					  proc_policy_exception_policy);
+		if (refresh_policy) {
+			if (read_from_stdin)
+				update_misc_policy(NULL, NULL,
+					proc_policy_exception_policy);
+			else
+				update_misc_policy(BASE_POLICY_EXCEPTION_POLICY,
+						   DISK_POLICY_EXCEPTION_POLICY,
+					proc_policy_exception_policy);
+		} else {
+			if (read_from_stdin)
+				move_file_to_proc(NULL, NULL,
+						  proc_policy_exception_policy);
+			else
+				move_file_to_proc(BASE_POLICY_EXCEPTION_POLICY,
+						  DISK_POLICY_EXCEPTION_POLICY,
+						  proc_policy_exception_policy);
+		}
 	}
 
 	if (load_domain_policy) {
@@ -597,7 +1447,7 @@ int loadpolicy_main(int argc, char *argv[])
 	}
 	return 0;
 usage:
-	printf("%s [s][e][d][a][f][p][m][u] [{-|policy_dir} "
+	printf("%s [s][e][d][a][f][p][m][u][c|k] [{-|policy_dir} "
 	       "[remote_ip:remote_port]]\n"
 	       "s : Load system_policy.\n"
 	       "e : Load exception_policy.\n"
@@ -608,7 +1458,11 @@ usage:
 	       "u : Load meminfo.\n"
 	       "- : Read policy from stdin. "
 	       "(Only one of 'sedpmu' is possible when using '-'.)\n"
-	       "f : Delete on-memory policy before loading on-disk policy. "
+	       "f : Replace on-memory policy with on-disk policy, writing "
+	       "only the differences. (Valid for 'sed'.)\n"
+	       "c : Check policy while loading and load nothing if an error "
+	       "is found. (Valid for 'sed'.)\n"
+	       "k : Check policy while loading and skip lines with errors. "
 	       "(Valid for 'sed'.)\n\n",
 	       argv[0]);
 	return 0;
@@ -49,34 +49,33 @@ static _Bool path_contains_pattern(const char *filename)
 	return false;
 }
 
-static const char *patternize(const char *cp, int argc, char *argv[],
-			      struct path_info *pattern_list)
+static const char *patternize(const char *cp, char *argv[],
+			      const struct pattern_index *index)
 {
 	int i;
 	struct path_info cp2;
 	cp2.name = cp;
 	fill_path_info(&cp2);
-	for (i = 1; i < argc; i++) {
-		if (path_matches_pattern(&cp2, &pattern_list[i]))
-			return argv[i];
-	}
-	return cp;
+	i = pattern_index_find(index, &cp2);
+	return i != EOF ? argv[i] : cp;
 }
 
 int patternize_main(int argc, char *argv[])
 {
+	struct pattern_index index;
+	struct line_reader reader;
+	char *line;
 	int i;
-	struct path_info *pattern_list
-		= malloc(argc * sizeof(struct path_info));
-	if (!pattern_list)
-		out_of_memory();
-	for (i = 0; i < argc; i++) {
-		pattern_list[i].name = argv[i];
-		fill_path_info(&pattern_list[i]);
+	memset(&index, 0, sizeof(index));
+	for (i = 1; i < argc; i++) {
+		struct path_info pattern;
+		pattern.name = argv[i];
+		fill_path_info(&pattern);
+		pattern_index_add(&index, &pattern, i);
 	}
-	get();
-	while (freadline(stdin)) {
-		char *sp = shared_buffer;
+	line_reader_open(&reader, stdin, true);
+	while ((line = line_reader_next(&reader)) != NULL) {
+		char *sp = line;
 		const char *cp;
 		_Bool first = true;
 		u8 count = 0;
@@ -109,7 +108,7 @@ int patternize_main(int argc, char *argv[])
 					count = 0;
 			} else if (count && count-- && *cp != '@' &&
 				   !path_contains_pattern(cp)) {
-				cp = patternize(cp, argc, argv, pattern_list);
+				cp = patternize(cp, argv, &index);
 			}
 			if (!first)
 				putchar(' ');
@@ -118,7 +117,7 @@ int patternize_main(int argc, char *argv[])
 		}
 		putchar('\n');
 	}
-	put();
-	free(pattern_list);
+	line_reader_close(&reader);
+	clear_pattern_index(&index);
 	return 0;
 }